@@ -0,0 +1,344 @@
+"""
+Benchmarks for the hot paths of the pyndri extension.
+
+Generates a synthetic Indri repository of configurable size (unless an
+existing repository is passed using --index), runs the selected benchmarks
+and writes the results as JSON, such that they can be tracked across
+versions.
+
+Usage:
+    python benchmarks/pyndri_benchmarks.py --num_documents 100000 \\
+        --output results.json
+"""
+
+import argparse
+import gc
+import itertools
+import json
+import logging
+import os
+import platform
+import random
+import resource
+import shutil
+import sys
+import tempfile
+import time
+import tracemalloc
+
+import pyndri
+import pyndri.utils
+
+
+def get_pyndri_version():
+    try:
+        from importlib import metadata
+    except ImportError:
+        return None
+
+    try:
+        return metadata.version('pyndri')
+    except metadata.PackageNotFoundError:
+        return None
+
+
+def make_vocabulary(vocabulary_size, rng):
+    alphabet = 'abcdefghijklmnopqrstuvwxyz'
+
+    vocabulary = set()
+
+    while len(vocabulary) < vocabulary_size:
+        vocabulary.add(''.join(
+            rng.choice(alphabet) for _ in range(rng.randint(3, 10))))
+
+    return sorted(vocabulary)
+
+
+def generate_corpus(path, num_documents, document_length,
+                    vocabulary, rng):
+    """Writes a TREC text corpus with Zipfian term frequencies."""
+    cum_weights = list(itertools.accumulate(
+        1.0 / rank for rank in range(1, len(vocabulary) + 1)))
+
+    with open(path, 'w', encoding='latin1') as f:
+        for doc_idx in range(num_documents):
+            length = max(1, int(rng.expovariate(1.0 / document_length)))
+
+            f.write('<DOC>\n<DOCNO>doc{}</DOCNO>\n<TEXT>\n'.format(doc_idx))
+            f.write(' '.join(rng.choices(
+                vocabulary, cum_weights=cum_weights, k=length)))
+            f.write('\n</TEXT>\n</DOC>\n')
+
+
+def percentiles(latencies):
+    latencies = sorted(latencies)
+
+    def percentile(p):
+        idx = min(int(round(p / 100.0 * (len(latencies) - 1))),
+                  len(latencies) - 1)
+
+        return latencies[idx]
+
+    return {
+        'p50_ms': percentile(50) * 1e3,
+        'p90_ms': percentile(90) * 1e3,
+        'p99_ms': percentile(99) * 1e3,
+        'max_ms': latencies[-1] * 1e3,
+        'mean_ms': sum(latencies) / len(latencies) * 1e3,
+    }
+
+
+def time_calls(fn, args_list):
+    latencies = []
+
+    start = time.perf_counter()
+
+    for args in args_list:
+        call_start = time.perf_counter()
+        fn(*args)
+        latencies.append(time.perf_counter() - call_start)
+
+    elapsed = time.perf_counter() - start
+
+    result = percentiles(latencies)
+    result['calls'] = len(args_list)
+    result['throughput_per_s'] = len(args_list) / elapsed
+
+    return result
+
+
+def make_queries(index, num_queries, rng):
+    token2id, id2token, id2df = index.get_dictionary()
+
+    # Sample query terms from the frequent part of the vocabulary, such
+    # that queries match a reasonable number of documents.
+    frequent_terms = sorted(id2df, key=id2df.get, reverse=True)[:1000]
+
+    return [
+        ' '.join(id2token[term_id] for term_id in rng.sample(
+            frequent_terms, rng.randint(1, 4)))
+        for _ in range(num_queries)]
+
+
+def benchmark_query(index, args, rng):
+    queries = make_queries(index, args.num_queries, rng)
+
+    query_env = pyndri.QueryEnvironment(
+        index, rules=('method:dirichlet,mu:2500',))
+    prf_query_env = pyndri.PRFQueryEnvironment(query_env)
+
+    results_requested = args.results_requested
+
+    return {
+        'query': time_calls(
+            lambda q: query_env.query(
+                q, results_requested=results_requested),
+            [(q,) for q in queries]),
+        'query_prf': time_calls(
+            lambda q: prf_query_env.query(
+                q, results_requested=results_requested),
+            [(q,) for q in queries]),
+        'query_snippets': time_calls(
+            lambda q: query_env.query(
+                q, results_requested=min(results_requested, 100),
+                include_snippets=True),
+            [(q,) for q in queries]),
+    }
+
+
+def benchmark_document(index, args, rng):
+    int_doc_ids = [
+        (rng.randrange(index.document_base(), index.maximum_document()),)
+        for _ in range(args.num_lookups)]
+
+    return {
+        'document': time_calls(index.document, int_doc_ids),
+        'ext_document_id': time_calls(index.ext_document_id, int_doc_ids),
+    }
+
+
+def benchmark_scan(index, args, rng):
+    def scan_document():
+        for int_doc_id in range(index.document_base(),
+                                index.maximum_document()):
+            index.document(int_doc_id)
+
+    def scan_iter_documents():
+        for _ in index.iter_documents():
+            pass
+
+    return {
+        'scan_document': time_calls(scan_document, [()]),
+        'scan_iter_documents': time_calls(scan_iter_documents, [()]),
+    }
+
+
+def benchmark_dictionary(index, args, rng):
+    gc.collect()
+
+    max_rss_before = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+    tracemalloc.start()
+
+    start = time.perf_counter()
+    dictionary = index.get_dictionary()
+    elapsed = time.perf_counter() - start
+
+    _, peak_bytes = tracemalloc.get_traced_memory()
+    tracemalloc.stop()
+
+    max_rss_after = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+    result = {
+        'get_dictionary': {
+            'load_time_s': elapsed,
+            'terms': len(dictionary[0]),
+            'peak_traced_bytes': peak_bytes,
+            'max_rss_delta_kb': max_rss_after - max_rss_before,
+        },
+    }
+
+    del dictionary
+
+    return result
+
+
+def benchmark_tokenize(index, args, rng):
+    token2id, id2token, _ = index.get_dictionary()
+    terms = list(id2token.values())
+
+    texts = [
+        ' '.join(rng.choice(terms) for _ in range(20))
+        for _ in range(args.num_lookups // 20 or 1)]
+    tokens = [(rng.choice(terms),) for _ in range(args.num_lookups)]
+
+    return {
+        'tokenize': time_calls(pyndri.tokenize, [(t,) for t in texts]),
+        'index_tokenize': time_calls(index.tokenize, [(t,) for t in texts]),
+        'krovetz_stem': time_calls(pyndri.krovetz_stem, tokens),
+        'porter_stem': time_calls(pyndri.porter_stem, tokens),
+        'krovetz_stem_batch': time_calls(
+            pyndri.krovetz_stem_batch,
+            [([token for token, in tokens],)]),
+        'porter_stem_batch': time_calls(
+            pyndri.porter_stem_batch,
+            [([token for token, in tokens],)]),
+    }
+
+
+BENCHMARKS = {
+    'query': benchmark_query,
+    'document': benchmark_document,
+    'scan': benchmark_scan,
+    'dictionary': benchmark_dictionary,
+    'tokenize': benchmark_tokenize,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser()
+
+    parser.add_argument('--loglevel', type=str, default='INFO')
+
+    parser.add_argument('--index',
+                        type=pyndri.utils.existing_directory_path,
+                        default=None,
+                        help='Existing repository; skips generation.')
+
+    parser.add_argument('--num_documents',
+                        type=pyndri.utils.positive_int, default=10000)
+    parser.add_argument('--document_length',
+                        type=pyndri.utils.positive_int, default=300)
+    parser.add_argument('--vocabulary_size',
+                        type=pyndri.utils.positive_int, default=50000)
+    parser.add_argument('--num_workers',
+                        type=pyndri.utils.positive_int, default=None)
+
+    parser.add_argument('--num_queries',
+                        type=pyndri.utils.positive_int, default=200)
+    parser.add_argument('--results_requested',
+                        type=pyndri.utils.positive_int, default=1000)
+    parser.add_argument('--num_lookups',
+                        type=pyndri.utils.positive_int, default=100000)
+
+    parser.add_argument('--benchmarks', nargs='+',
+                        choices=sorted(BENCHMARKS),
+                        default=sorted(BENCHMARKS))
+
+    parser.add_argument('--seed', type=int, default=1)
+
+    parser.add_argument('--output', type=str, default=None,
+                        help='Output path (default: stdout).')
+
+    args = parser.parse_args()
+
+    try:
+        pyndri.utils.configure_logging(args)
+    except IOError:
+        return -1
+
+    rng = random.Random(args.seed)
+
+    tmp_dir = None
+
+    try:
+        if args.index is None:
+            tmp_dir = tempfile.mkdtemp(prefix='pyndri-benchmark-')
+
+            corpus_path = os.path.join(tmp_dir, 'corpus.trectext')
+            index_path = os.path.join(tmp_dir, 'index')
+
+            logging.info('Generating corpus of %d documents.',
+                         args.num_documents)
+
+            generate_corpus(corpus_path,
+                            args.num_documents, args.document_length,
+                            make_vocabulary(args.vocabulary_size, rng),
+                            rng)
+
+            logging.info('Building repository.')
+
+            start = time.perf_counter()
+            pyndri.build_index(index_path, [corpus_path],
+                               num_workers=args.num_workers)
+            build_time = time.perf_counter() - start
+        else:
+            index_path = args.index
+            build_time = None
+
+        report = {
+            'pyndri_version': get_pyndri_version(),
+            'python_version': platform.python_version(),
+            'platform': platform.platform(),
+            'timestamp': time.time(),
+            'parameters': {
+                key: value for key, value in vars(args).items()
+                if key not in ('loglevel', 'output')},
+            'build_time_s': build_time,
+            'results': {},
+        }
+
+        with pyndri.open(index_path) as index:
+            report['index'] = {
+                'documents': len(index),
+                'total_terms': index.total_terms(),
+                'unique_terms': index.unique_terms(),
+            }
+
+            for name in args.benchmarks:
+                logging.info('Running %s benchmark.', name)
+
+                report['results'].update(BENCHMARKS[name](index, args, rng))
+    finally:
+        if tmp_dir is not None:
+            shutil.rmtree(tmp_dir)
+
+    if args.output is not None:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+    else:
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        sys.stdout.write('\n')
+
+if __name__ == '__main__':
+    sys.exit(main())
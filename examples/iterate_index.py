@@ -15,6 +15,13 @@ with pyndri.open(sys.argv[1]) as index:
         #   ('eUK436208', (381, 3346))
         print(index.document(document_id))
 
+    # Full scans are faster using iter_documents, which decodes batches of
+    # documents on a background thread. Every batch consists of the internal
+    # document identifiers, offsets into the terms and the terms themselves.
+    for document_ids, offsets, terms in index.iter_documents(batch_size=1024):
+        for idx, document_id in enumerate(document_ids):
+            print(document_id, tuple(terms[offsets[idx]:offsets[idx + 1]]))
+
     # The following line will raise an exception, as there is no document
     # with internal identifier 0.
     print(index.document(0))
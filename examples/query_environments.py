@@ -37,3 +37,10 @@ with pyndri.open(sys.argv[1]) as index:
     # (https://lemurproject.org/doxygen/lemur/html/IndriRunQuery.html)
     bm25_query_env = pyndri.OkapiQueryEnvironment(index)
     print(bm25_query_env.query('hello world'))
+
+    # Fuses the rankings of the query environments above using reciprocal
+    # rank fusion; the queries are evaluated concurrently.
+    document_ids, scores = pyndri.fuse(
+        [lm_query_env, prf_query_env, tfidf_query_env, bm25_query_env],
+        'hello world', method='rrf')
+    print(list(zip(document_ids, scores)))
@@ -9,3 +9,9 @@ print('marketing',
 print('strategies',
       pyndri.krovetz_stem('strategies'),
       pyndri.porter_stem('strategies'))  # strategy, strategi
+
+# Large numbers of terms are stemmed faster in batches; distinct terms are
+# stemmed once and, optionally, memoized across calls.
+print(pyndri.krovetz_stem_batch(
+    ['predictions', 'marketing', 'strategies'],
+    num_threads=4, cache_size=100000))  # ['prediction', 'marketing', 'strategy']
@@ -1,20 +1,35 @@
+from pyndri.build import build_index
 from pyndri.dictionary import Dictionary, extract_dictionary
 
 from pyndri_ext import Index as __IndexBase
-from pyndri_ext import QueryEnvironment, QueryExpander, \
-    krovetz_stem, porter_stem, tokenize
+from pyndri_ext import QueryEnvironment as __QueryEnvironmentBase
+from pyndri_ext import QueryExpander, IndexEnvironment, CancellationToken, \
+    TermSampler, Qrels, krovetz_stem, porter_stem, krovetz_stem_batch, \
+    porter_stem_batch, tokenize, merge_repositories, cosine_similarity
+from pyndri_ext import fuse as __fuse
 
+import asyncio
 import os
 
 __all__ = [
     'Index',
     'Dictionary',
     'QueryEnvironment',
+    'CancellationToken',
     'QueryExpander',
+    'IndexEnvironment',
+    'TermSampler',
+    'Qrels',
+    'build_index',
     'extract_dictionary',
+    'merge_repositories',
     'krovetz_stem',
     'porter_stem',
+    'krovetz_stem_batch',
+    'porter_stem_batch',
     'tokenize',
+    'cosine_similarity',
+    'fuse',
     'escape',
 ]
 
@@ -46,16 +61,68 @@ def escape(input):
     })
 
 
+class QueryEnvironment(__QueryEnvironmentBase):
+
+    async def query_async(self, query_str, document_set=None,
+                          results_requested=0, include_snippets=False,
+                          cancellation_token=None, include_extents=False):
+        """
+        Queries the index without blocking the event loop.
+
+        The query is evaluated by one of num_workers native worker threads
+        (see QueryEnvironment), which do not hold the GIL during evaluation.
+        Cancelling the awaiting task cancels the query if it has not started
+        yet; results of queries that already started are discarded.
+        """
+        loop = asyncio.get_running_loop()
+        future = loop.create_future()
+
+        if cancellation_token is None:
+            cancellation_token = CancellationToken()
+
+        def resolve(results, error):
+            if future.done():
+                return
+            elif error is not None:
+                future.set_exception(error)
+            elif results is None:
+                future.cancel()
+            else:
+                future.set_result(results)
+
+        def callback(results, error):
+            try:
+                loop.call_soon_threadsafe(resolve, results, error)
+            except RuntimeError:
+                pass  # Event loop was closed.
+
+        self._submit(callback, cancellation_token, query_str,
+                     document_set=document_set,
+                     results_requested=results_requested,
+                     include_snippets=include_snippets,
+                     include_extents=include_extents)
+
+        try:
+            return await future
+        except asyncio.CancelledError:
+            cancellation_token.cancel()
+            raise
+
+
 class Index(__IndexBase):
 
     def __init__(self, *args, **kwargs):
         super(Index, self).__init__(*args, **kwargs)
 
-        self.__default_query_env = QueryEnvironment(self)
+        # Created on first use, as many jobs never query.
+        self.__default_query_env = None
+        self.__closed = False
 
     def query(self, *args, **kwargs):
-        assert self.__default_query_env is not None, \
-            'Index has been closed.'
+        assert not self.__closed, 'Index has been closed.'
+
+        if self.__default_query_env is None:
+            self.__default_query_env = QueryEnvironment(self)
 
         return self.__default_query_env.query(*args, **kwargs)
 
@@ -72,25 +139,26 @@ class Index(__IndexBase):
         return '<pyndri.Index of {} documents>'.format(len(self))
 
     def close(self):
-        assert self.__default_query_env is not None, \
-            'Index has been closed.'
+        assert not self.__closed, 'Index has been closed.'
 
         del self.__default_query_env
         self.__default_query_env = None
+        self.__closed = True
 
 
 class __IndexOpener(object):
 
-    def __init__(self, path):
+    def __init__(self, path, **kwargs):
         if not os.path.isdir(path):
             raise IOError('Index path is not a directory.')
         elif not os.path.exists(os.path.join(path, 'manifest')):
             raise IOError('Index manifest not found.')
 
         self.path = path
+        self.kwargs = kwargs
 
     def __enter__(self):
-        self.index = Index(self.path)
+        self.index = Index(self.path, **self.kwargs)
         return self.index
 
     def __exit__(self, type, value, traceback):
@@ -129,3 +197,32 @@ class PRFQueryEnvironment(object):
     def query(self, query_str, *args, **kwargs):
         expanded_query_str = self.expander.expand(query_str)
         return self.query_env.query(expanded_query_str, *args, **kwargs)
+
+
+def fuse(query_envs, query_str, **kwargs):
+    """
+    Fuses the rankings of a query over multiple query environments.
+
+    The queries are evaluated concurrently without holding the GIL and the
+    rankings are fused natively, using CombSUM or CombMNZ (method='combsum'
+    or 'combmnz') after score normalization ('minmax', 'sum', 'zmuv' or
+    'none'), or using reciprocal rank fusion (method='rrf', rrf_k=60).
+    Every environment contributes its top-depth results, optionally
+    weighted using weights. PRFQueryEnvironments contribute the ranking of
+    their expanded query.
+
+    Returns (document_ids, scores) memoryviews of the results_requested
+    highest-scoring documents.
+    """
+    native_query_envs = []
+    queries = []
+
+    for query_env in query_envs:
+        if isinstance(query_env, PRFQueryEnvironment):
+            native_query_envs.append(query_env.query_env)
+            queries.append(query_env.expander.expand(query_str))
+        else:
+            native_query_envs.append(query_env)
+            queries.append(query_str)
+
+    return __fuse(native_query_envs, queries, **kwargs)
@@ -0,0 +1,346 @@
+"""Parallel construction of Indri repositories.
+
+The corpus is split into shards that are indexed concurrently by separate
+worker processes, each owning a native IndexEnvironment that writes a partial
+repository. The partial repositories are merged into a single repository
+afterwards, which can be opened using pyndri.Index.
+"""
+
+import logging
+import multiprocessing
+import os
+import queue as queue_lib
+import shutil
+import tempfile
+
+from pyndri_ext import IndexEnvironment, merge_repositories
+
+__all__ = [
+    'build_index',
+    'split_trec_file',
+]
+
+# File classes whose documents are delimited by </DOC>.
+SPLITTABLE_FILE_CLASSES = ('trectext', 'trecweb')
+
+DOCUMENT_END_TAG = b'</DOC>'
+
+DOCUMENTS_PER_BATCH = 256
+
+# Interval at which blocked producers check whether the worker is alive.
+QUEUE_TIMEOUT = 1.0
+
+
+class _WorkerExited(Exception):
+    pass
+
+
+def parse_memory(memory):
+    if isinstance(memory, int):
+        return memory
+
+    units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+
+    memory = str(memory).strip().upper()
+
+    if memory and memory[-1] in units:
+        return int(float(memory[:-1]) * units[memory[-1]])
+    else:
+        return int(memory)
+
+
+def split_trec_file(path, num_shards, output_dir):
+    """
+    Splits a TREC file into contiguous shards of approximately equal size.
+
+    Shards are only cut directly after a </DOC> tag, such that documents are
+    never split and their relative order is retained.
+    """
+    assert num_shards > 0
+
+    shard_size = max(os.path.getsize(path) // num_shards, 1)
+
+    shard_paths = []
+    out_f = None
+
+    with open(path, 'rb') as in_f:
+        for line in in_f:
+            if out_f is None:
+                shard_path = os.path.join(
+                    output_dir, '{}-{}'.format(
+                        os.path.basename(path), len(shard_paths)))
+
+                out_f = open(shard_path, 'wb')
+                shard_paths.append(shard_path)
+
+            out_f.write(line)
+
+            if DOCUMENT_END_TAG in line and \
+                    out_f.tell() >= shard_size and \
+                    len(shard_paths) < num_shards:
+                out_f.close()
+                out_f = None
+
+    if out_f is not None:
+        out_f.close()
+
+    return shard_paths
+
+
+def _assign_files(file_paths, num_shards):
+    """
+    Partitions files into contiguous shards of similar size.
+
+    Indri assigns document identifiers in the order that files are added and
+    merging concatenates the shards, hence contiguity retains the order.
+    """
+    shard_size = sum(map(os.path.getsize, file_paths)) / float(num_shards)
+
+    shards = [[]]
+    current_size = 0
+
+    for file_path in file_paths:
+        if current_size >= shard_size and len(shards) < num_shards:
+            shards.append([])
+            current_size = 0
+
+        shards[-1].append(file_path)
+        current_size += os.path.getsize(file_path)
+
+    return shards
+
+
+def _create_environment(repository_path, options):
+    return IndexEnvironment(
+        repository_path,
+        memory=options['memory'],
+        stemmer=options['stemmer'],
+        store_docs=options['store_docs'],
+        normalize=options['normalize'],
+        fields=tuple(options['fields']))
+
+
+def _index_files(repository_path, file_paths, file_class, options):
+    index_env = _create_environment(repository_path, options)
+
+    for file_path in file_paths:
+        index_env.add_file(file_path, file_class)
+
+    num_documents = index_env.documents_indexed()
+    index_env.close()
+
+    return num_documents
+
+
+def _index_documents(repository_path, queue, result_queue, options):
+    try:
+        index_env = _create_environment(repository_path, options)
+
+        while True:
+            batch = queue.get()
+
+            if batch is None:
+                break
+
+            for ext_document_id, text in batch:
+                index_env.add_document(ext_document_id, text)
+
+        result_queue.put((index_env.documents_indexed(), None))
+        index_env.close()
+    except Exception as e:
+        result_queue.put((0, '{}: {}'.format(type(e).__name__, e)))
+
+        raise
+
+
+def _put(queue, item, worker):
+    """Puts item on the queue of worker; raises if the worker has exited."""
+    while True:
+        try:
+            queue.put(item, timeout=QUEUE_TIMEOUT)
+
+            return
+        except queue_lib.Full:
+            if not worker.is_alive():
+                raise _WorkerExited()
+
+
+def _file_worker(args):
+    return _index_files(*args)
+
+
+def _build_from_files(shard_paths, file_paths, file_class, options,
+                      num_workers, tmp_dir):
+    if len(file_paths) < num_workers and \
+            file_class in SPLITTABLE_FILE_CLASSES:
+        split_dir = os.path.join(tmp_dir, 'corpus')
+        os.mkdir(split_dir)
+
+        split_paths = []
+
+        for file_path in file_paths:
+            split_paths.extend(split_trec_file(
+                file_path, num_workers, split_dir))
+
+        file_paths = split_paths
+
+    assignments = _assign_files(file_paths, num_workers)
+
+    tasks = [
+        (os.path.join(tmp_dir, 'shard-{}'.format(idx)),
+         assignment, file_class, options)
+        for idx, assignment in enumerate(assignments)]
+
+    with multiprocessing.Pool(len(tasks)) as pool:
+        num_documents = pool.map(_file_worker, tasks, chunksize=1)
+
+    shard_paths.extend(task[0] for task in tasks)
+
+    return sum(num_documents)
+
+
+def _build_from_documents(shard_paths, documents, options,
+                          num_workers, tmp_dir):
+    queues = [multiprocessing.Queue(maxsize=4) for _ in range(num_workers)]
+    result_queue = multiprocessing.Queue()
+
+    workers = []
+
+    for idx, queue in enumerate(queues):
+        shard_path = os.path.join(tmp_dir, 'shard-{}'.format(idx))
+        shard_paths.append(shard_path)
+
+        worker = multiprocessing.Process(
+            target=_index_documents,
+            args=(shard_path, queue, result_queue, options))
+        worker.start()
+
+        workers.append(worker)
+
+    try:
+        batch = []
+        num_batches = 0
+
+        for ext_document_id, text in documents:
+            batch.append((ext_document_id, text))
+
+            if len(batch) >= DOCUMENTS_PER_BATCH:
+                _put(queues[num_batches % num_workers], batch,
+                     workers[num_batches % num_workers])
+                num_batches += 1
+
+                batch = []
+
+        if batch:
+            _put(queues[num_batches % num_workers], batch,
+                 workers[num_batches % num_workers])
+    except _WorkerExited:
+        pass  # Reported below.
+    finally:
+        for queue, worker in zip(queues, workers):
+            try:
+                _put(queue, None, worker)
+            except _WorkerExited:
+                # Batches left for the worker are never consumed; do not
+                # wait for them to be flushed at exit.
+                queue.cancel_join_thread()
+
+        for worker in workers:
+            worker.join()
+
+    num_documents = 0
+    errors = []
+
+    for _ in workers:
+        try:
+            worker_num_documents, error = result_queue.get(
+                timeout=QUEUE_TIMEOUT)
+        except queue_lib.Empty:
+            break
+
+        num_documents += worker_num_documents
+
+        if error is not None:
+            errors.append(error)
+
+    if errors:
+        raise RuntimeError('Indexing worker failed: {}'.format(errors[0]))
+    elif any(worker.exitcode != 0 for worker in workers):
+        raise RuntimeError('Indexing worker exited with code {}.'.format(
+            next(worker.exitcode for worker in workers
+                 if worker.exitcode != 0)))
+
+    return num_documents
+
+
+def build_index(repository_path, corpus,
+                num_workers=None, file_class='trectext',
+                memory='1024M', stemmer='krovetz',
+                store_docs=True, normalize=True, fields=(),
+                tmp_dir=None):
+    """
+    Builds an Indri repository using multiple indexing processes.
+
+    Parameters:
+        - repository_path: path of the repository to create.
+        - corpus: either a list of file paths, which are indexed using
+            file_class, or an iterable of (ext_document_id, text) pairs.
+
+            Files are distributed over the workers; TREC files are split
+            at document boundaries when there are fewer files than
+            workers. Document identifiers follow the order of the input
+            files. For iterables of documents, document identifiers are not
+            guaranteed to follow the order of the input.
+        - num_workers: number of indexing processes (default: CPU count).
+        - memory: indexing memory per worker (e.g., '1024M').
+        - stemmer: stemmer name (e.g., 'krovetz', 'porter') or None.
+        - fields: names of fields to index.
+        - tmp_dir: directory for partial repositories (default: next to
+            repository_path).
+
+    Returns the number of documents indexed.
+    """
+    if os.path.exists(repository_path):
+        raise IOError('Repository path already exists.')
+
+    if num_workers is None:
+        num_workers = multiprocessing.cpu_count()
+
+    assert num_workers > 0
+
+    options = {
+        'memory': parse_memory(memory),
+        'stemmer': stemmer,
+        'store_docs': store_docs,
+        'normalize': normalize,
+        'fields': fields,
+    }
+
+    shard_dir = tempfile.mkdtemp(
+        prefix='pyndri-build-',
+        dir=tmp_dir or os.path.dirname(os.path.abspath(repository_path)))
+
+    shard_paths = []
+
+    try:
+        if isinstance(corpus, (list, tuple)) and \
+                all(isinstance(path, str) for path in corpus):
+            for path in corpus:
+                if not os.path.isfile(path):
+                    raise IOError('Corpus file {} not found.'.format(path))
+
+            num_documents = _build_from_files(
+                shard_paths, list(corpus), file_class, options,
+                num_workers, shard_dir)
+        else:
+            num_documents = _build_from_documents(
+                shard_paths, corpus, options, num_workers, shard_dir)
+
+        logging.info('Indexed %d documents in %d shards; merging.',
+                     num_documents, len(shard_paths))
+
+        merge_repositories(repository_path, shard_paths)
+    finally:
+        shutil.rmtree(shard_dir, ignore_errors=True)
+
+    return num_documents
@@ -22,14 +22,13 @@ class IndriSentences(gensim.interfaces.CorpusABC):
                 self.index.maximum_document())
 
     def __iter__(self):
-        for int_doc_id in range(self.index.document_base(),
-                                self._maximum_document()):
-            ext_doc_id, tokens = self.index.document(int_doc_id)
-
-            yield tuple(
-                self.dictionary[token_id]
-                for token_id in tokens
-                if token_id > 0 and token_id in self.dictionary)
+        for _, offsets, terms in self.index.iter_documents(
+                end=self._maximum_document()):
+            for begin, end in zip(offsets[:-1], offsets[1:]):
+                yield tuple(
+                    self.dictionary[token_id]
+                    for token_id in terms[begin:end]
+                    if token_id > 0 and token_id in self.dictionary)
 
     def __len__(self):
         return self._maximum_document() - self.index.document_base()
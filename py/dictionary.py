@@ -1,3 +1,4 @@
+import array
 import collections
 import heapq
 import pyndri
@@ -16,7 +17,8 @@ class Dictionary(object):
     This class is compatible with gensim.
     """
 
-    def __init__(self, token2id, id2token, id2df, **kwargs):
+    def __init__(self, token2id, id2token, id2df, indri_id2cid=None,
+                 **kwargs):
         assert len(token2id) == len(id2token)
 
         self.token2id = token2id
@@ -24,6 +26,11 @@ class Dictionary(object):
 
         self.dfs = id2df
 
+        # Maps Indri term identifiers to the identifiers of the dictionary,
+        # if they differ.
+        self.indri_id2cid = indri_id2cid
+        self.__id_map = None
+
         if 'krovetz_stemming' in kwargs:
             raise NotImplementedError('krovetz_stemming was deprecated '
                                       'in favour of Index.process_term.')
@@ -79,6 +86,39 @@ class Dictionary(object):
 
         return sorted(counter.items())
 
+    def id_map(self, index):
+        """
+        Returns a dense lookup array from Indri term identifiers to the
+        identifiers of the dictionary (-1 for terms not in the dictionary).
+        """
+        if self.__id_map is None or \
+                len(self.__id_map) != index.unique_terms() + 1:
+            id_map = array.array('i', [-1]) * (index.unique_terms() + 1)
+
+            if self.indri_id2cid is not None:
+                for indri_id, cid in self.indri_id2cid.items():
+                    id_map[indri_id] = cid
+            else:
+                for token_id in self.id2token:
+                    id_map[token_id] = token_id
+
+            self.__id_map = id_map
+
+        return self.__id_map
+
+    def corpus2csr(self, index, start=None, end=None, num_threads=1):
+        """
+        Vectorizes the documents of index in [start, end) natively.
+
+        Returns the bag-of-words of every document, restricted to the
+        dictionary, as the (data, indices, indptr) buffers of a compressed
+        sparse row matrix; e.g., scipy.sparse.csr_matrix(
+            dictionary.corpus2csr(index), shape=(num_docs, num_terms)).
+        """
+        return index.bag_of_words(start=start, end=end,
+                                  id_map=self.id_map(index),
+                                  num_threads=num_threads)
+
 
 def extract_dictionary(index,
                        max_terms=None, make_contiguous=False,
@@ -114,7 +154,8 @@ def extract_dictionary(index,
     else:
         indri_id2cid = None
 
-    dictionary = Dictionary(token2id, id2token, id2df, **kwargs)
+    dictionary = Dictionary(token2id, id2token, id2df,
+                            indri_id2cid=indri_id2cid, **kwargs)
 
     if make_contiguous:
         return dictionary, indri_id2cid
@@ -231,6 +231,38 @@ def read_queries(file_or_files,
     return queries
 
 
+def read_qrels(file_or_path):
+    """
+    Reads TREC relevance judgments (topic, iteration, document, relevance).
+
+    Returns a dictionary mapping topic identifiers to dictionaries that map
+    external document identifiers to relevance levels, as accepted by
+    pyndri.Qrels.
+    """
+    if not isinstance(file_or_path, io.IOBase):
+        with open(file_or_path, 'r') as f:
+            return read_qrels(f)
+
+    qrels = collections.defaultdict(dict)
+
+    for line in file_or_path:
+        line = line.strip()
+
+        if not line:
+            continue
+
+        try:
+            topic_id, _, ext_doc_id, relevance = line.split()
+        except ValueError:
+            logging.warning('Unable to process "%s" in qrels.', line)
+
+            continue
+
+        qrels[topic_id][ext_doc_id] = int(relevance)
+
+    return dict(qrels)
+
+
 def parse_queries(index, dictionary, query_path,
                   strict=False, num_queries=None):
     query_f = list(map(lambda filename: open(filename, 'r'), [query_path]))
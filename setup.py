@@ -1,5 +1,5 @@
 import os
-from distutils.core import setup, Extension
+from setuptools import setup, Extension
 
 pyndri_ext = Extension(
     'pyndri_ext',
@@ -20,8 +20,9 @@ setup(name='pyndri',
       ext_modules=[pyndri_ext],
       packages=['pyndri'],
       package_dir={'pyndri': 'py'},
-      scripts=['bin/PyndriQuery', 'bin/PyndriStatistics'],
-      python_requires='>=3',
+      scripts=['bin/PyndriBuildIndex', 'bin/PyndriQuery',
+               'bin/PyndriStatistics'],
+      python_requires='>=3.9',
       url='https://github.com/cvangysel/pyndri',
       download_url='https://github.com/cvangysel/pyndri/tarball/0.4',
       keywords=['indri', 'language models', 'retrieval', 'indexing'],
@@ -1,8 +1,38 @@
 #include <Python.h>
 #include "structmember.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <iostream>
 #include <sstream>
 
@@ -16,12 +46,14 @@
 
 #include <indri/CompressedCollection.hpp>
 #include <indri/DiskIndex.hpp>
+#include <indri/IndexEnvironment.hpp>
 #include <indri/KrovetzStemmer.hpp>
 #include <indri/QueryEnvironment.hpp>
 #include <indri/QueryParserFactory.hpp>
 #include <indri/QuerySpec.hpp>
 #include <indri/Path.hpp>
 #include <indri/Porter_Stemmer.hpp>
+#include <indri/Repository.hpp>
 #include <indri/RMExpander.hpp>
 #include <indri/SnippetBuilder.hpp>
 
@@ -48,1218 +80,9484 @@ int PyDict_SetItemAndSteal(PyObject* p, PyObject* key, PyObject* val) {
     return ret;
 }
 
-static PyTypeObject IndexType;
-static PyTypeObject QueryEnvironmentType;
-static PyTypeObject QueryExpanderType;
+// Returns a read-only memoryview, with the given struct format, on a copy of
+// the buffer.
+PyObject* BufferToMemoryView(const void* data, const size_t size, const char* format) {
+    PyObject* const bytes = PyBytes_FromStringAndSize(
+        static_cast<const char*>(data), size);
 
-// Index
-
-typedef struct {
-    PyObject_HEAD
+    if (bytes == NULL) {
+        return NULL;
+    }
 
-    char* repository_path_;
+    PyObject* const view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
 
-    indri::api::Parameters* parameters_;
+    if (view == NULL) {
+        return NULL;
+    }
 
-    indri::collection::CompressedCollection* collection_;
-    indri::index::DiskIndex* index_;
+    PyObject* const ret = PyObject_CallMethod(view, "cast", "s", format);
+    Py_DECREF(view);
 
-    indri::api::QueryEnvironment* query_env_;
-} Index;
+    return ret;
+}
 
-static void Index_dealloc(Index* self) {
-    // self->collection_->close();
-    self->index_->close();
-    // self->query_env_->close();
+// Acquires a contiguous buffer of 32-bit integers (e.g., array.array('i') or
+// a NumPy int32 array). Returns false, with an exception set, on failure.
+bool GetInt32Buffer(PyObject* obj, const bool writable, const char* name,
+                    Py_buffer* const buffer) {
+    int flags = PyBUF_FORMAT | PyBUF_C_CONTIGUOUS;
 
-    delete self->parameters_;
+    if (writable) {
+        flags |= PyBUF_WRITABLE;
+    }
 
-    // delete self->collection_;
-    delete self->index_;
-    delete self->query_env_;
+    if (PyObject_GetBuffer(obj, buffer, flags) < 0) {
+        return false;
+    }
 
-    delete [] self->repository_path_;
-}
+    if (buffer->itemsize != sizeof(INT32) ||
+        buffer->format == NULL ||
+        strchr("iIlL", buffer->format[strlen(buffer->format) - 1]) == NULL) {
+        PyBuffer_Release(buffer);
+        PyErr_Format(PyExc_TypeError, "%s should be a buffer of 32-bit integers.", name);
 
-static PyObject* Index_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
-    Index* self;
+        return false;
+    }
 
-    self = (Index*) type->tp_alloc(type, 0);
-    if (self != NULL) {
-        self->repository_path_ = NULL;
+    return true;
+}
 
-        self->parameters_ = new indri::api::Parameters;
+// Acquires a C-contiguous matrix of 32-bit floats (e.g., a two-dimensional
+// NumPy float32 array). Returns false, with an exception set, on failure.
+bool GetFloat32Matrix(PyObject* obj, const char* name, Py_buffer* const buffer,
+                      size_t* const rows, size_t* const columns) {
+    if (PyObject_GetBuffer(obj, buffer, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+        return false;
+    }
 
-        self->collection_ = new indri::collection::CompressedCollection;
-        self->index_ = new indri::index::DiskIndex;
+    if (buffer->itemsize != sizeof(float) ||
+        buffer->format == NULL ||
+        buffer->format[strlen(buffer->format) - 1] != 'f' ||
+        buffer->ndim != 2) {
+        PyBuffer_Release(buffer);
+        PyErr_Format(PyExc_TypeError, "%s should be a matrix of 32-bit floats.", name);
 
-        self->query_env_ = new indri::api::QueryEnvironment;
+        return false;
     }
 
-    return (PyObject*) self;
+    *rows = buffer->shape[0];
+    *columns = buffer->shape[1];
+
+    return true;
 }
 
-static int Index_init(Index* self, PyObject* args, PyObject* kwds) {
-    const char* repository_path = NULL;
+// Calls fn(task) for every task in [0, num_tasks) using up to num_threads
+// threads, which take tasks in order. Must not be called with the GIL held if
+// fn blocks on Python.
+void ParallelFor(const size_t num_threads, const size_t num_tasks,
+                 const std::function<void(size_t)>& fn) {
+    std::atomic<size_t> next_task(0);
+
+    auto worker = [&]() {
+        for (size_t task = next_task++; task < num_tasks; task = next_task++) {
+            fn(task);
+        }
+    };
 
-    static char* kwlist[] = {"repository_path", NULL};
+    std::vector<std::thread> threads;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist,
-                                     &repository_path)) {
-        return -1;
+    for (size_t i = 1; i < std::min(num_threads, num_tasks); ++i) {
+        threads.push_back(std::thread(worker));
     }
 
-    const size_t repository_path_length = strlen(repository_path);
+    worker();
 
-    self->repository_path_ = new char[repository_path_length + 1];
-    memcpy(self->repository_path_, repository_path, repository_path_length);
-    self->repository_path_[repository_path_length] = 0;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+}
 
-    // Load parameters.
-    try {
-        self->parameters_->loadFile(
-            indri::file::Path::combine(repository_path, "manifest"));
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+class TokenExtractor : public indri::lang::Walker {
+ public:
+    explicit TokenExtractor(std::vector<std::string>* const tokens) : tokens_(tokens) {
+        tokens_->clear();
+    }
 
-        return -1;
+    virtual void defaultBefore(indri::lang::Node* node) {}
+
+    virtual void after(indri::lang::IndexTerm* node) {
+        tokens_->push_back(node->getText());
     }
 
-    const std::string collection_path =
-        indri::file::Path::combine(repository_path, "collection");
+ private:
+    std::vector<std::string>* const tokens_;
+};
+
+// Extracts the index terms from an Indri query. Returns false on parse errors.
+bool ExtractQueryTerms(const std::string& query_str,
+                       std::vector<std::string>* const terms,
+                       std::string* const error) {
+    indri::api::QueryParserWrapper* const parser =
+        indri::api::QueryParserFactory::get(query_str, "indri");
+
+    indri::lang::ScoredExtentNode* root_node = NULL;
 
     try {
-        self->collection_->open(collection_path);
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+        root_node = parser->query();
+    } catch (const antlr::NoViableAltException& e) {
+        *error = e.getMessage();
+    } catch (const antlr::MismatchedTokenException& e) {
+        *error = e.getMessage();
+    } catch (const antlr::TokenStreamRecognitionException& e) {
+        *error = e.getMessage();
+    }
 
-        return -1;
+    if (root_node == NULL) {
+        return false;
     }
 
-    // Load index.
-    std::string index_path = "index";
+    TokenExtractor extractor(terms);
+    root_node->walk(extractor);
 
-    indri::api::Parameters container = (*self->parameters_)["indexes"];
+    return true;
+}
 
-    if(container.exists("index")) {
-        indri::api::Parameters indexes = container["index"];
+// Query instrumentation.
+
+// The parse phase covers parsing the query and looking up the document
+// frequencies of its terms; Indri parses the query again within
+// runAnnotatedQuery, which is part of the evaluation phase.
+enum QueryPhase {
+    QUERY_PHASE_PARSE = 0,
+    QUERY_PHASE_EVALUATE,
+    QUERY_PHASE_FETCH_DOCUMENTS,
+    QUERY_PHASE_SNIPPETS,
+    QUERY_PHASE_CONVERSION,
+    NUM_QUERY_PHASES
+};
 
-        if (indexes.size() != 1) {
-            PyErr_SetString(PyExc_IOError, "Indri repository contain more than one index.");
+static const char* const QUERY_PHASE_NAMES[NUM_QUERY_PHASES] = {
+    "parse", "evaluate", "fetch_documents", "snippets", "conversion"
+};
 
-            return -1;
-        }
+typedef std::chrono::steady_clock Clock;
 
-        index_path = indri::file::Path::combine(
-            index_path, (std::string) indexes[static_cast<size_t>(0)]);
-    } else {
-        PyErr_SetString(PyExc_IOError, "Indri repository does not contain an index.");
+double SecondsSince(const Clock::time_point& start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
 
-        return -1;
+// Wall-time breakdown and counters of a single query.
+struct QueryProfile {
+    QueryProfile() :
+        postings_touched(0),
+        documents_scored(0),
+        snippet_bytes_decompressed(0),
+        results(0) {
+        for (size_t phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+            phase_seconds[phase] = 0.0;
+        }
     }
 
-    try {
-        self->index_->open(repository_path, index_path);
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
-
-        return -1;
-    }
+    double total_seconds() const {
+        double total = 0.0;
 
-    // TODO(cvangysel): possibly remove query_env_ in the future.
-    try {
-        self->query_env_->addIndex(repository_path);
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+        for (size_t phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+            total += phase_seconds[phase];
+        }
 
-        return -1;
+        return total;
     }
 
-    return 0;
-}
+    double phase_seconds[NUM_QUERY_PHASES];
 
-static PyObject* Index_get_document_ids(Index* self, PyObject* args) {
-    PyObject* external_doc_ids = NULL;
+    // Sum of the document frequencies of the query terms (approximate, as
+    // operators such as #syn or #odN may skip postings).
+    UINT64 postings_touched;
+    // Upper bound on the number of candidate documents that were scored: the
+    // documents evaluated, but no more than postings_touched.
+    UINT64 documents_scored;
+    // Bytes of document text decompressed to build snippets.
+    UINT64 snippet_bytes_decompressed;
 
-    if (!PyArg_ParseTuple(args, "O", &external_doc_ids)) {
-        return NULL;
-    }
+    UINT64 results;
+};
 
-    if (external_doc_ids == NULL) {
-        return NULL;
+// Histogram of durations with power-of-two microsecond buckets; bucket i
+// holds durations below 2^i microseconds (and above those of bucket i - 1).
+class LatencyHistogram {
+ public:
+    static const size_t kNumBuckets = 32;
+
+    LatencyHistogram() : count_(0), sum_seconds_(0.0) {
+        for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+            counts_[bucket] = 0;
+        }
     }
 
-    PyObject* const iterator = PyObject_GetIter(external_doc_ids);
-    PyObject *item;
+    void add(const double seconds) {
+        const double microseconds = seconds * 1e6;
 
-    if (iterator == NULL) {
-        PyErr_SetString(
-            PyExc_TypeError,
-            "Passed object is not iterable.");
+        size_t bucket = 0;
+        while (bucket < kNumBuckets - 1 &&
+               microseconds >= static_cast<double>(1ULL << bucket)) {
+            ++bucket;
+        }
 
-        Py_DECREF(iterator);
+        ++counts_[bucket];
 
-        return NULL;
+        ++count_;
+        sum_seconds_ += seconds;
     }
 
-    std::vector<std::string> ext_document_ids;
+    PyObject* to_dict() const {
+        PyObject* const upper_bounds = PyList_New(kNumBuckets);
+        PyObject* const counts = PyList_New(kNumBuckets);
 
-    while (item = PyIter_Next(iterator)) {
-        CHECK(PyUnicode_CheckExact(item));
+        for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+            PyList_SetItem(upper_bounds, bucket,
+                           PyLong_FromUnsignedLongLong(1ULL << bucket));
+            PyList_SetItem(counts, bucket,
+                           PyLong_FromUnsignedLongLong(counts_[bucket]));
+        }
 
-        PyObject* item_bytes = PyUnicode_AsEncodedString(item, ENCODING, "strict");
-        char* const ext_document_id = PyBytes_AsString(item_bytes);
+        PyObject* const histogram = PyDict_New();
 
-        // Create a copy of the string.
-        ext_document_ids.push_back(ext_document_id);
+        PyDict_SetItemString(histogram, "bucket_upper_bounds_us", upper_bounds);
+        PyDict_SetItemAndSteal(histogram, PyUnicode_FromString("counts"), counts);
+        PyDict_SetItemAndSteal(histogram, PyUnicode_FromString("count"),
+                               PyLong_FromUnsignedLongLong(count_));
+        PyDict_SetItemAndSteal(histogram, PyUnicode_FromString("sum_seconds"),
+                               PyFloat_FromDouble(sum_seconds_));
 
-        Py_DECREF(item_bytes);
-        Py_DECREF(item);
+        Py_DECREF(upper_bounds);
+
+        return histogram;
     }
 
-    Py_DECREF(iterator);
+ private:
+    UINT64 counts_[kNumBuckets];
 
-    std::vector<lemur::api::DOCID_T> int_doc_ids;
+    UINT64 count_;
+    double sum_seconds_;
+};
 
-    try {
-        int_doc_ids = self->query_env_->documentIDsFromMetadata("docno", ext_document_ids);
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+// Aggregated instrumentation of all instrumented queries of an environment.
+struct QueryStats {
+    QueryStats() :
+        queries(0),
+        postings_touched(0),
+        documents_scored(0),
+        snippet_bytes_decompressed(0) {}
 
-        return NULL;
-    }
+    void add(const QueryProfile& profile) {
+        ++queries;
 
-    PyObject* const doc_ids_tuple = PyTuple_New(int_doc_ids.size());
+        for (size_t phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+            phase_histograms[phase].add(profile.phase_seconds[phase]);
+        }
 
-    Py_ssize_t pos = 0;
-    for (std::vector<lemur::api::DOCID_T>::iterator int_doc_ids_it = int_doc_ids.begin();
-         int_doc_ids_it != int_doc_ids.end();
-         ++int_doc_ids_it, ++pos) {
-        const lemur::api::DOCID_T int_document_id = *int_doc_ids_it;
+        total_histogram.add(profile.total_seconds());
 
-        std::string ext_document_id;
+        postings_touched += profile.postings_touched;
+        documents_scored += profile.documents_scored;
+        snippet_bytes_decompressed += profile.snippet_bytes_decompressed;
 
-        try {
-            ext_document_id = self->collection_->retrieveMetadatum(int_document_id, "docno");
-        } catch (const lemur::api::Exception& e) {
-            PyErr_SetString(PyExc_IOError, e.what().c_str());
+        last_query = profile;
+    }
 
-            Py_DECREF(doc_ids_tuple);
+    UINT64 queries;
 
-            return NULL;
-        }
+    LatencyHistogram phase_histograms[NUM_QUERY_PHASES];
+    LatencyHistogram total_histogram;
 
-        PyObject* py_ext_document_id = PyUnicode_Decode(
-            ext_document_id.c_str(),
-            ext_document_id.size(),
-            ENCODING,
-            "strict");
+    UINT64 postings_touched;
+    UINT64 documents_scored;
+    UINT64 snippet_bytes_decompressed;
 
-        PyObject* py_int_document_id = PyLong_FromLong(int_document_id);
+    QueryProfile last_query;
+};
 
-        PyTuple_SetItem(doc_ids_tuple,
-                        pos,
-                        PyTuple_Pack(
-                            2,
-                            py_ext_document_id,
-                            py_int_document_id));
+PyObject* QueryProfileToDict(const QueryProfile& profile) {
+    PyObject* const phases = PyDict_New();
 
-        Py_DECREF(py_ext_document_id);
-        Py_DECREF(py_int_document_id);
+    for (size_t phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+        PyDict_SetItemAndSteal(phases,
+                               PyUnicode_FromString(QUERY_PHASE_NAMES[phase]),
+                               PyFloat_FromDouble(profile.phase_seconds[phase]));
     }
 
-    return doc_ids_tuple;
-}
+    PyObject* const result = PyDict_New();
 
-static PyObject* Index_document(Index* self, PyObject* args) {
-    int int_document_id;
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("phase_seconds"), phases);
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("total_seconds"),
+                           PyFloat_FromDouble(profile.total_seconds()));
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("postings_touched"),
+                           PyLong_FromUnsignedLongLong(profile.postings_touched));
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("documents_scored"),
+                           PyLong_FromUnsignedLongLong(profile.documents_scored));
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("snippet_bytes_decompressed"),
+                           PyLong_FromUnsignedLongLong(profile.snippet_bytes_decompressed));
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("results"),
+                           PyLong_FromUnsignedLongLong(profile.results));
 
-    if (!PyArg_ParseTuple(args, "i", &int_document_id)) {
-        return NULL;
-    }
+    return result;
+}
 
-    if (int_document_id < self->index_->documentBase() ||
-        int_document_id >= self->index_->documentMaximum()) {
-        PyErr_SetString(
-            PyExc_IndexError,
-            "Specified internal document identifier is out of bounds.");
+PyObject* QueryStatsToDict(const QueryStats& stats) {
+    PyObject* const histograms = PyDict_New();
 
-        return NULL;
+    for (size_t phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+        PyDict_SetItemAndSteal(histograms,
+                               PyUnicode_FromString(QUERY_PHASE_NAMES[phase]),
+                               stats.phase_histograms[phase].to_dict());
     }
 
-    string ext_document_id;
-    const indri::index::TermList* term_list = 0;
-
-    try {
-        ext_document_id = self->collection_->retrieveMetadatum(
-            int_document_id, "docno");
-        term_list = self->index_->termList(int_document_id);
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+    PyDict_SetItemAndSteal(histograms, PyUnicode_FromString("total"),
+                           stats.total_histogram.to_dict());
 
-        if (term_list != 0) {
-            delete term_list;
-        }
+    PyObject* const totals = PyDict_New();
 
-        return NULL;
-    }
+    PyDict_SetItemAndSteal(totals, PyUnicode_FromString("postings_touched"),
+                           PyLong_FromUnsignedLongLong(stats.postings_touched));
+    PyDict_SetItemAndSteal(totals, PyUnicode_FromString("documents_scored"),
+                           PyLong_FromUnsignedLongLong(stats.documents_scored));
+    PyDict_SetItemAndSteal(totals, PyUnicode_FromString("snippet_bytes_decompressed"),
+                           PyLong_FromUnsignedLongLong(stats.snippet_bytes_decompressed));
 
-    PyObject* terms = PyTuple_New(term_list->terms().size());
+    PyObject* const result = PyDict_New();
 
-    indri::utility::greedy_vector<lemur::api::TERMID_T>::const_iterator term_it =
-        term_list->terms().begin();
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("queries"),
+                           PyLong_FromUnsignedLongLong(stats.queries));
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("totals"), totals);
+    PyDict_SetItemAndSteal(result, PyUnicode_FromString("histograms"), histograms);
 
-    Py_ssize_t pos = 0;
-    for (; term_it != term_list->terms().end(); ++term_it, ++pos) {
-        PyTuple_SetItem(terms, pos, PyLong_FromLong(*term_it));
+    if (stats.queries > 0) {
+        PyDict_SetItemAndSteal(result, PyUnicode_FromString("last_query"),
+                               QueryProfileToDict(stats.last_query));
+    } else {
+        Py_INCREF(Py_None);
+        PyDict_SetItemString(result, "last_query", Py_None);
+        Py_DECREF(Py_None);
     }
 
-    delete term_list;
-
-    PyObject* name = PyUnicode_Decode(
-        ext_document_id.c_str(),
-        ext_document_id.size(),
-        ENCODING,
-        "strict");
+    return result;
+}
 
-    PyObject* ret = PyTuple_Pack(2, name, terms);
+// Module state
 
-    Py_DECREF(name);
-    Py_DECREF(terms);
+// The types are heap types created by every interpreter that imports the
+// module, hence they are looked up through the module that defined the type
+// of an object instead of being global.
+typedef struct {
+    PyTypeObject* index_type;
+    PyTypeObject* query_environment_type;
+    PyTypeObject* query_expander_type;
+    PyTypeObject* index_environment_type;
+    PyTypeObject* cancellation_token_type;
+    PyTypeObject* document_iterator_type;
+    PyTypeObject* shared_buffer_type;
+    PyTypeObject* term_sampler_type;
+    PyTypeObject* qrels_type;
+} ModuleState;
+
+// Returns the state of the pyndri module that defined type (or one of its
+// bases). Returns NULL, with an exception set, on failure.
+static ModuleState* GetModuleState(PyTypeObject* type);
+
+#ifndef Py_TPFLAGS_IMMUTABLETYPE
+#define Py_TPFLAGS_IMMUTABLETYPE 0
+#endif
+
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define Py_TPFLAGS_DISALLOW_INSTANTIATION 0
+#endif
+
+// Without the GIL, concurrent method calls on the same object are serialized
+// using per-object critical sections. These are released whenever the calling
+// thread releases its thread state (e.g., Py_BEGIN_ALLOW_THREADS), just like
+// the GIL, hence native state that is used with the GIL released keeps its
+// own locks (e.g., QueryEnvironment::query_env_mutex_).
+#ifdef Py_GIL_DISABLED
+#define PYNDRI_BEGIN_CRITICAL_SECTION(op) Py_BEGIN_CRITICAL_SECTION(op)
+#define PYNDRI_END_CRITICAL_SECTION() Py_END_CRITICAL_SECTION()
+#else
+#define PYNDRI_BEGIN_CRITICAL_SECTION(op) {
+#define PYNDRI_END_CRITICAL_SECTION() }
+#endif
+
+template <typename T, PyObject* (*Method)(T*)>
+static PyObject* LockedNoArgs(T* self, PyObject*) {
+    PyObject* result;
+
+    PYNDRI_BEGIN_CRITICAL_SECTION(self);
+    result = Method(self);
+    PYNDRI_END_CRITICAL_SECTION();
 
-    return ret;
+    return result;
 }
 
-static PyObject* Index_ext_document_id(Index* self, PyObject* args) {
-    int int_document_id;
+template <typename T, PyObject* (*Method)(T*, PyObject*)>
+static PyObject* LockedArgs(T* self, PyObject* args) {
+    PyObject* result;
 
-    if (!PyArg_ParseTuple(args, "i", &int_document_id)) {
-        return NULL;
-    }
+    PYNDRI_BEGIN_CRITICAL_SECTION(self);
+    result = Method(self, args);
+    PYNDRI_END_CRITICAL_SECTION();
 
-    if (int_document_id < self->index_->documentBase() ||
-        int_document_id >= self->index_->documentMaximum()) {
-        PyErr_SetString(
-            PyExc_IndexError,
-            "Specified internal document identifier is out of bounds.");
+    return result;
+}
 
-        return NULL;
-    }
+template <typename T, PyObject* (*Method)(T*, PyObject*, PyObject*)>
+static PyObject* LockedKeywords(T* self, PyObject* args, PyObject* kwds) {
+    PyObject* result;
 
-    string ext_document_id;
+    PYNDRI_BEGIN_CRITICAL_SECTION(self);
+    result = Method(self, args, kwds);
+    PYNDRI_END_CRITICAL_SECTION();
 
-    try {
-        ext_document_id = self->collection_->retrieveMetadatum(
-            int_document_id, "docno");
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+    return result;
+}
 
-        return NULL;
-    }
+template <typename T, PyObject* (*Getter)(T*, void*)>
+static PyObject* LockedGetter(T* self, void* closure) {
+    PyObject* result;
 
-    return PyUnicode_Decode(ext_document_id.c_str(),
-                            ext_document_id.size(),
-                            ENCODING,
-                            "strict");
-}
+    PYNDRI_BEGIN_CRITICAL_SECTION(self);
+    result = Getter(self, closure);
+    PYNDRI_END_CRITICAL_SECTION();
 
-static PyObject* Index_document_base(Index* self) {
-    return PyLong_FromLong(self->index_->documentBase());
+    return result;
 }
 
-static PyObject* Index_maximum_document(Index* self) {
-    return PyLong_FromLong(self->index_->documentMaximum());
+template <typename T, PyObject* (*Method)(T*)>
+static PyObject* LockedIterNext(T* self) {
+    return LockedNoArgs<T, Method>(self, NULL);
 }
 
-static PyObject* Index_document_count(Index* self) {
-    return PyLong_FromLong(self->index_->documentCount());
-}
+// Shared tables
 
-static PyObject* Index_total_terms(Index* self) {
-    return PyLong_FromLong(self->index_->termCount());
-}
+// Incremented in every child process created using fork(2). Shared by all
+// interpreters in the process.
+static std::atomic<unsigned long> fork_generation(0);
 
-static PyObject* Index_unique_terms(Index* self) {
-    return PyLong_FromLong(self->index_->uniqueTermCount());
+static void IncrementForkGeneration() {
+    ++fork_generation;
 }
 
-static PyObject* Index_term_count(Index* self, PyObject* args) {
-    char* term_object;
+// Read-only tables of an Index (document lengths, external document
+// identifiers and the vocabulary) in a shared anonymous mapping. Processes
+// forked after the tables were built share a single physical copy.
+class SharedTables {
+ public:
+    // Throws lemur::api::Exception on Indri errors and returns NULL, with
+    // errno set, if the mapping cannot be created.
+    static SharedTables* Build(indri::index::DiskIndex* const index,
+                               indri::collection::CompressedCollection* const collection) {
+        const lemur::api::DOCID_T document_base = index->documentBase();
+        const lemur::api::DOCID_T maximum_document = index->documentMaximum();
+
+        std::vector<INT32> document_lengths(maximum_document, 0);
+        std::vector<UINT64> docno_offsets(maximum_document + 1, 0);
+        std::string docnos;
+
+        for (lemur::api::DOCID_T int_document_id = document_base;
+             int_document_id < maximum_document;
+             ++int_document_id) {
+            document_lengths[int_document_id] = index->documentLength(int_document_id);
+
+            docno_offsets[int_document_id] = docnos.size();
+            docnos.append(collection->retrieveMetadatum(int_document_id, "docno"));
+        }
 
-    if (!PyArg_ParseTuple(args, "s", &term_object)) {
-        return NULL;
-    }
+        docno_offsets[maximum_document] = docnos.size();
 
-    return PyLong_FromLong(self->index_->termCount(term_object));
-}
+        // Term identifiers are contiguous and start at 1.
+        const size_t num_terms = index->uniqueTermCount() + 1;
 
-static PyObject* Index_process_term(Index* self, PyObject* args) {
+        std::vector<UINT64> term_offsets(num_terms + 1, 0);
+        std::vector<UINT64> term_document_frequencies(num_terms, 0);
+        std::vector<UINT64> term_frequencies(num_terms, 0);
+        std::vector<std::string> term_strings(num_terms);
+
+        indri::index::VocabularyIterator* const vocabulary_it = index->vocabularyIterator();
+
+        vocabulary_it->startIteration();
+
+        while (!vocabulary_it->finished()) {
+            indri::index::DiskTermData* const term_data = vocabulary_it->currentEntry();
+
+            const lemur::api::TERMID_T term_id = term_data->termID;
+            CHECK_GT(term_id, 0);
+            CHECK(static_cast<size_t>(term_id) < num_terms);
+
+            term_strings[term_id] = term_data->termData->term;
+            term_document_frequencies[term_id] = term_data->termData->corpus.documentCount;
+            term_frequencies[term_id] = term_data->termData->corpus.totalCount;
+
+            vocabulary_it->nextEntry();
+        }
+
+        delete vocabulary_it;
+
+        std::string terms;
+
+        for (size_t term_id = 0; term_id < num_terms; ++term_id) {
+            term_offsets[term_id] = terms.size();
+            terms.append(term_strings[term_id]);
+        }
+
+        term_offsets[num_terms] = terms.size();
+
+        // Layout of the mapping; every array is 8-byte aligned.
+        size_t size = 0;
+
+        const size_t document_lengths_offset = Reserve(&size, document_lengths.size() * sizeof(INT32));
+        const size_t docno_offsets_offset = Reserve(&size, docno_offsets.size() * sizeof(UINT64));
+        const size_t docnos_offset = Reserve(&size, docnos.size());
+        const size_t term_offsets_offset = Reserve(&size, term_offsets.size() * sizeof(UINT64));
+        const size_t term_document_frequencies_offset = Reserve(&size, num_terms * sizeof(UINT64));
+        const size_t term_frequencies_offset = Reserve(&size, num_terms * sizeof(UINT64));
+        const size_t terms_offset = Reserve(&size, terms.size());
+
+        void* const mapping = mmap(NULL, std::max<size_t>(size, 1),
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS,
+                                   -1, 0);
+
+        if (mapping == MAP_FAILED) {
+            return NULL;
+        }
+
+        char* const base = static_cast<char*>(mapping);
+
+        memcpy(base + document_lengths_offset, document_lengths.data(),
+               document_lengths.size() * sizeof(INT32));
+        memcpy(base + docno_offsets_offset, docno_offsets.data(),
+               docno_offsets.size() * sizeof(UINT64));
+        memcpy(base + docnos_offset, docnos.data(), docnos.size());
+        memcpy(base + term_offsets_offset, term_offsets.data(),
+               term_offsets.size() * sizeof(UINT64));
+        memcpy(base + term_document_frequencies_offset, term_document_frequencies.data(),
+               num_terms * sizeof(UINT64));
+        memcpy(base + term_frequencies_offset, term_frequencies.data(),
+               num_terms * sizeof(UINT64));
+        memcpy(base + terms_offset, terms.data(), terms.size());
+
+        // Children can only read the tables.
+        mprotect(mapping, std::max<size_t>(size, 1), PROT_READ);
+
+        SharedTables* const tables = new SharedTables;
+
+        tables->mapping_ = mapping;
+        tables->mapping_size_ = std::max<size_t>(size, 1);
+
+        tables->document_base_ = document_base;
+        tables->maximum_document_ = maximum_document;
+        tables->num_terms_ = num_terms;
+
+        tables->document_lengths_ = reinterpret_cast<const INT32*>(base + document_lengths_offset);
+        tables->docno_offsets_ = reinterpret_cast<const UINT64*>(base + docno_offsets_offset);
+        tables->docnos_ = base + docnos_offset;
+        tables->term_offsets_ = reinterpret_cast<const UINT64*>(base + term_offsets_offset);
+        tables->term_document_frequencies_ =
+            reinterpret_cast<const UINT64*>(base + term_document_frequencies_offset);
+        tables->term_frequencies_ = reinterpret_cast<const UINT64*>(base + term_frequencies_offset);
+        tables->terms_ = base + terms_offset;
+
+        return tables;
+    }
+
+    ~SharedTables() {
+        munmap(mapping_, mapping_size_);
+    }
+
+    lemur::api::DOCID_T document_base() const { return document_base_; }
+    lemur::api::DOCID_T maximum_document() const { return maximum_document_; }
+
+    const INT32* document_lengths() const { return document_lengths_; }
+
+    int document_length(const lemur::api::DOCID_T int_document_id) const {
+        if (int_document_id < document_base_ || int_document_id >= maximum_document_) {
+            return 0;
+        }
+
+        return document_lengths_[int_document_id];
+    }
+
+    // Expects a valid internal document identifier.
+    void ext_document_id(const lemur::api::DOCID_T int_document_id,
+                         const char** const data, size_t* const size) const {
+        *data = docnos_ + docno_offsets_[int_document_id];
+        *size = docno_offsets_[int_document_id + 1] - docno_offsets_[int_document_id];
+    }
+
+    // Number of term identifier slots, including the invalid identifier 0.
+    size_t num_terms() const { return num_terms_; }
+
+    // Expects a term identifier below num_terms().
+    void term(const lemur::api::TERMID_T term_id,
+              const char** const data, size_t* const size) const {
+        *data = terms_ + term_offsets_[term_id];
+        *size = term_offsets_[term_id + 1] - term_offsets_[term_id];
+    }
+
+    UINT64 term_document_frequency(const lemur::api::TERMID_T term_id) const {
+        return term_document_frequencies_[term_id];
+    }
+
+    UINT64 term_frequency(const lemur::api::TERMID_T term_id) const {
+        return term_frequencies_[term_id];
+    }
+
+ private:
+    SharedTables() {}
+
+    static size_t Reserve(size_t* const size, const size_t bytes) {
+        const size_t offset = *size;
+        *size += (bytes + 7) & ~static_cast<size_t>(7);
+
+        return offset;
+    }
+
+    void* mapping_;
+    size_t mapping_size_;
+
+    lemur::api::DOCID_T document_base_;
+    lemur::api::DOCID_T maximum_document_;
+    size_t num_terms_;
+
+    const INT32* document_lengths_;
+    const UINT64* docno_offsets_;
+    const char* docnos_;
+    const UINT64* term_offsets_;
+    const UINT64* term_document_frequencies_;
+    const UINT64* term_frequencies_;
+    const char* terms_;
+};
+
+// SharedBuffer
+
+// Read-only buffer of a one-dimensional array that is owned by a native
+// object, such that memoryviews can be returned without copying. The owner
+// is kept alive until the last view is released.
+typedef struct {
+    PyObject_HEAD
+
+    std::shared_ptr<void>* owner_;
+
+    void* data_;
+    const char* format_;
+    Py_ssize_t num_items_;
+    Py_ssize_t item_size_;
+} SharedBuffer;
+
+static void SharedBuffer_dealloc(SharedBuffer* self) {
+    delete self->owner_;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static int SharedBuffer_getbuffer(SharedBuffer* self, Py_buffer* view, int flags) {
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "Buffer is read-only.");
+        view->obj = NULL;
+
+        return -1;
+    }
+
+    view->obj = (PyObject*) self;
+    Py_INCREF(self);
+
+    view->buf = self->data_;
+    view->len = self->num_items_ * self->item_size_;
+    view->readonly = 1;
+    view->itemsize = self->item_size_;
+    view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>(self->format_) : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->num_items_ : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? &self->item_size_ : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    return 0;
+}
+
+// Returns a read-only memoryview, with the given struct format, on the
+// num_items items at data, which owner keeps alive.
+template <typename T>
+static PyObject* SharedBufferToMemoryView(PyTypeObject* const type,
+                                          const std::shared_ptr<void>& owner,
+                                          const T* const data,
+                                          const size_t num_items,
+                                          const char* format) {
+    SharedBuffer* const buffer = (SharedBuffer*) type->tp_alloc(type, 0);
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    static T empty;
+
+    buffer->owner_ = new std::shared_ptr<void>(owner);
+    buffer->data_ = const_cast<T*>(num_items == 0 ? &empty : data);
+    buffer->format_ = format;
+    buffer->num_items_ = num_items;
+    buffer->item_size_ = sizeof(T);
+
+    PyObject* const view = PyMemoryView_FromObject((PyObject*) buffer);
+    Py_DECREF(buffer);
+
+    return view;
+}
+
+template <typename T>
+static PyObject* SharedBufferToMemoryView(PyTypeObject* const type,
+                                          const std::shared_ptr<void>& owner,
+                                          const std::vector<T>& items,
+                                          const char* format) {
+    return SharedBufferToMemoryView(type, owner, items.data(), items.size(), format);
+}
+
+// Returns an owner for SharedBufferToMemoryView that holds a reference to a
+// Python object, for buffers that live as long as that object.
+static std::shared_ptr<void> PyObjectOwner(PyObject* const obj) {
+    Py_INCREF(obj);
+
+    return std::shared_ptr<void>(obj, [](void* const owned) {
+        Py_DECREF(static_cast<PyObject*>(owned));
+    });
+}
+
+// Document iteration
+
+// Decodes the term lists of a range of documents into batches using
+// num_threads threads, each owning an index reader. Batches are returned in
+// document order, and at most `prefetch` batches are decoded ahead of the
+// consumer. Batches are handed to Python without copying (see SharedBuffer).
+// Every batch is freshly allocated rather than recycled, as Python may hold
+// views on a batch for as long as it likes; allocation is cheap compared to
+// decoding the term lists. Safe for concurrent calls to next.
+class DocumentPrefetcher {
+ public:
+    struct Batch {
+        std::vector<INT32> document_ids;
+        // Terms of document_ids[i] are terms[offsets[i]:offsets[i + 1]].
+        std::vector<INT64> offsets;
+        std::vector<INT32> terms;
+    };
+
+    // Throws lemur::api::Exception if the index cannot be opened.
+    DocumentPrefetcher(const std::string& repository_path,
+                       const std::string& index_path,
+                       const lemur::api::DOCID_T start,
+                       const lemur::api::DOCID_T end,
+                       const size_t batch_size,
+                       const size_t prefetch,
+                       const size_t num_threads)
+            : start_(start), end_(end),
+              batch_size_(batch_size), prefetch_(prefetch),
+              num_batches_((end - start + batch_size - 1) / batch_size),
+              next_batch_(0), next_claimed_(0), num_running_(0),
+              failed_(false), stop_(false) {
+        // DiskIndex is not safe for concurrent use; every thread owns a reader.
+        for (size_t i = 0; i < std::min(num_threads, num_batches_); ++i) {
+            indri::index::DiskIndex* const index = new indri::index::DiskIndex;
+
+            try {
+                index->open(repository_path, index_path);
+            } catch (const lemur::api::Exception& e) {
+                delete index;
+                CloseIndexes();
+
+                throw;
+            }
+
+            indexes_.push_back(index);
+        }
+
+        num_running_ = indexes_.size();
+
+        for (size_t i = 0; i < indexes_.size(); ++i) {
+            threads_.push_back(std::thread(&DocumentPrefetcher::Run, this, indexes_[i]));
+        }
+    }
+
+    ~DocumentPrefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+
+        claimable_cv_.notify_all();
+
+        for (size_t i = 0; i < threads_.size(); ++i) {
+            threads_[i].join();
+        }
+
+        // Every thread closed its index when it finished.
+        for (size_t i = 0; i < indexes_.size(); ++i) {
+            delete indexes_[i];
+        }
+    }
+
+    // Blocks until the next batch is available. Returns NULL at the end of the
+    // range, or on failure, in which case error is set.
+    std::shared_ptr<Batch> next(std::string* const error) {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        ready_cv_.wait(lock, [this]() {
+            return ready_.count(next_batch_) > 0 || failed_ || num_running_ == 0;
+        });
+
+        std::unordered_map<size_t, std::shared_ptr<Batch> >::iterator it =
+            ready_.find(next_batch_);
+
+        if (it == ready_.end()) {
+            *error = error_;
+
+            return std::shared_ptr<Batch>();
+        }
+
+        std::shared_ptr<Batch> batch(std::move(it->second));
+        ready_.erase(it);
+
+        ++next_batch_;
+
+        lock.unlock();
+        claimable_cv_.notify_all();
+
+        return batch;
+    }
+
+ private:
+    void Run(indri::index::DiskIndex* const index) {
+        while (true) {
+            size_t batch_idx;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                claimable_cv_.wait(lock, [this]() {
+                    return stop_ || failed_ || next_claimed_ >= num_batches_ ||
+                           next_claimed_ < next_batch_ + prefetch_;
+                });
+
+                if (stop_ || failed_ || next_claimed_ >= num_batches_) {
+                    break;
+                }
+
+                batch_idx = next_claimed_++;
+            }
+
+            const lemur::api::DOCID_T begin = start_ + batch_idx * batch_size_;
+            const lemur::api::DOCID_T end = std::min<lemur::api::DOCID_T>(
+                end_, begin + batch_size_);
+
+            std::shared_ptr<Batch> batch(new Batch);
+            batch->offsets.push_back(0);
+
+            try {
+                for (lemur::api::DOCID_T document = begin; document < end; ++document) {
+                    const indri::index::TermList* const term_list = index->termList(document);
+
+                    batch->document_ids.push_back(document);
+                    batch->terms.insert(batch->terms.end(),
+                                        term_list->terms().begin(),
+                                        term_list->terms().end());
+                    batch->offsets.push_back(batch->terms.size());
+
+                    delete term_list;
+                }
+            } catch (const lemur::api::Exception& e) {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                failed_ = true;
+                error_ = e.what();
+
+                break;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_[batch_idx] = std::move(batch);
+            }
+
+            ready_cv_.notify_all();
+        }
+
+        // Release the files of the index as soon as the range is decoded.
+        index->close();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --num_running_;
+        }
+
+        ready_cv_.notify_all();
+        claimable_cv_.notify_all();
+    }
+
+    void CloseIndexes() {
+        for (size_t i = 0; i < indexes_.size(); ++i) {
+            indexes_[i]->close();
+            delete indexes_[i];
+        }
+
+        indexes_.clear();
+    }
+
+    const lemur::api::DOCID_T start_;
+    const lemur::api::DOCID_T end_;
+
+    const size_t batch_size_;
+    const size_t prefetch_;
+    const size_t num_batches_;
+
+    std::vector<indri::index::DiskIndex*> indexes_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_;
+    std::condition_variable claimable_cv_;
+
+    // Decoded batches, by batch index, that have not been consumed yet.
+    std::unordered_map<size_t, std::shared_ptr<Batch> > ready_;
+
+    size_t next_batch_;  // Index of the batch returned by the next call to next.
+    size_t next_claimed_;  // Index of the batch decoded next by a thread.
+    size_t num_running_;
+
+    bool failed_;
+    bool stop_;
+    std::string error_;
+};
+
+typedef struct {
+    PyObject_HEAD
+
+    // Kept until dealloc, as other threads may still be waiting on it once
+    // the iterator is exhausted.
+    DocumentPrefetcher* prefetcher_;
+    bool exhausted_;
+
+    // Value of fork_generation when the prefetcher was started.
+    unsigned long fork_generation_;
+} DocumentIterator;
+
+static void DocumentIterator_dealloc(DocumentIterator* self) {
+    // The prefetch thread does not exist in forked children.
+    if (self->prefetcher_ != NULL && self->fork_generation_ == fork_generation) {
+        Py_BEGIN_ALLOW_THREADS
+        delete self->prefetcher_;
+        Py_END_ALLOW_THREADS
+    }
+
+    self->prefetcher_ = NULL;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+// Returns a new DocumentIterator over [start, end). Sets an exception on failure.
+static PyObject* DocumentIterator_create(PyTypeObject* const type,
+                                         const std::string& repository_path,
+                                         const std::string& index_path,
+                                         const lemur::api::DOCID_T start,
+                                         const lemur::api::DOCID_T end,
+                                         const size_t batch_size,
+                                         const size_t prefetch,
+                                         const size_t num_threads) {
+    DocumentIterator* const self = (DocumentIterator*) type->tp_alloc(type, 0);
+
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->prefetcher_ = NULL;
+    self->exhausted_ = false;
+    self->fork_generation_ = fork_generation;
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    try {
+        self->prefetcher_ = new DocumentPrefetcher(
+            repository_path, index_path, start, end, batch_size, prefetch, num_threads);
+    } catch (const lemur::api::Exception& e) {
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+        Py_DECREF(self);
+
+        return NULL;
+    }
+
+    return (PyObject*) self;
+}
+
+static PyObject* DocumentIterator_next(DocumentIterator* self) {
+    if (self->fork_generation_ != fork_generation) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Document iterators cannot be used after fork.");
+
+        return NULL;
+    }
+
+    if (self->exhausted_) {
+        return NULL;
+    }
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return NULL;
+    }
+
+    std::shared_ptr<DocumentPrefetcher::Batch> batch;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    batch = self->prefetcher_->next(&error);
+    Py_END_ALLOW_THREADS
+
+    if (!batch) {
+        self->exhausted_ = true;
+
+        if (!error.empty()) {
+            PyErr_SetString(PyExc_IOError, error.c_str());
+        }
+
+        return NULL;
+    }
+
+    PyObject* const document_ids = SharedBufferToMemoryView(
+        state->shared_buffer_type, batch, batch->document_ids, "i");
+    PyObject* const offsets = SharedBufferToMemoryView(
+        state->shared_buffer_type, batch, batch->offsets, "q");
+    PyObject* const terms = SharedBufferToMemoryView(
+        state->shared_buffer_type, batch, batch->terms, "i");
+
+    if (document_ids == NULL || offsets == NULL || terms == NULL) {
+        Py_XDECREF(document_ids);
+        Py_XDECREF(offsets);
+        Py_XDECREF(terms);
+
+        return NULL;
+    }
+
+    PyObject* const ret = PyTuple_Pack(3, document_ids, offsets, terms);
+
+    Py_DECREF(document_ids);
+    Py_DECREF(offsets);
+    Py_DECREF(terms);
+
+    return ret;
+}
+
+// Co-occurrence counting
+
+// Counts co-occurrences of term pairs within a window over a range of
+// documents. Documents are split in blocks that are processed by threads that
+// each own a DiskIndex and a hash map. Pairs are stored once, as (a, b) with
+// a <= b. When a map outgrows its share of the memory budget, it is spilled to
+// disk as a sorted run; all runs are merged afterwards.
+class CooccurrenceCounter {
+ public:
+    struct Options {
+        std::string repository_path;
+        std::string index_path;
+
+        lemur::api::DOCID_T start;
+        lemur::api::DOCID_T end;
+
+        size_t window;
+        UINT64 min_count;
+
+        // Indexed by term identifier; empty if all terms are included.
+        std::vector<bool> vocabulary_subset;
+
+        size_t num_threads;
+        size_t memory_budget;
+        std::string spill_dir;
+    };
+
+    // Symmetric co-occurrence matrix in coordinate format.
+    struct Result {
+        std::vector<INT32> rows;
+        std::vector<INT32> columns;
+        std::vector<INT64> counts;
+    };
+
+    // Throws lemur::api::Exception on Indri errors and returns false, with
+    // error set, on I/O errors.
+    static bool Count(const Options& options, Result* const result, std::string* const error) {
+        CooccurrenceCounter counter(options);
+
+        return counter.Merge(result, error);
+    }
+
+ private:
+    typedef std::pair<UINT64, UINT64> Entry;  // (pair key, count)
+
+    // Approximate memory use of a hash map entry, including bucket overhead.
+    static const size_t ENTRY_BYTES = 48;
+    static const lemur::api::DOCID_T DOCUMENTS_PER_BLOCK = 256;
+    static const size_t SPILL_BUFFER_ENTRIES = 1 << 12;
+
+    // Sorted run of entries that is either held in memory or spilled to disk.
+    class SortedRun {
+     public:
+        explicit SortedRun(std::vector<Entry>* entries)
+                : entries_(entries), file_(NULL), position_(0), size_(entries->size()) {}
+
+        SortedRun(FILE* file, const size_t size)
+                : entries_(new std::vector<Entry>), file_(file), position_(0), size_(size) {
+            rewind(file_);
+        }
+
+        ~SortedRun() {
+            delete entries_;
+
+            if (file_ != NULL) {
+                fclose(file_);
+            }
+        }
+
+        // Returns false if the run is exhausted or cannot be read.
+        bool next(Entry* const entry) {
+            if (file_ == NULL) {
+                if (position_ >= size_) {
+                    return false;
+                }
+
+                *entry = (*entries_)[position_++];
+
+                return true;
+            }
+
+            if (position_ >= entries_->size()) {
+                entries_->resize(std::min<size_t>(SPILL_BUFFER_ENTRIES, size_));
+
+                if (entries_->empty() ||
+                    fread(entries_->data(), sizeof(Entry), entries_->size(), file_) !=
+                        entries_->size()) {
+                    return false;
+                }
+
+                size_ -= entries_->size();
+                position_ = 0;
+            }
+
+            *entry = (*entries_)[position_++];
+
+            return true;
+        }
+
+     private:
+        std::vector<Entry>* entries_;
+        FILE* file_;
+
+        size_t position_;
+        size_t size_;  // Entries remaining on disk, or in memory in total.
+    };
+
+    explicit CooccurrenceCounter(const Options& options)
+            : options_(options), next_block_(options.start), failed_(false) {}
+
+    ~CooccurrenceCounter() {
+        for (size_t i = 0; i < runs_.size(); ++i) {
+            delete runs_[i];
+        }
+    }
+
+    static UINT64 Key(const lemur::api::TERMID_T a, const lemur::api::TERMID_T b) {
+        return a <= b ?
+            (static_cast<UINT64>(a) << 32) | static_cast<UINT32>(b) :
+            (static_cast<UINT64>(b) << 32) | static_cast<UINT32>(a);
+    }
+
+    bool included(const lemur::api::TERMID_T term_id) const {
+        return term_id > 0 &&
+            (options_.vocabulary_subset.empty() ||
+             (static_cast<size_t>(term_id) < options_.vocabulary_subset.size() &&
+              options_.vocabulary_subset[term_id]));
+    }
+
+    // Sorts a map into a run; spills it to disk if spill is set.
+    bool AddRun(std::unordered_map<UINT64, UINT64>* const counts, const bool spill) {
+        std::vector<Entry>* const entries =
+            new std::vector<Entry>(counts->begin(), counts->end());
+
+        counts->clear();
+        std::sort(entries->begin(), entries->end());
+
+        if (!spill) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            runs_.push_back(new SortedRun(entries));
+
+            return true;
+        }
+
+        std::string path = indri::file::Path::combine(
+            options_.spill_dir, "pyndri-cooccurrence-XXXXXX");
+
+        const int fd = mkstemp(&path[0]);
+        FILE* const file = fd >= 0 ? fdopen(fd, "w+b") : NULL;
+
+        if (file == NULL) {
+            if (fd >= 0) {
+                close(fd);
+                unlink(path.c_str());
+            }
+
+            delete entries;
+            Fail(std::string("Unable to create spill file: ") + strerror(errno));
+
+            return false;
+        }
+
+        // The file is removed once closed.
+        unlink(path.c_str());
+
+        const size_t size = entries->size();
+        const bool written = fwrite(entries->data(), sizeof(Entry), size, file) == size;
+
+        delete entries;
+
+        if (!written || fflush(file) != 0) {
+            fclose(file);
+            Fail(std::string("Unable to write spill file: ") + strerror(errno));
+
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        runs_.push_back(new SortedRun(file, size));
+
+        return true;
+    }
+
+    void Fail(const std::string& error) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (!failed_) {
+            failed_ = true;
+            error_ = error;
+        }
+    }
+
+    void Work() {
+        indri::index::DiskIndex index;
+
+        try {
+            index.open(options_.repository_path, options_.index_path);
+        } catch (const lemur::api::Exception& e) {
+            Fail(e.what());
+
+            return;
+        }
+
+        const size_t max_entries = std::max<size_t>(
+            options_.memory_budget / options_.num_threads / ENTRY_BYTES, 1);
+
+        std::unordered_map<UINT64, UINT64> counts;
+        std::vector<lemur::api::TERMID_T> terms;
+
+        while (!failed_) {
+            const lemur::api::DOCID_T block_start = next_block_.fetch_add(DOCUMENTS_PER_BLOCK);
+
+            if (block_start >= options_.end) {
+                break;
+            }
+
+            const lemur::api::DOCID_T block_end =
+                std::min(block_start + DOCUMENTS_PER_BLOCK, options_.end);
+
+            for (lemur::api::DOCID_T int_document_id = block_start;
+                 int_document_id < block_end;
+                 ++int_document_id) {
+                try {
+                    const indri::index::TermList* const term_list =
+                        index.termList(int_document_id);
+
+                    terms.assign(term_list->terms().begin(), term_list->terms().end());
+
+                    delete term_list;
+                } catch (const lemur::api::Exception& e) {
+                    Fail(e.what());
+
+                    break;
+                }
+
+                for (size_t i = 0; i < terms.size(); ++i) {
+                    if (!included(terms[i])) {
+                        continue;
+                    }
+
+                    const size_t window_end = std::min(terms.size(), i + options_.window + 1);
+
+                    for (size_t j = i + 1; j < window_end; ++j) {
+                        if (included(terms[j])) {
+                            ++counts[Key(terms[i], terms[j])];
+                        }
+                    }
+                }
+
+                if (counts.size() >= max_entries && !AddRun(&counts, true /* spill */)) {
+                    break;
+                }
+            }
+        }
+
+        if (!failed_) {
+            AddRun(&counts, false /* spill */);
+        }
+
+        index.close();
+    }
+
+    bool Merge(Result* const result, std::string* const error) {
+        std::vector<std::thread> threads;
+
+        for (size_t i = 0; i < options_.num_threads; ++i) {
+            threads.push_back(std::thread(&CooccurrenceCounter::Work, this));
+        }
+
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+
+        if (failed_) {
+            *error = error_;
+
+            return false;
+        }
+
+        // k-way merge of the sorted runs.
+        typedef std::pair<Entry, size_t> Head;  // (entry, run)
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+
+        for (size_t run = 0; run < runs_.size(); ++run) {
+            Entry entry;
+
+            if (runs_[run]->next(&entry)) {
+                heads.push(Head(entry, run));
+            }
+        }
+
+        while (!heads.empty()) {
+            const UINT64 key = heads.top().first.first;
+            UINT64 count = 0;
+
+            while (!heads.empty() && heads.top().first.first == key) {
+                const size_t run = heads.top().second;
+                count += heads.top().first.second;
+
+                heads.pop();
+
+                Entry entry;
+
+                if (runs_[run]->next(&entry)) {
+                    heads.push(Head(entry, run));
+                }
+            }
+
+            if (count < options_.min_count) {
+                continue;
+            }
+
+            const INT32 a = static_cast<INT32>(key >> 32);
+            const INT32 b = static_cast<INT32>(key & 0xffffffff);
+
+            result->rows.push_back(a);
+            result->columns.push_back(b);
+            result->counts.push_back(count);
+
+            if (a != b) {
+                result->rows.push_back(b);
+                result->columns.push_back(a);
+                result->counts.push_back(count);
+            }
+        }
+
+        return true;
+    }
+
+    const Options& options_;
+
+    std::atomic<lemur::api::DOCID_T> next_block_;
+
+    std::mutex mutex_;
+    std::vector<SortedRun*> runs_;
+
+    std::atomic<bool> failed_;
+    std::string error_;
+};
+
+// Out-of-class definition, as std::min binds the constant to a reference.
+const size_t CooccurrenceCounter::SPILL_BUFFER_ENTRIES;
+
+// Bag-of-words vectorization
+
+// Term counts of a range of documents in compressed sparse row format.
+struct BagOfWords {
+    std::vector<INT32> data;
+    std::vector<INT32> indices;
+    std::vector<INT64> indptr;
+};
+
+// Builds the bag-of-words rows of the documents in [start, end). Terms are
+// mapped to columns using the dense lookup id_map (indexed by term
+// identifier; negative entries and terms beyond its size are dropped), or to
+// their term identifier if id_map is NULL. The range is partitioned into
+// contiguous parts that are processed by threads owning a DiskIndex. Returns
+// false, with error set, on failure.
+static bool BuildBagOfWords(const std::string& repository_path,
+                            const std::string& index_path,
+                            const lemur::api::DOCID_T start,
+                            const lemur::api::DOCID_T end,
+                            const INT32* const id_map,
+                            const size_t id_map_size,
+                            const size_t num_threads,
+                            BagOfWords* const result,
+                            std::string* const error) {
+    const size_t num_documents = end - start;
+    const size_t num_parts = std::max<size_t>(std::min(num_threads, num_documents), 1);
+
+    std::vector<BagOfWords> parts(num_parts);
+
+    std::mutex error_mutex;
+    bool failed = false;
+
+    ParallelFor(num_parts, num_parts, [&](const size_t part) {
+        const lemur::api::DOCID_T part_start = start + num_documents * part / num_parts;
+        const lemur::api::DOCID_T part_end = start + num_documents * (part + 1) / num_parts;
+
+        BagOfWords* const bow = &parts[part];
+        std::vector<INT32> columns;
+
+        try {
+            indri::index::DiskIndex index;
+            index.open(repository_path, index_path);
+
+            for (lemur::api::DOCID_T int_document_id = part_start;
+                 int_document_id < part_end;
+                 ++int_document_id) {
+                const indri::index::TermList* const term_list =
+                    index.termList(int_document_id);
+
+                columns.clear();
+
+                indri::utility::greedy_vector<lemur::api::TERMID_T>::const_iterator term_it =
+                    term_list->terms().begin();
+
+                for (; term_it != term_list->terms().end(); ++term_it) {
+                    const lemur::api::TERMID_T term_id = *term_it;
+
+                    if (term_id <= 0) {
+                        continue;  // Out-of-vocabulary.
+                    } else if (id_map == NULL) {
+                        columns.push_back(term_id);
+                    } else if (static_cast<size_t>(term_id) < id_map_size &&
+                               id_map[term_id] >= 0) {
+                        columns.push_back(id_map[term_id]);
+                    }
+                }
+
+                delete term_list;
+
+                std::sort(columns.begin(), columns.end());
+
+                for (size_t i = 0; i < columns.size(); ++i) {
+                    if (i > 0 && columns[i] == columns[i - 1]) {
+                        ++bow->data.back();
+                    } else {
+                        bow->indices.push_back(columns[i]);
+                        bow->data.push_back(1);
+                    }
+                }
+
+                bow->indptr.push_back(bow->indices.size());
+            }
+
+            index.close();
+        } catch (const lemur::api::Exception& e) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+
+            failed = true;
+            *error = e.what();
+        }
+    });
+
+    if (failed) {
+        return false;
+    }
+
+    // Concatenate the parts; their row pointers are relative to the part.
+    result->indptr.assign(1, 0);
+
+    for (size_t part = 0; part < num_parts; ++part) {
+        const INT64 offset = result->indices.size();
+
+        result->data.insert(result->data.end(),
+                            parts[part].data.begin(), parts[part].data.end());
+        result->indices.insert(result->indices.end(),
+                               parts[part].indices.begin(), parts[part].indices.end());
+
+        for (size_t i = 0; i < parts[part].indptr.size(); ++i) {
+            result->indptr.push_back(offset + parts[part].indptr[i]);
+        }
+
+        // Release the part early, as the result is of similar size.
+        std::vector<INT32>().swap(parts[part].data);
+        std::vector<INT32>().swap(parts[part].indices);
+    }
+
+    return true;
+}
+
+// Calls fn(index, i) for every i in [0, num_items) using up to num_threads
+// threads. Items are partitioned contiguously and every thread owns a
+// DiskIndex, as DiskIndex is not safe for concurrent use. Returns false, with
+// error set, on failure.
+static bool ParallelForDocuments(const std::string& repository_path,
+                                 const std::string& index_path,
+                                 const size_t num_items,
+                                 const size_t num_threads,
+                                 const std::function<void(indri::index::DiskIndex*, size_t)>& fn,
+                                 std::string* const error) {
+    const size_t num_parts = std::max<size_t>(std::min(num_threads, num_items), 1);
+
+    std::mutex error_mutex;
+    bool failed = false;
+
+    ParallelFor(num_parts, num_parts, [&](const size_t part) {
+        try {
+            indri::index::DiskIndex index;
+            index.open(repository_path, index_path);
+
+            const size_t end = num_items * (part + 1) / num_parts;
+
+            for (size_t i = num_items * part / num_parts; i < end; ++i) {
+                fn(&index, i);
+            }
+
+            index.close();
+        } catch (const lemur::api::Exception& e) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+
+            failed = true;
+            *error = e.what();
+        }
+    });
+
+    return !failed;
+}
+
+// Calls fn(collection, i) for every i in [0, num_items) using up to
+// num_threads threads, each owning a CompressedCollection; analogous to
+// ParallelForDocuments. Returns false, with error set, on failure.
+static bool ParallelForCollection(const std::string& repository_path,
+                                  const size_t num_items,
+                                  const size_t num_threads,
+                                  const std::function<void(indri::collection::CompressedCollection*,
+                                                           size_t)>& fn,
+                                  std::string* const error) {
+    const size_t num_parts = std::max<size_t>(std::min(num_threads, num_items), 1);
+
+    std::mutex error_mutex;
+    bool failed = false;
+
+    ParallelFor(num_parts, num_parts, [&](const size_t part) {
+        try {
+            indri::collection::CompressedCollection collection;
+            collection.open(indri::file::Path::combine(repository_path, "collection"));
+
+            const size_t end = num_items * (part + 1) / num_parts;
+
+            for (size_t i = num_items * part / num_parts; i < end; ++i) {
+                fn(&collection, i);
+            }
+
+            collection.close();
+        } catch (const lemur::api::Exception& e) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+
+            failed = true;
+            *error = e.what();
+        }
+    });
+
+    return !failed;
+}
+
+// Scoring
+
+enum ScoringModel {
+    SCORING_MODEL_DIRICHLET,
+    SCORING_MODEL_JELINEK_MERCER,
+    SCORING_MODEL_BM25,
+    SCORING_MODEL_TFIDF,
+};
+
+struct ScoringParameters {
+    ScoringParameters()
+            : model(SCORING_MODEL_DIRICHLET),
+              mu(2500.0), collection_lambda(0.4), k1(1.2), b(0.75) {}
+
+    ScoringModel model;
+
+    double mu;  // Dirichlet.
+    double collection_lambda;  // Jelinek-Mercer.
+    double k1, b;  // BM25 and TF-IDF.
+};
+
+// Collection statistics of a query term; term_id is 0 for terms that do not
+// occur in the index.
+struct QueryTermStatistics {
+    lemur::api::TERMID_T term_id;
+    UINT64 query_frequency;
+
+    UINT64 collection_frequency;
+    UINT64 document_frequency;
+};
+
+// Scores a document given the frequencies of the distinct query terms within
+// it. Language models follow Indri's #combine: the mean log-probability over
+// query term occurrences, where terms that do not occur in the collection get
+// a collection probability of 1 / (2 |C|).
+static double ScoreDocument(const ScoringParameters& parameters,
+                            const std::vector<QueryTermStatistics>& terms,
+                            const UINT32* const term_frequencies,
+                            const double document_length,
+                            const double collection_length,
+                            const double num_documents) {
+    const double average_document_length =
+        num_documents > 0 ? collection_length / num_documents : 0.0;
+
+    double score = 0.0;
+    UINT64 query_length = 0;
+
+    for (size_t i = 0; i < terms.size(); ++i) {
+        const QueryTermStatistics& term = terms[i];
+        const double tf = term_frequencies[i];
+
+        query_length += term.query_frequency;
+
+        switch (parameters.model) {
+        case SCORING_MODEL_DIRICHLET:
+        case SCORING_MODEL_JELINEK_MERCER: {
+            const double collection_probability = term.collection_frequency > 0 ?
+                term.collection_frequency / collection_length :
+                1.0 / (2.0 * collection_length);
+
+            double probability;
+
+            if (parameters.model == SCORING_MODEL_DIRICHLET) {
+                probability = (tf + parameters.mu * collection_probability) /
+                    (document_length + parameters.mu);
+            } else {
+                probability =
+                    (1.0 - parameters.collection_lambda) *
+                        (document_length > 0 ? tf / document_length : 0.0) +
+                    parameters.collection_lambda * collection_probability;
+            }
+
+            score += term.query_frequency * std::log(probability);
+
+            break;
+        }
+        case SCORING_MODEL_BM25:
+        case SCORING_MODEL_TFIDF: {
+            if (tf == 0) {
+                break;
+            }
+
+            const double df = term.document_frequency;
+            const double normalization = parameters.k1 *
+                ((1.0 - parameters.b) +
+                 parameters.b * (average_document_length > 0 ?
+                                 document_length / average_document_length : 1.0));
+
+            if (parameters.model == SCORING_MODEL_BM25) {
+                const double idf = std::log(
+                    (num_documents - df + 0.5) / (df + 0.5));
+
+                score += term.query_frequency * idf *
+                    (parameters.k1 + 1.0) * tf / (normalization + tf);
+            } else {
+                const double idf = std::log((num_documents + 1.0) / (df + 0.5));
+
+                score += term.query_frequency * idf *
+                    parameters.k1 * tf / (normalization + tf);
+            }
+
+            break;
+        }
+        }
+    }
+
+    if ((parameters.model == SCORING_MODEL_DIRICHLET ||
+         parameters.model == SCORING_MODEL_JELINEK_MERCER) && query_length > 0) {
+        score /= query_length;
+    }
+
+    return score;
+}
+
+// Collects the statistics of the distinct terms of a query given as term
+// identifiers, where identifiers below 1 denote out-of-vocabulary terms.
+static std::vector<QueryTermStatistics> CollectQueryTermStatistics(
+        indri::index::DiskIndex* const index,
+        const std::vector<INT32>& term_ids) {
+    std::vector<QueryTermStatistics> terms;
+
+    for (size_t i = 0; i < term_ids.size(); ++i) {
+        const lemur::api::TERMID_T term_id = std::max(term_ids[i], 0);
+
+        std::vector<QueryTermStatistics>::iterator term_it = terms.begin();
+
+        // Out-of-vocabulary terms are kept apart, as they may differ.
+        while (term_it != terms.end() && (term_it->term_id != term_id || term_id == 0)) {
+            ++term_it;
+        }
+
+        if (term_it != terms.end()) {
+            ++term_it->query_frequency;
+
+            continue;
+        }
+
+        QueryTermStatistics term = {term_id, 1, 0, 0};
+
+        if (term_id > 0) {
+            indri::index::DocListIterator* const postings = index->docListIterator(term_id);
+
+            if (postings != NULL) {
+                term.collection_frequency = postings->termData()->corpus.totalCount;
+                term.document_frequency = postings->termData()->corpus.documentCount;
+
+                delete postings;
+            }
+        }
+
+        terms.push_back(term);
+    }
+
+    return terms;
+}
+
+// Computes the scores of documents directly from the postings. Candidate
+// documents are sorted and split into contiguous chunks, such that every
+// thread advances the posting list of every query term once over its chunk.
+// Scores of documents outside [document_base, maximum_document) are NaN.
+// Returns false, with error set, on failure.
+static bool ScoreDocuments(const std::string& repository_path,
+                           const std::string& index_path,
+                           const std::vector<QueryTermStatistics>& terms,
+                           const double collection_length,
+                           const double num_documents,
+                           const lemur::api::DOCID_T document_base,
+                           const lemur::api::DOCID_T maximum_document,
+                           const std::vector<INT32>& document_ids,
+                           const ScoringParameters& parameters,
+                           const size_t num_threads,
+                           std::vector<double>* const scores,
+                           std::string* const error) {
+    // Positions of the candidates in ascending document order.
+    std::vector<size_t> order(document_ids.size());
+
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), [&document_ids](const size_t a, const size_t b) {
+        return document_ids[a] < document_ids[b];
+    });
+
+    scores->assign(document_ids.size(), 0.0);
+
+    const size_t num_chunks = std::max<size_t>(std::min(num_threads, order.size()), 1);
+
+    return ParallelForDocuments(
+        repository_path, index_path, num_chunks, num_chunks,
+        [&](indri::index::DiskIndex* const thread_index, const size_t chunk) {
+            const size_t begin = order.size() * chunk / num_chunks;
+            const size_t end = order.size() * (chunk + 1) / num_chunks;
+
+            // Row-major matrix of term frequencies, one row per candidate.
+            std::vector<UINT32> term_frequencies((end - begin) * terms.size(), 0);
+
+            for (size_t t = 0; t < terms.size(); ++t) {
+                if (terms[t].term_id <= 0 || terms[t].collection_frequency == 0) {
+                    continue;
+                }
+
+                indri::index::DocListIterator* const postings =
+                    thread_index->docListIterator(terms[t].term_id);
+
+                if (postings == NULL) {
+                    continue;
+                }
+
+                postings->startIteration();
+
+                for (size_t i = begin; i < end && !postings->finished(); ++i) {
+                    const lemur::api::DOCID_T int_document_id = document_ids[order[i]];
+
+                    // Skips to the first posting at or beyond the document.
+                    if (!postings->nextEntry(int_document_id)) {
+                        break;
+                    }
+
+                    const indri::index::DocListIterator::DocumentData* const entry =
+                        postings->currentEntry();
+
+                    if (entry->document == int_document_id) {
+                        term_frequencies[(i - begin) * terms.size() + t] =
+                            entry->positions.size();
+                    }
+                }
+
+                delete postings;
+            }
+
+            for (size_t i = begin; i < end; ++i) {
+                const lemur::api::DOCID_T int_document_id = document_ids[order[i]];
+
+                if (int_document_id < document_base || int_document_id >= maximum_document) {
+                    (*scores)[order[i]] = NAN;
+
+                    continue;
+                }
+
+                (*scores)[order[i]] = ScoreDocument(
+                    parameters, terms,
+                    term_frequencies.data() + (i - begin) * terms.size(),
+                    thread_index->documentLength(int_document_id),
+                    collection_length, num_documents);
+            }
+        },
+        error);
+}
+
+// A retrieval score and internal document identifier.
+typedef std::pair<double, lemur::api::DOCID_T> ScoredDocument;
+
+// Orders documents by descending score, breaking ties by identifier.
+static bool CompareScoredDocuments(const ScoredDocument& a, const ScoredDocument& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+// Ranks the documents that contain at least one query term under several
+// scoring configurations in a single document-at-a-time pass over the
+// postings. The document range is split into chunks, each traversed by a
+// thread with its own DiskIndex that keeps a top-k heap per configuration.
+// Rankings are sorted by descending score. Returns false, with error set, on
+// failure.
+static bool SweepScoringParameters(
+        const std::string& repository_path,
+        const std::string& index_path,
+        const std::vector<QueryTermStatistics>& terms,
+        const double collection_length,
+        const double num_documents,
+        const lemur::api::DOCID_T document_base,
+        const lemur::api::DOCID_T maximum_document,
+        const std::vector<ScoringParameters>& configurations,
+        const size_t results_requested,
+        const size_t num_threads,
+        std::vector<std::vector<ScoredDocument> >* const rankings,
+        std::string* const error) {
+    typedef std::vector<ScoredDocument> Ranking;
+
+    const size_t num_documents_in_range = maximum_document - document_base;
+    const size_t num_chunks = std::max<size_t>(std::min(num_threads, num_documents_in_range), 1);
+
+    // Top results per chunk and configuration, as min-heaps.
+    std::vector<std::vector<Ranking> > chunk_rankings(
+        num_chunks, std::vector<Ranking>(configurations.size()));
+
+    const bool failed = !ParallelForDocuments(
+        repository_path, index_path, num_chunks, num_chunks,
+        [&](indri::index::DiskIndex* const thread_index, const size_t chunk) {
+            const lemur::api::DOCID_T chunk_begin =
+                document_base + num_documents_in_range * chunk / num_chunks;
+            const lemur::api::DOCID_T chunk_end =
+                document_base + num_documents_in_range * (chunk + 1) / num_chunks;
+
+            std::vector<indri::index::DocListIterator*> postings(terms.size(), NULL);
+
+            for (size_t t = 0; t < terms.size(); ++t) {
+                if (terms[t].term_id <= 0 || terms[t].collection_frequency == 0) {
+                    continue;
+                }
+
+                postings[t] = thread_index->docListIterator(terms[t].term_id);
+
+                if (postings[t] == NULL) {
+                    continue;
+                }
+
+                postings[t]->startIteration();
+
+                if (!postings[t]->nextEntry(chunk_begin)) {
+                    delete postings[t];
+                    postings[t] = NULL;
+                }
+            }
+
+            std::vector<UINT32> term_frequencies(terms.size());
+            std::vector<Ranking>& heaps = chunk_rankings[chunk];
+
+            while (true) {
+                // The next document that contains any of the terms.
+                lemur::api::DOCID_T int_document_id = chunk_end;
+
+                for (size_t t = 0; t < terms.size(); ++t) {
+                    if (postings[t] != NULL) {
+                        int_document_id = std::min(
+                            int_document_id, postings[t]->currentEntry()->document);
+                    }
+                }
+
+                if (int_document_id >= chunk_end) {
+                    break;
+                }
+
+                for (size_t t = 0; t < terms.size(); ++t) {
+                    term_frequencies[t] = 0;
+
+                    if (postings[t] == NULL ||
+                        postings[t]->currentEntry()->document != int_document_id) {
+                        continue;
+                    }
+
+                    term_frequencies[t] = postings[t]->currentEntry()->positions.size();
+
+                    if (!postings[t]->nextEntry()) {
+                        delete postings[t];
+                        postings[t] = NULL;
+                    }
+                }
+
+                const double document_length = thread_index->documentLength(int_document_id);
+
+                for (size_t c = 0; c < configurations.size(); ++c) {
+                    const double score = ScoreDocument(
+                        configurations[c], terms, term_frequencies.data(),
+                        document_length, collection_length, num_documents);
+
+                    Ranking& heap = heaps[c];
+
+                    const ScoredDocument result(score, int_document_id);
+
+                    // The heap front is the worst of the retained results.
+                    if (heap.size() < results_requested) {
+                        heap.push_back(result);
+                        std::push_heap(heap.begin(), heap.end(), &CompareScoredDocuments);
+                    } else if (results_requested > 0 &&
+                               CompareScoredDocuments(result, heap.front())) {
+                        std::pop_heap(heap.begin(), heap.end(), &CompareScoredDocuments);
+                        heap.back() = result;
+                        std::push_heap(heap.begin(), heap.end(), &CompareScoredDocuments);
+                    }
+                }
+            }
+
+            for (size_t t = 0; t < terms.size(); ++t) {
+                delete postings[t];
+            }
+        },
+        error);
+
+    if (failed) {
+        return false;
+    }
+
+    rankings->assign(configurations.size(), Ranking());
+
+    for (size_t c = 0; c < configurations.size(); ++c) {
+        Ranking& ranking = (*rankings)[c];
+
+        for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+            ranking.insert(ranking.end(),
+                           chunk_rankings[chunk][c].begin(), chunk_rankings[chunk][c].end());
+        }
+
+        std::sort(ranking.begin(), ranking.end(), &CompareScoredDocuments);
+
+        if (ranking.size() > results_requested) {
+            ranking.resize(results_requested);
+        }
+    }
+
+    return true;
+}
+
+// Embeddings
+
+// y += a * x over n floats.
+static void AddScaled(const float a, const float* const x, float* const y, const size_t n) {
+    size_t i = 0;
+
+#if defined(__AVX__)
+    const __m256 a8 = _mm256_set1_ps(a);
+
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_add_ps(
+            _mm256_loadu_ps(y + i), _mm256_mul_ps(a8, _mm256_loadu_ps(x + i))));
+    }
+#elif defined(__SSE__)
+    const __m128 a4 = _mm_set1_ps(a);
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(y + i, _mm_add_ps(
+            _mm_loadu_ps(y + i), _mm_mul_ps(a4, _mm_loadu_ps(x + i))));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+// Inner product of x and y over n floats.
+static float Dot(const float* const x, const float* const y, const size_t n) {
+    size_t i = 0;
+    float result = 0.0f;
+
+#if defined(__AVX__)
+    __m256 sum8 = _mm256_setzero_ps();
+
+    for (; i + 8 <= n; i += 8) {
+        sum8 = _mm256_add_ps(sum8, _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+
+    float partial8[8];
+    _mm256_storeu_ps(partial8, sum8);
+
+    for (size_t j = 0; j < 8; ++j) {
+        result += partial8[j];
+    }
+#elif defined(__SSE__)
+    __m128 sum4 = _mm_setzero_ps();
+
+    for (; i + 4 <= n; i += 4) {
+        sum4 = _mm_add_ps(sum4, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+
+    float partial4[4];
+    _mm_storeu_ps(partial4, sum4);
+
+    for (size_t j = 0; j < 4; ++j) {
+        result += partial4[j];
+    }
+#endif
+
+    for (; i < n; ++i) {
+        result += x[i] * y[i];
+    }
+
+    return result;
+}
+
+// Computes the weighted centroid of the embeddings of the terms of every
+// document into the row-major centroids matrix. Every occurrence of a term
+// contributes its weight (e.g., its idf, such that a term contributes tf * idf
+// in total), or 1 if weights is empty. Terms without an embedding row are
+// skipped; documents without any are left at zero. Returns false, with error
+// set, on failure.
+static bool ComputeDocumentCentroids(const std::string& repository_path,
+                                     const std::string& index_path,
+                                     const std::vector<INT32>& document_ids,
+                                     const float* const embeddings,
+                                     const size_t num_embeddings,
+                                     const size_t dimensionality,
+                                     const std::vector<float>& weights,
+                                     const size_t num_threads,
+                                     float* const centroids,
+                                     std::string* const error) {
+    std::fill(centroids, centroids + document_ids.size() * dimensionality, 0.0f);
+
+    return ParallelForDocuments(
+        repository_path, index_path, document_ids.size(), num_threads,
+        [&](indri::index::DiskIndex* const thread_index, const size_t i) {
+            const indri::index::TermList* const term_list =
+                thread_index->termList(document_ids[i]);
+
+            if (term_list == NULL) {
+                return;
+            }
+
+            float* const centroid = centroids + i * dimensionality;
+            double total_weight = 0.0;
+
+            indri::utility::greedy_vector<lemur::api::TERMID_T>::const_iterator term_it =
+                term_list->terms().begin();
+
+            for (; term_it != term_list->terms().end(); ++term_it) {
+                const lemur::api::TERMID_T term_id = *term_it;
+
+                if (term_id <= 0 || static_cast<size_t>(term_id) >= num_embeddings) {
+                    continue;
+                }
+
+                const float weight = weights.empty() ? 1.0f : weights[term_id];
+
+                if (weight == 0.0f) {
+                    continue;
+                }
+
+                AddScaled(weight, embeddings + term_id * dimensionality,
+                          centroid, dimensionality);
+
+                total_weight += weight;
+            }
+
+            delete term_list;
+
+            if (total_weight > 0.0) {
+                const float scale = 1.0 / total_weight;
+
+                for (size_t d = 0; d < dimensionality; ++d) {
+                    centroid[d] *= scale;
+                }
+            }
+        },
+        error);
+}
+
+// Computes the cosine similarity between every query and every vector into the
+// row-major (num_queries, num_vectors) similarities matrix. Similarities
+// involving a zero vector are 0.
+static void ComputeCosineSimilarities(const float* const vectors,
+                                      const size_t num_vectors,
+                                      const float* const queries,
+                                      const size_t num_queries,
+                                      const size_t dimensionality,
+                                      const size_t num_threads,
+                                      float* const similarities) {
+    const size_t block_size = 256;
+    const size_t num_blocks = (num_vectors + block_size - 1) / block_size;
+
+    std::vector<float> query_norms(num_queries);
+
+    for (size_t q = 0; q < num_queries; ++q) {
+        query_norms[q] = std::sqrt(Dot(queries + q * dimensionality,
+                                       queries + q * dimensionality,
+                                       dimensionality));
+    }
+
+    // Blocks of vectors are scored against all queries, such that every vector
+    // is read once while the queries stay in cache.
+    ParallelFor(std::max<size_t>(std::min(num_threads, num_blocks), 1), num_blocks,
+                [&](const size_t block) {
+        const size_t end = std::min(num_vectors, (block + 1) * block_size);
+
+        for (size_t v = block * block_size; v < end; ++v) {
+            const float* const vector = vectors + v * dimensionality;
+            const float norm = std::sqrt(Dot(vector, vector, dimensionality));
+
+            for (size_t q = 0; q < num_queries; ++q) {
+                const float denominator = norm * query_norms[q];
+
+                similarities[q * num_vectors + v] = denominator > 0.0f ?
+                    Dot(vector, queries + q * dimensionality, dimensionality) / denominator :
+                    0.0f;
+            }
+        }
+    });
+}
+
+// Warm-up
+
+// Files of an index directory per warm-up component, in prefetch order.
+static const char* const WARM_UP_COMPONENTS[] = {
+    "vocabulary", "lengths", "postings", "documents", "collection", NULL};
+
+static const size_t WARM_UP_CHUNK_SIZE = 4 << 20;
+
+// Appends the paths of the regular files below a directory.
+static void ListFiles(const std::string& directory, std::vector<std::string>* const paths) {
+    DIR* const dir = opendir(directory.c_str());
+
+    if (dir == NULL) {
+        return;
+    }
+
+    std::vector<std::string> entries;
+
+    for (struct dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            entries.push_back(entry->d_name);
+        }
+    }
+
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end());
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const std::string path = indri::file::Path::combine(directory, entries[i]);
+
+        struct stat st;
+
+        if (stat(path.c_str(), &st) != 0) {
+            continue;
+        } else if (S_ISDIR(st.st_mode)) {
+            ListFiles(path, paths);
+        } else if (S_ISREG(st.st_mode)) {
+            paths->push_back(path);
+        }
+    }
+}
+
+// Returns the warm-up component of a file of the index directory, or NULL.
+static const char* WarmUpComponent(const std::string& file_name) {
+    if (file_name.compare(0, 8, "frequent") == 0 ||
+        file_name.compare(0, 10, "infrequent") == 0) {
+        return "vocabulary";  // Term strings, statistics and identifiers.
+    } else if (file_name == "documentLengths" || file_name == "documentStatistics") {
+        return "lengths";
+    } else if (file_name == "invertedFile") {
+        return "postings";
+    } else if (file_name == "directFile") {
+        return "documents";
+    }
+
+    return NULL;
+}
+
+// Collects the files of the given components (or all files of the index and
+// collection if components is empty), ordered as in WARM_UP_COMPONENTS.
+static void CollectWarmUpPaths(const std::string& repository_path,
+                               const std::string& index_path,
+                               const std::vector<std::string>& components,
+                               std::vector<std::string>* const paths) {
+    std::vector<std::string> index_files;
+    ListFiles(indri::file::Path::combine(repository_path, index_path), &index_files);
+
+    std::vector<std::string> collection_files;
+    ListFiles(indri::file::Path::combine(repository_path, "collection"), &collection_files);
+
+    if (components.empty()) {
+        paths->insert(paths->end(), index_files.begin(), index_files.end());
+        paths->insert(paths->end(), collection_files.begin(), collection_files.end());
+
+        return;
+    }
+
+    for (const char* const* component = WARM_UP_COMPONENTS; *component != NULL; ++component) {
+        if (std::find(components.begin(), components.end(), *component) == components.end()) {
+            continue;
+        } else if (strcmp(*component, "collection") == 0) {
+            paths->insert(paths->end(), collection_files.begin(), collection_files.end());
+
+            continue;
+        }
+
+        for (size_t i = 0; i < index_files.size(); ++i) {
+            const char* const file_component = WarmUpComponent(
+                indri::file::Path::filename(index_files[i]));
+
+            if (file_component != NULL && strcmp(file_component, *component) == 0) {
+                paths->push_back(index_files[i]);
+            }
+        }
+    }
+}
+
+// Faults index files into the page cache on a background thread, optionally
+// pinning them in memory using mlock until the warmer is destroyed.
+class IndexWarmer {
+ public:
+    struct Progress {
+        UINT64 bytes_done;
+        UINT64 bytes_total;
+        UINT64 bytes_locked;
+
+        bool running;
+        std::string error;
+    };
+
+    IndexWarmer() : bytes_done_(0), bytes_total_(0), bytes_locked_(0),
+                    running_(false), stop_(false) {}
+
+    ~IndexWarmer() {
+        stop_ = true;
+        Wait();
+
+        for (size_t i = 0; i < locked_.size(); ++i) {
+            munlock(locked_[i].first, locked_[i].second);
+            munmap(locked_[i].first, locked_[i].second);
+        }
+    }
+
+    // Waits for a previous warm-up to finish before starting.
+    void Start(const std::vector<std::string>& paths, const bool lock) {
+        Wait();
+
+        UINT64 bytes_total = 0;
+
+        for (size_t i = 0; i < paths.size(); ++i) {
+            struct stat st;
+
+            if (stat(paths[i].c_str(), &st) == 0) {
+                bytes_total += st.st_size;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            error_.clear();
+        }
+
+        bytes_done_ = 0;
+        bytes_total_ = bytes_total;
+        running_ = true;
+
+        thread_ = std::thread(&IndexWarmer::Run, this, paths, lock);
+    }
+
+    void Wait() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    Progress progress() {
+        Progress progress;
+
+        progress.bytes_done = bytes_done_;
+        progress.bytes_total = bytes_total_;
+        progress.bytes_locked = bytes_locked_;
+        progress.running = running_;
+
+        std::lock_guard<std::mutex> guard(mutex_);
+        progress.error = error_;
+
+        return progress;
+    }
+
+ private:
+    void Run(const std::vector<std::string> paths, const bool lock) {
+        std::string error;
+
+        for (size_t i = 0; i < paths.size() && !stop_; ++i) {
+            if (!WarmFile(paths[i], lock, &error)) {
+                std::lock_guard<std::mutex> guard(mutex_);
+                error_ = error;
+
+                break;
+            }
+        }
+
+        running_ = false;
+    }
+
+    // Returns false, with error set, on failure.
+    bool WarmFile(const std::string& path, const bool lock, std::string* const error) {
+        const int fd = open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            *error = path + ": " + strerror(errno);
+
+            return false;
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) != 0) {
+            *error = path + ": " + strerror(errno);
+            close(fd);
+
+            return false;
+        }
+
+        const size_t size = st.st_size;
+
+        if (size == 0) {
+            close(fd);
+
+            return true;
+        }
+
+        char* const data = static_cast<char*>(
+            mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0));
+        close(fd);
+
+        if (data == MAP_FAILED) {
+            *error = path + ": " + strerror(errno);
+
+            return false;
+        }
+
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        volatile char sink = 0;
+
+        // Touches every page, such that progress reflects resident data.
+        for (size_t offset = 0; offset < size && !stop_; offset += WARM_UP_CHUNK_SIZE) {
+            const size_t length = std::min(WARM_UP_CHUNK_SIZE, size - offset);
+
+            madvise(data + offset, length, MADV_WILLNEED);
+
+            for (size_t page = offset; page < offset + length; page += page_size) {
+                sink ^= data[page];
+            }
+
+            bytes_done_ += length;
+        }
+
+        if (lock && !stop_) {
+            if (mlock(data, size) != 0) {
+                *error = path + ": mlock: " + strerror(errno);
+                munmap(data, size);
+
+                return false;
+            }
+
+            locked_.push_back(std::make_pair(data, size));
+            bytes_locked_ += size;
+        } else {
+            munmap(data, size);
+        }
+
+        return true;
+    }
+
+    std::thread thread_;
+
+    std::atomic<UINT64> bytes_done_;
+    std::atomic<UINT64> bytes_total_;
+    std::atomic<UINT64> bytes_locked_;
+
+    std::atomic<bool> running_;
+    std::atomic<bool> stop_;
+
+    std::mutex mutex_;
+    std::string error_;
+
+    // Only accessed by the warm-up thread, or after joining it.
+    std::vector<std::pair<char*, size_t> > locked_;
+};
+
+// Term statistics
+
+struct TermStatistics {
+    lemur::api::TERMID_T term_id;  // 0 for out-of-vocabulary terms.
+
+    UINT64 document_frequency;
+    UINT64 collection_frequency;
+};
+
+// Bounded memo of the statistics of hot terms, keyed by term and by term
+// identifier. Cleared entirely once full. Not synchronized: the module does
+// not rely on the GIL (Py_MOD_GIL_NOT_USED), hence every access must happen
+// within the critical section of its Index (see Index_term_statistics).
+class TermStatisticsCache {
+ public:
+    explicit TermStatisticsCache(const size_t capacity) : capacity_(capacity) {}
+
+    bool lookup(const std::string& term, TermStatistics* const stats) const {
+        std::unordered_map<std::string, TermStatistics>::const_iterator it = by_term_.find(term);
+
+        if (it == by_term_.end()) {
+            return false;
+        }
+
+        *stats = it->second;
+
+        return true;
+    }
+
+    bool lookup(const lemur::api::TERMID_T term_id, TermStatistics* const stats) const {
+        std::unordered_map<lemur::api::TERMID_T, TermStatistics>::const_iterator it =
+            by_id_.find(term_id);
+
+        if (it == by_id_.end()) {
+            return false;
+        }
+
+        *stats = it->second;
+
+        return true;
+    }
+
+    void insert(const std::string& term, const TermStatistics& stats) {
+        if (by_term_.size() >= capacity_) {
+            by_term_.clear();
+        }
+
+        by_term_[term] = stats;
+    }
+
+    void insert(const lemur::api::TERMID_T term_id, const TermStatistics& stats) {
+        if (by_id_.size() >= capacity_) {
+            by_id_.clear();
+        }
+
+        by_id_[term_id] = stats;
+    }
+
+ private:
+    const size_t capacity_;
+
+    std::unordered_map<std::string, TermStatistics> by_term_;
+    std::unordered_map<lemur::api::TERMID_T, TermStatistics> by_id_;
+};
+
+static const size_t TERM_STATISTICS_CACHE_SIZE = 1 << 14;
+
+// Index
+
+typedef struct {
+    PyObject_HEAD
+
+    char* repository_path_;
+
+    indri::api::Parameters* parameters_;
+
+    // Path of the index within the repository.
+    std::string* index_path_;
+
+    indri::collection::CompressedCollection* collection_;
+    indri::index::DiskIndex* index_;
+
+    indri::api::QueryEnvironment* query_env_;
+
+    // Whether the Indri objects above have been opened; see Index_disk_index.
+    bool collection_opened_;
+    bool index_opened_;
+    bool query_env_opened_;
+
+    // Value of fork_generation when the Indri objects above were created.
+    unsigned long fork_generation_;
+
+    SharedTables* shared_tables_;
+
+    TermStatisticsCache* term_statistics_cache_;
+
+    // Strings of the terms converted so far, indexed by term identifier
+    // (NULL if not yet converted); see Index_term_string.
+    std::vector<PyObject*>* term_strings_;
+
+    IndexWarmer* warmer_;
+} Index;
+
+static void Index_dealloc(Index* self) {
+    // After a fork, the Indri objects may hold locks that were acquired by
+    // other threads of the parent; abandon them instead (see Index_reopen).
+    if (self->fork_generation_ == fork_generation) {
+        // self->collection_->close();
+        if (self->index_opened_) {
+            self->index_->close();
+        }
+        // self->query_env_->close();
+
+        // delete self->collection_;
+        delete self->index_;
+        delete self->query_env_;
+
+        delete self->warmer_;
+    }
+
+    delete self->parameters_;
+    delete self->index_path_;
+
+    delete self->shared_tables_;
+    delete self->term_statistics_cache_;
+
+    if (self->term_strings_ != NULL) {
+        for (PyObject* const term_obj : *self->term_strings_) {
+            Py_XDECREF(term_obj);
+        }
+
+        delete self->term_strings_;
+    }
+
+    delete [] self->repository_path_;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static PyObject* Index_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    Index* self;
+
+    self = (Index*) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->repository_path_ = NULL;
+
+        self->parameters_ = new indri::api::Parameters;
+        self->index_path_ = new std::string;
+
+        self->collection_ = new indri::collection::CompressedCollection;
+        self->index_ = new indri::index::DiskIndex;
+
+        self->query_env_ = new indri::api::QueryEnvironment;
+
+        self->collection_opened_ = false;
+        self->index_opened_ = false;
+        self->query_env_opened_ = false;
+
+        self->fork_generation_ = fork_generation;
+
+        self->shared_tables_ = NULL;
+
+        self->term_statistics_cache_ = new TermStatisticsCache(TERM_STATISTICS_CACHE_SIZE);
+        self->term_strings_ = NULL;
+
+        self->warmer_ = NULL;
+    }
+
+    return (PyObject*) self;
+}
+
+// Abandons the Indri objects inherited from the parent when called in a
+// process forked after the Index was opened, as file positions, buffers and
+// locks cannot be shared with the parent. The inherited objects are not
+// closed, as they may hold locks acquired by other threads of the parent.
+// Fresh objects are opened on first use.
+static void Index_reopen(Index* self) {
+    if (self->fork_generation_ == fork_generation) {
+        return;
+    }
+
+    self->collection_ = new indri::collection::CompressedCollection;
+    self->index_ = new indri::index::DiskIndex;
+    self->query_env_ = new indri::api::QueryEnvironment;
+
+    self->collection_opened_ = false;
+    self->index_opened_ = false;
+    self->query_env_opened_ = false;
+
+    // The warm-up thread does not exist in the child.
+    self->warmer_ = NULL;
+
+    self->fork_generation_ = fork_generation;
+}
+
+// The accessors below open their Indri object on first use, such that jobs
+// that only need some of them do not pay for opening all. Return NULL, with an
+// exception set, on failure.
+
+static indri::index::DiskIndex* Index_disk_index(Index* self) {
+    Index_reopen(self);
+
+    if (!self->index_opened_) {
+        try {
+            self->index_->open(self->repository_path_, *self->index_path_);
+        } catch (const lemur::api::Exception& e) {
+            PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+            return NULL;
+        }
+
+        self->index_opened_ = true;
+    }
+
+    return self->index_;
+}
+
+static indri::collection::CompressedCollection* Index_collection(Index* self) {
+    Index_reopen(self);
+
+    if (!self->collection_opened_) {
+        try {
+            self->collection_->open(
+                indri::file::Path::combine(self->repository_path_, "collection"));
+        } catch (const lemur::api::Exception& e) {
+            PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+            return NULL;
+        }
+
+        self->collection_opened_ = true;
+    }
+
+    return self->collection_;
+}
+
+static indri::api::QueryEnvironment* Index_query_env(Index* self) {
+    Index_reopen(self);
+
+    // TODO(cvangysel): possibly remove query_env_ in the future.
+    if (!self->query_env_opened_) {
+        try {
+            self->query_env_->addIndex(self->repository_path_);
+        } catch (const lemur::api::Exception& e) {
+            PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+            return NULL;
+        }
+
+        self->query_env_opened_ = true;
+    }
+
+    return self->query_env_;
+}
+
+// Returns a new reference to the string of term_id, given its encoded form.
+// Every term is decoded at most once; later calls share the same object.
+static PyObject* Index_intern_term(Index* self,
+                                   const size_t num_terms,
+                                   const lemur::api::TERMID_T term_id,
+                                   const char* const data,
+                                   const size_t size) {
+    if (self->term_strings_ == NULL) {
+        self->term_strings_ = new std::vector<PyObject*>(num_terms, NULL);
+    }
+
+    PyObject*& term_obj = (*self->term_strings_)[term_id];
+
+    if (term_obj == NULL) {
+        term_obj = PyUnicode_Decode(data, size, ENCODING, "strict");
+
+        if (term_obj == NULL) {
+            return NULL;
+        }
+    }
+
+    Py_INCREF(term_obj);
+
+    return term_obj;
+}
+
+// Returns a new reference to the string of term_id, which should be within
+// [1, uniqueTermCount]. The index may be NULL when shared tables are used.
+static PyObject* Index_term_string(Index* self,
+                                   indri::index::DiskIndex* const index,
+                                   const lemur::api::TERMID_T term_id) {
+    if (self->term_strings_ != NULL && (*self->term_strings_)[term_id] != NULL) {
+        PyObject* const term_obj = (*self->term_strings_)[term_id];
+        Py_INCREF(term_obj);
+
+        return term_obj;
+    }
+
+    if (self->shared_tables_ != NULL) {
+        const char* data;
+        size_t size;
+
+        self->shared_tables_->term(term_id, &data, &size);
+
+        return Index_intern_term(self, self->shared_tables_->num_terms(),
+                                 term_id, data, size);
+    }
+
+    const std::string term = index->term(term_id);
+
+    return Index_intern_term(self, index->uniqueTermCount() + 1,
+                             term_id, term.c_str(), term.size());
+}
+
+// Starts warming up the given components in the background, where no
+// components denotes the default prefetch set, or the whole index when
+// locking it in memory.
+static void Index_start_warm_up(Index* self,
+                                const std::vector<std::string>& components,
+                                const bool lock_memory) {
+    static const std::vector<std::string> default_components = {
+        "vocabulary", "lengths", "postings"};
+
+    std::vector<std::string> paths;
+
+    CollectWarmUpPaths(
+        self->repository_path_, *self->index_path_,
+        components.empty() && !lock_memory ? default_components : components,
+        &paths);
+
+    if (self->warmer_ == NULL) {
+        self->warmer_ = new IndexWarmer;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+
+    self->warmer_->Start(paths, lock_memory);
+
+    Py_END_ALLOW_THREADS
+}
+
+static int Index_init(Index* self, PyObject* args, PyObject* kwds) {
+    const char* repository_path = NULL;
+    int shared_tables = 0;
+    int warm_up = 0;
+    int lock_memory = 0;
+
+    static char* kwlist[] = {"repository_path", "shared_tables", "warm_up",
+                             "lock_memory", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|ppp", kwlist,
+                                     &repository_path,
+                                     &shared_tables,
+                                     &warm_up,
+                                     &lock_memory)) {
+        return -1;
+    }
+
+    const size_t repository_path_length = strlen(repository_path);
+
+    self->repository_path_ = new char[repository_path_length + 1];
+    memcpy(self->repository_path_, repository_path, repository_path_length);
+    self->repository_path_[repository_path_length] = 0;
+
+    // Load parameters.
+    try {
+        self->parameters_->loadFile(
+            indri::file::Path::combine(repository_path, "manifest"));
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return -1;
+    }
+
+    // Load index.
+    std::string index_path = "index";
+
+    indri::api::Parameters container = (*self->parameters_)["indexes"];
+
+    if(container.exists("index")) {
+        indri::api::Parameters indexes = container["index"];
+
+        if (indexes.size() != 1) {
+            PyErr_SetString(PyExc_IOError, "Indri repository contain more than one index.");
+
+            return -1;
+        }
+
+        index_path = indri::file::Path::combine(
+            index_path, (std::string) indexes[static_cast<size_t>(0)]);
+    } else {
+        PyErr_SetString(PyExc_IOError, "Indri repository does not contain an index.");
+
+        return -1;
+    }
+
+    *self->index_path_ = index_path;
+
+    if (shared_tables) {
+        indri::index::DiskIndex* const index = Index_disk_index(self);
+        indri::collection::CompressedCollection* const collection = Index_collection(self);
+
+        if (index == NULL || collection == NULL) {
+            return -1;
+        }
+
+        bool failed = false;
+        std::string error;
+
+        Py_BEGIN_ALLOW_THREADS
+
+        try {
+            self->shared_tables_ = SharedTables::Build(index, collection);
+
+            if (self->shared_tables_ == NULL) {
+                failed = true;
+                error = strerror(errno);
+            }
+        } catch (const lemur::api::Exception& e) {
+            failed = true;
+            error = e.what();
+        }
+
+        Py_END_ALLOW_THREADS
+
+        if (failed) {
+            PyErr_SetString(PyExc_IOError, error.c_str());
+
+            return -1;
+        }
+    }
+
+    if (warm_up || lock_memory) {
+        Index_start_warm_up(self, std::vector<std::string>(), lock_memory);
+    }
+
+    return 0;
+}
+
+// Returns the external identifier of a valid internal document identifier as
+// a string. Sets an exception on failure.
+static PyObject* Index_ext_document_id_obj(Index* self,
+                                           const lemur::api::DOCID_T int_document_id) {
+    if (self->shared_tables_ != NULL) {
+        const char* data;
+        size_t size;
+
+        self->shared_tables_->ext_document_id(int_document_id, &data, &size);
+
+        return PyUnicode_Decode(data, size, ENCODING, "strict");
+    }
+
+    indri::collection::CompressedCollection* const collection = Index_collection(self);
+
+    if (collection == NULL) {
+        return NULL;
+    }
+
+    string ext_document_id;
+
+    try {
+        ext_document_id = collection->retrieveMetadatum(int_document_id, "docno");
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return NULL;
+    }
+
+    return PyUnicode_Decode(ext_document_id.c_str(),
+                            ext_document_id.size(),
+                            ENCODING,
+                            "strict");
+}
+
+static PyObject* Index_get_document_ids(Index* self, PyObject* args) {
+    PyObject* external_doc_ids = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &external_doc_ids)) {
+        return NULL;
+    }
+
+    if (external_doc_ids == NULL) {
+        return NULL;
+    }
+
+    indri::api::QueryEnvironment* const query_env = Index_query_env(self);
+
+    if (query_env == NULL) {
+        return NULL;
+    }
+
+    PyObject* const iterator = PyObject_GetIter(external_doc_ids);
+    PyObject *item;
+
+    if (iterator == NULL) {
+        PyErr_SetString(
+            PyExc_TypeError,
+            "Passed object is not iterable.");
+
+        return NULL;
+    }
+
+    std::vector<std::string> ext_document_ids;
+
+    while ((item = PyIter_Next(iterator)) != NULL) {
+        CHECK(PyUnicode_CheckExact(item));
+
+        PyObject* item_bytes = PyUnicode_AsEncodedString(item, ENCODING, "strict");
+        char* const ext_document_id = PyBytes_AsString(item_bytes);
+
+        // Create a copy of the string.
+        ext_document_ids.push_back(ext_document_id);
+
+        Py_DECREF(item_bytes);
+        Py_DECREF(item);
+    }
+
+    Py_DECREF(iterator);
+
+    std::vector<lemur::api::DOCID_T> int_doc_ids;
+
+    try {
+        int_doc_ids = query_env->documentIDsFromMetadata("docno", ext_document_ids);
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return NULL;
+    }
+
+    PyObject* const doc_ids_tuple = PyTuple_New(int_doc_ids.size());
+
+    Py_ssize_t pos = 0;
+    for (std::vector<lemur::api::DOCID_T>::iterator int_doc_ids_it = int_doc_ids.begin();
+         int_doc_ids_it != int_doc_ids.end();
+         ++int_doc_ids_it, ++pos) {
+        const lemur::api::DOCID_T int_document_id = *int_doc_ids_it;
+
+        PyObject* py_ext_document_id = Index_ext_document_id_obj(self, int_document_id);
+
+        if (py_ext_document_id == NULL) {
+            Py_DECREF(doc_ids_tuple);
+
+            return NULL;
+        }
+
+        PyObject* py_int_document_id = PyLong_FromLong(int_document_id);
+
+        PyTuple_SetItem(doc_ids_tuple,
+                        pos,
+                        PyTuple_Pack(
+                            2,
+                            py_ext_document_id,
+                            py_int_document_id));
+
+        Py_DECREF(py_ext_document_id);
+        Py_DECREF(py_int_document_id);
+    }
+
+    return doc_ids_tuple;
+}
+
+static PyObject* Index_document(Index* self, PyObject* args, PyObject* kwds) {
+    int int_document_id;
+    int as_strings = 0;
+
+    static char* kwlist[] = {"int_document_id", "as_strings", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|p", kwlist,
+                                     &int_document_id, &as_strings)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    if (int_document_id < index->documentBase() ||
+        int_document_id >= index->documentMaximum()) {
+        PyErr_SetString(
+            PyExc_IndexError,
+            "Specified internal document identifier is out of bounds.");
+
+        return NULL;
+    }
+
+    PyObject* name = Index_ext_document_id_obj(self, int_document_id);
+
+    if (name == NULL) {
+        return NULL;
+    }
+
+    const indri::index::TermList* term_list = 0;
+
+    try {
+        term_list = index->termList(int_document_id);
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        Py_DECREF(name);
+
+        return NULL;
+    }
+
+    PyObject* terms = PyTuple_New(term_list->terms().size());
+
+    indri::utility::greedy_vector<lemur::api::TERMID_T>::const_iterator term_it =
+        term_list->terms().begin();
+
+    Py_ssize_t pos = 0;
+    for (; term_it != term_list->terms().end(); ++term_it, ++pos) {
+        if (!as_strings) {
+            PyTuple_SetItem(terms, pos, PyLong_FromLong(*term_it));
+        } else if (*term_it > 0) {
+            // Out-of-vocabulary terms (e.g., stopwords) have identifier 0.
+            PyTuple_SetItem(terms, pos, Index_term_string(self, index, *term_it));
+        } else {
+            Py_INCREF(Py_None);
+            PyTuple_SetItem(terms, pos, Py_None);
+        }
+    }
+
+    delete term_list;
+
+    if (as_strings) {
+        for (pos = 0; pos < PyTuple_GET_SIZE(terms); ++pos) {
+            if (PyTuple_GET_ITEM(terms, pos) == NULL) {
+                Py_DECREF(name);
+                Py_DECREF(terms);
+
+                return NULL;
+            }
+        }
+    }
+
+    PyObject* ret = PyTuple_Pack(2, name, terms);
+
+    Py_DECREF(name);
+    Py_DECREF(terms);
+
+    return ret;
+}
+
+static PyObject* Index_ext_document_id(Index* self, PyObject* args) {
+    int int_document_id;
+
+    if (!PyArg_ParseTuple(args, "i", &int_document_id)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    if (int_document_id < index->documentBase() ||
+        int_document_id >= index->documentMaximum()) {
+        PyErr_SetString(
+            PyExc_IndexError,
+            "Specified internal document identifier is out of bounds.");
+
+        return NULL;
+    }
+
+    return Index_ext_document_id_obj(self, int_document_id);
+}
+
+static PyObject* Index_document_base(Index* self) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(index->documentBase());
+}
+
+static PyObject* Index_maximum_document(Index* self) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(index->documentMaximum());
+}
+
+static PyObject* Index_document_count(Index* self) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(index->documentCount());
+}
+
+static PyObject* Index_total_terms(Index* self) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(index->termCount());
+}
+
+static PyObject* Index_unique_terms(Index* self) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(index->uniqueTermCount());
+}
+
+// Looks up the statistics of a term given as a string (or bytes) or as a term
+// identifier. Unknown terms get zero statistics. Returns false, with an
+// exception set, on failure. Expects the critical section of self to be held
+// (see LockedArgs); the term statistics cache is not accessed across calls
+// into Python, which may suspend it.
+static bool Index_term_statistics(Index* self, PyObject* term_obj,
+                                  TermStatistics* const stats) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return false;
+    }
+
+    std::string term;
+    lemur::api::TERMID_T term_id = 0;
+
+    if (PyUnicode_Check(term_obj) || PyBytes_Check(term_obj)) {
+        PyObject* const term_bytes = PyUnicode_Check(term_obj) ?
+            PyUnicode_AsEncodedString(term_obj, ENCODING, "strict") : term_obj;
+
+        if (term_bytes == NULL) {
+            if (!PyErr_ExceptionMatches(PyExc_UnicodeEncodeError)) {
+                return false;
+            }
+
+            // Terms are decoded as ENCODING, hence the term cannot occur.
+            PyErr_Clear();
+
+            stats->term_id = 0;
+            stats->document_frequency = 0;
+            stats->collection_frequency = 0;
+
+            return true;
+        }
+
+        term.assign(PyBytes_AS_STRING(term_bytes), PyBytes_GET_SIZE(term_bytes));
+
+        if (term_bytes != term_obj) {
+            Py_DECREF(term_bytes);
+        }
+
+        if (self->term_statistics_cache_->lookup(term, stats)) {
+            return true;
+        }
+    } else {
+        const long value = PyLong_AsLong(term_obj);
+
+        if (value == -1 && PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "terms should be strings or term identifiers.");
+
+            return false;
+        }
+
+        term_id = value > 0 && value <= std::numeric_limits<lemur::api::TERMID_T>::max() ?
+            value : 0;
+
+        if (self->term_statistics_cache_->lookup(term_id, stats)) {
+            return true;
+        }
+    }
+
+    stats->term_id = 0;
+    stats->document_frequency = 0;
+    stats->collection_frequency = 0;
+
+    try {
+        if (!term.empty()) {
+            term_id = index->term(term);
+        }
+
+        if (term_id > 0 && self->shared_tables_ != NULL) {
+            if (static_cast<size_t>(term_id) < self->shared_tables_->num_terms()) {
+                stats->term_id = term_id;
+                stats->document_frequency =
+                    self->shared_tables_->term_document_frequency(term_id);
+                stats->collection_frequency = self->shared_tables_->term_frequency(term_id);
+            }
+        } else if (term_id > 0) {
+            indri::index::DocListIterator* const postings = index->docListIterator(term_id);
+
+            if (postings != NULL) {
+                stats->term_id = term_id;
+                stats->document_frequency = postings->termData()->corpus.documentCount;
+                stats->collection_frequency = postings->termData()->corpus.totalCount;
+
+                delete postings;
+            }
+        }
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return false;
+    }
+
+    if (!term.empty()) {
+        self->term_statistics_cache_->insert(term, *stats);
+    } else {
+        self->term_statistics_cache_->insert(term_id, *stats);
+    }
+
+    return true;
+}
+
+static PyObject* Index_term_count(Index* self, PyObject* args) {
+    PyObject* term_obj;
+
+    if (!PyArg_ParseTuple(args, "U", &term_obj)) {
+        return NULL;
+    }
+
+    TermStatistics stats;
+
+    if (!Index_term_statistics(self, term_obj, &stats)) {
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLongLong(stats.collection_frequency);
+}
+
+static PyObject* Index_term_stats(Index* self, PyObject* args) {
+    PyObject* terms_obj;
+
+    if (!PyArg_ParseTuple(args, "O", &terms_obj)) {
+        return NULL;
+    }
+
+    PyObject* const terms_seq = PySequence_Fast(terms_obj, "terms should be iterable.");
+
+    if (terms_seq == NULL) {
+        return NULL;
+    }
+
+    const Py_ssize_t num_terms = PySequence_Fast_GET_SIZE(terms_seq);
+
+    std::vector<INT32> term_ids(num_terms);
+    std::vector<INT64> document_frequencies(num_terms);
+    std::vector<INT64> collection_frequencies(num_terms);
+
+    for (Py_ssize_t i = 0; i < num_terms; ++i) {
+        TermStatistics stats;
+
+        if (!Index_term_statistics(self, PySequence_Fast_GET_ITEM(terms_seq, i), &stats)) {
+            Py_DECREF(terms_seq);
+
+            return NULL;
+        }
+
+        term_ids[i] = stats.term_id;
+        document_frequencies[i] = stats.document_frequency;
+        collection_frequencies[i] = stats.collection_frequency;
+    }
+
+    Py_DECREF(terms_seq);
+
+    PyObject* const term_ids_view = BufferToMemoryView(
+        term_ids.data(), term_ids.size() * sizeof(INT32), "i");
+    PyObject* const document_frequencies_view = BufferToMemoryView(
+        document_frequencies.data(), document_frequencies.size() * sizeof(INT64), "q");
+    PyObject* const collection_frequencies_view = BufferToMemoryView(
+        collection_frequencies.data(), collection_frequencies.size() * sizeof(INT64), "q");
+
+    if (term_ids_view == NULL || document_frequencies_view == NULL ||
+        collection_frequencies_view == NULL) {
+        Py_XDECREF(term_ids_view);
+        Py_XDECREF(document_frequencies_view);
+        Py_XDECREF(collection_frequencies_view);
+
+        return NULL;
+    }
+
+    PyObject* const ret = PyTuple_Pack(
+        3, term_ids_view, document_frequencies_view, collection_frequencies_view);
+
+    Py_DECREF(term_ids_view);
+    Py_DECREF(document_frequencies_view);
+    Py_DECREF(collection_frequencies_view);
+
+    return ret;
+}
+
+static PyObject* Index_process_term(Index* self, PyObject* args) {
     char* term_object;
 
-    if (!PyArg_ParseTuple(args, "s", &term_object)) {
+    if (!PyArg_ParseTuple(args, "s", &term_object)) {
+        return NULL;
+    }
+
+    indri::api::QueryEnvironment* const query_env = Index_query_env(self);
+
+    if (query_env == NULL) {
+        return NULL;
+    }
+
+    indri::collection::Repository* const repository =
+        &dynamic_cast<indri::server::LocalQueryServer*>(
+            query_env->getServers()[0])->_repository;
+
+    const std::string processed_term =
+        repository->processTerm(term_object);
+
+    // Share the string of in-vocabulary terms with the other term APIs, but
+    // only if the index is open already (see Index_disk_index); callers that
+    // only process text should not pay for opening it.
+    if (self->index_opened_ && !processed_term.empty()) {
+        const lemur::api::TERMID_T term_id = self->index_->term(processed_term);
+
+        if (term_id > 0) {
+            return Index_term_string(self, self->index_, term_id);
+        }
+    }
+
+    return PyUnicode_Decode(processed_term.c_str(),
+                            processed_term.size(),
+                            ENCODING,
+                            "strict");
+}
+
+static PyObject* Index_document_length(Index* self, PyObject* args) {
+    int int_document_id;
+
+    if (!PyArg_ParseTuple(args, "i", &int_document_id)) {
+        return NULL;
+    }
+
+    if (self->shared_tables_ != NULL) {
+        return PyLong_FromLong(self->shared_tables_->document_length(int_document_id));
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(index->documentLength(int_document_id));
+}
+
+static PyObject* Index_document_lengths(Index* self) {
+    if (self->shared_tables_ == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Index was not opened with shared_tables enabled.");
+
+        return NULL;
+    }
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return NULL;
+    }
+
+    // Read-only view on the shared mapping, indexed by internal document
+    // identifier; the view keeps the Index, and thus the mapping, alive.
+    return SharedBufferToMemoryView(
+        state->shared_buffer_type, PyObjectOwner((PyObject*) self),
+        self->shared_tables_->document_lengths(),
+        self->shared_tables_->maximum_document(), "i");
+}
+
+static PyObject* Index_iter_documents(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* start_obj = Py_None;
+    PyObject* end_obj = Py_None;
+    long batch_size = 1024;
+    long prefetch = 4;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"start", "end", "batch_size", "prefetch",
+                             "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOlll", kwlist,
+                                     &start_obj, &end_obj,
+                                     &batch_size, &prefetch, &num_threads)) {
+        return NULL;
+    }
+
+    if (batch_size <= 0 || prefetch <= 0 || num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "batch_size, prefetch and num_threads should be positive.");
+
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    lemur::api::DOCID_T start = index->documentBase();
+    lemur::api::DOCID_T end = index->documentMaximum();
+
+    if (start_obj != Py_None) {
+        start = std::max<long>(start, PyLong_AsLong(start_obj));
+    }
+
+    if (end_obj != Py_None) {
+        end = std::min<long>(end, PyLong_AsLong(end_obj));
+    }
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return DocumentIterator_create(
+        state->document_iterator_type,
+        self->repository_path_, *self->index_path_,
+        start, std::max(start, end), batch_size, prefetch, num_threads);
+}
+
+static PyObject* Index_cooccurrence(Index* self, PyObject* args, PyObject* kwds) {
+    long window = 5;
+    long long min_count = 1;
+    PyObject* vocabulary_subset_obj = Py_None;
+    long num_threads = 1;
+    long long memory_budget = 1LL << 30;
+    const char* spill_dir = NULL;
+
+    static char* kwlist[] = {"window", "min_count", "vocabulary_subset",
+                             "num_threads", "memory_budget", "spill_dir",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|lLOlLz", kwlist,
+                                     &window, &min_count, &vocabulary_subset_obj,
+                                     &num_threads, &memory_budget, &spill_dir)) {
+        return NULL;
+    }
+
+    if (window <= 0 || num_threads <= 0 || memory_budget <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "window, num_threads and memory_budget should be positive.");
+
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    CooccurrenceCounter::Options options;
+
+    options.repository_path = self->repository_path_;
+    options.index_path = *self->index_path_;
+
+    options.start = index->documentBase();
+    options.end = index->documentMaximum();
+
+    options.window = window;
+    options.min_count = std::max(min_count, 1LL);
+
+    if (vocabulary_subset_obj != Py_None) {
+        PyObject* const iterator = PyObject_GetIter(vocabulary_subset_obj);
+
+        if (iterator == NULL) {
+            return NULL;
+        }
+
+        options.vocabulary_subset.assign(index->uniqueTermCount() + 1, false);
+
+        PyObject* item;
+
+        while ((item = PyIter_Next(iterator)) != NULL) {
+            const long term_id = PyLong_AsLong(item);
+            Py_DECREF(item);
+
+            if (term_id > 0 && static_cast<size_t>(term_id) < options.vocabulary_subset.size()) {
+                options.vocabulary_subset[term_id] = true;
+            }
+        }
+
+        Py_DECREF(iterator);
+
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    options.num_threads = num_threads;
+    options.memory_budget = memory_budget;
+
+    if (spill_dir != NULL) {
+        options.spill_dir = spill_dir;
+    } else {
+        const char* const tmp_dir = getenv("TMPDIR");
+        options.spill_dir = tmp_dir != NULL ? tmp_dir : "/tmp";
+    }
+
+    CooccurrenceCounter::Result result;
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    try {
+        failed = !CooccurrenceCounter::Count(options, &result, &error);
+    } catch (const lemur::api::Exception& e) {
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    PyObject* const rows = BufferToMemoryView(
+        result.rows.data(), result.rows.size() * sizeof(INT32), "i");
+    PyObject* const columns = BufferToMemoryView(
+        result.columns.data(), result.columns.size() * sizeof(INT32), "i");
+    PyObject* const counts = BufferToMemoryView(
+        result.counts.data(), result.counts.size() * sizeof(INT64), "q");
+
+    if (rows == NULL || columns == NULL || counts == NULL) {
+        Py_XDECREF(rows);
+        Py_XDECREF(columns);
+        Py_XDECREF(counts);
+
+        return NULL;
+    }
+
+    PyObject* const ret = PyTuple_Pack(3, rows, columns, counts);
+
+    Py_DECREF(rows);
+    Py_DECREF(columns);
+    Py_DECREF(counts);
+
+    return ret;
+}
+
+static PyObject* Index_bag_of_words(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* start_obj = Py_None;
+    PyObject* end_obj = Py_None;
+    PyObject* id_map_obj = Py_None;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"start", "end", "id_map", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOOl", kwlist,
+                                     &start_obj, &end_obj, &id_map_obj,
+                                     &num_threads)) {
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
+
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    lemur::api::DOCID_T start = index->documentBase();
+    lemur::api::DOCID_T end = index->documentMaximum();
+
+    if (start_obj != Py_None) {
+        start = std::max<long>(start, PyLong_AsLong(start_obj));
+    }
+
+    if (end_obj != Py_None) {
+        end = std::min<long>(end, PyLong_AsLong(end_obj));
+    }
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    end = std::max(start, end);
+
+    Py_buffer id_map;
+    id_map.buf = NULL;
+    id_map.len = 0;
+
+    if (id_map_obj != Py_None &&
+        !GetInt32Buffer(id_map_obj, false /* writable */, "id_map", &id_map)) {
+        return NULL;
+    }
+
+    BagOfWords bow;
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !BuildBagOfWords(self->repository_path_, *self->index_path_,
+                              start, end,
+                              static_cast<const INT32*>(id_map.buf),
+                              id_map.len / sizeof(INT32),
+                              num_threads,
+                              &bow, &error);
+
+    Py_END_ALLOW_THREADS
+
+    if (id_map_obj != Py_None) {
+        PyBuffer_Release(&id_map);
+    }
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    PyObject* const data = BufferToMemoryView(
+        bow.data.data(), bow.data.size() * sizeof(INT32), "i");
+    PyObject* const indices = BufferToMemoryView(
+        bow.indices.data(), bow.indices.size() * sizeof(INT32), "i");
+    PyObject* const indptr = BufferToMemoryView(
+        bow.indptr.data(), bow.indptr.size() * sizeof(INT64), "q");
+
+    if (data == NULL || indices == NULL || indptr == NULL) {
+        Py_XDECREF(data);
+        Py_XDECREF(indices);
+        Py_XDECREF(indptr);
+
+        return NULL;
+    }
+
+    PyObject* const ret = PyTuple_Pack(3, data, indices, indptr);
+
+    Py_DECREF(data);
+    Py_DECREF(indices);
+    Py_DECREF(indptr);
+
+    return ret;
+}
+
+// Converts an iterable of integers (e.g., internal document or term
+// identifiers). Returns false, with an exception set, on failure.
+static bool ParseIdentifiers(PyObject* obj, std::vector<INT32>* const ids) {
+    PyObject* const seq = PySequence_Fast(obj, "Identifiers should be iterable.");
+
+    if (seq == NULL) {
+        return false;
+    }
+
+    const Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+    ids->resize(size);
+
+    for (Py_ssize_t i = 0; i < size; ++i) {
+        (*ids)[i] = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    }
+
+    Py_DECREF(seq);
+
+    return !PyErr_Occurred();
+}
+
+// Extracts the terms, and optionally the text, of passages [begin, end) of
+// documents, such as the extents of passage retrieval results.
+static PyObject* Index_passages(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* document_ids_obj = NULL;
+    PyObject* begins_obj = NULL;
+    PyObject* ends_obj = NULL;
+    int include_text = 0;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"document_ids", "begins", "ends", "include_text",
+                             "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|pl", kwlist,
+                                     &document_ids_obj, &begins_obj, &ends_obj,
+                                     &include_text, &num_threads)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    std::vector<INT32> document_ids, begins, ends;
+
+    if (!ParseIdentifiers(document_ids_obj, &document_ids) ||
+        !ParseIdentifiers(begins_obj, &begins) ||
+        !ParseIdentifiers(ends_obj, &ends)) {
+        return NULL;
+    }
+
+    if (begins.size() != document_ids.size() || ends.size() != document_ids.size()) {
+        PyErr_SetString(PyExc_ValueError,
+                        "document_ids, begins and ends should have the same length.");
+
+        return NULL;
+    }
+
+    const lemur::api::DOCID_T document_base = index->documentBase();
+    const lemur::api::DOCID_T maximum_document = index->documentMaximum();
+
+    for (size_t i = 0; i < document_ids.size(); ++i) {
+        if (document_ids[i] < document_base || document_ids[i] >= maximum_document) {
+            PyErr_SetString(PyExc_IndexError,
+                            "Specified internal document identifier is out of bounds.");
+
+            return NULL;
+        } else if (begins[i] < 0 || ends[i] < begins[i]) {
+            PyErr_SetString(PyExc_ValueError,
+                            "Passages should satisfy 0 <= begin <= end.");
+
+            return NULL;
+        }
+    }
+
+    std::vector<std::vector<INT32> > passage_terms(document_ids.size());
+    std::vector<std::string> passage_texts(include_text ? document_ids.size() : 0);
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !ParallelForDocuments(
+        self->repository_path_, *self->index_path_,
+        document_ids.size(), std::max(num_threads, 1L),
+        [&](indri::index::DiskIndex* const thread_index, const size_t i) {
+            const indri::index::TermList* const term_list =
+                thread_index->termList(document_ids[i]);
+
+            const size_t length = term_list->terms().size();
+            const size_t end = std::min<size_t>(ends[i], length);
+            const size_t begin = std::min<size_t>(begins[i], end);
+
+            passage_terms[i].assign(term_list->terms().begin() + begin,
+                                    term_list->terms().begin() + end);
+
+            delete term_list;
+        },
+        &error);
+
+    if (!failed && include_text) {
+        failed = !ParallelForCollection(
+            self->repository_path_,
+            document_ids.size(), std::max(num_threads, 1L),
+            [&](indri::collection::CompressedCollection* const collection, const size_t i) {
+                indri::api::ParsedDocument* const document =
+                    collection->retrieve(document_ids[i]);
+
+                // Byte offsets of the passage in the original text.
+                const size_t end = std::min<size_t>(ends[i], document->positions.size());
+                const size_t begin = std::min<size_t>(begins[i], end);
+
+                if (begin < end) {
+                    const size_t text_begin = document->positions[begin].begin;
+                    const size_t text_end = std::min<size_t>(
+                        document->positions[end - 1].end, document->textLength);
+
+                    if (text_begin < text_end) {
+                        passage_texts[i].assign(document->text + text_begin,
+                                                text_end - text_begin);
+                    }
+                }
+
+                delete document;
+            },
+            &error);
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    std::vector<INT64> offsets(1, 0);
+    std::vector<INT32> terms;
+
+    for (size_t i = 0; i < passage_terms.size(); ++i) {
+        terms.insert(terms.end(), passage_terms[i].begin(), passage_terms[i].end());
+        offsets.push_back(terms.size());
+    }
+
+    PyObject* const offsets_obj = BufferToMemoryView(
+        offsets.data(), offsets.size() * sizeof(INT64), "q");
+    PyObject* const terms_obj = BufferToMemoryView(
+        terms.data(), terms.size() * sizeof(INT32), "i");
+    PyObject* texts_obj = NULL;
+
+    if (include_text) {
+        texts_obj = PyTuple_New(passage_texts.size());
+
+        for (size_t i = 0; texts_obj != NULL && i < passage_texts.size(); ++i) {
+            PyTuple_SetItem(texts_obj, i, PyUnicode_Decode(passage_texts[i].c_str(),
+                                                           passage_texts[i].size(),
+                                                           ENCODING,
+                                                           "strict"));
+        }
+    }
+
+    if (offsets_obj == NULL || terms_obj == NULL || (include_text && texts_obj == NULL)) {
+        Py_XDECREF(offsets_obj);
+        Py_XDECREF(terms_obj);
+        Py_XDECREF(texts_obj);
+
+        return NULL;
+    }
+
+    if (include_text) {
+        return Py_BuildValue("(NNN)", offsets_obj, terms_obj, texts_obj);
+    }
+
+    return Py_BuildValue("(NN)", offsets_obj, terms_obj);
+}
+
+// Returns the identifier of a field. Sets an exception and returns 0 if the
+// index does not contain the field.
+static int Index_field_id(indri::index::DiskIndex* const index, const char* field) {
+    const int field_id = index->field(field);
+
+    if (field_id <= 0) {
+        PyErr_Format(PyExc_KeyError, "Index does not contain field %s.", field);
+
+        return 0;
+    }
+
+    return field_id;
+}
+
+static PyObject* Index_fields(Index* self) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    std::vector<std::string> fields;
+
+    // Field identifiers are contiguous and start at 1.
+    for (int field_id = 1; ; ++field_id) {
+        const std::string field = index->field(field_id);
+
+        if (field.empty()) {
+            break;
+        }
+
+        fields.push_back(field);
+    }
+
+    PyObject* const fields_tuple = PyTuple_New(fields.size());
+
+    for (size_t i = 0; i < fields.size(); ++i) {
+        PyTuple_SetItem(fields_tuple, i,
+                        PyUnicode_Decode(fields[i].c_str(), fields[i].size(),
+                                         ENCODING, "strict"));
+    }
+
+    return fields_tuple;
+}
+
+static PyObject* Index_field_statistics(Index* self, PyObject* args, PyObject* kwds) {
+    const char* field = NULL;
+    PyObject* terms_obj = NULL;
+
+    static char* kwlist[] = {"field", "terms", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwlist, &field, &terms_obj)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL || Index_field_id(index, field) == 0) {
+        return NULL;
+    }
+
+    PyObject* const statistics = PyDict_New();
+
+    PyDict_SetItemAndSteal(statistics,
+                           PyUnicode_FromString("term_count"),
+                           PyLong_FromUnsignedLongLong(index->fieldTermCount(field)));
+    PyDict_SetItemAndSteal(statistics,
+                           PyUnicode_FromString("document_count"),
+                           PyLong_FromUnsignedLongLong(index->fieldDocumentCount(field)));
+
+    if (terms_obj == NULL) {
+        return statistics;
+    }
+
+    PyObject* const terms_seq = PySequence_Fast(terms_obj, "terms should be iterable.");
+
+    if (terms_seq == NULL) {
+        Py_DECREF(statistics);
+
+        return NULL;
+    }
+
+    const Py_ssize_t num_terms = PySequence_Fast_GET_SIZE(terms_seq);
+
+    PyObject* const term_counts = PyTuple_New(num_terms);
+    PyObject* const term_document_counts = PyTuple_New(num_terms);
+
+    for (Py_ssize_t i = 0; i < num_terms; ++i) {
+        const char* const term = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(terms_seq, i));
+
+        if (term == NULL) {
+            Py_DECREF(terms_seq);
+            Py_DECREF(term_counts);
+            Py_DECREF(term_document_counts);
+            Py_DECREF(statistics);
+
+            return NULL;
+        }
+
+        PyTuple_SetItem(term_counts, i,
+                        PyLong_FromUnsignedLongLong(index->fieldTermCount(field, term)));
+        PyTuple_SetItem(term_document_counts, i,
+                        PyLong_FromUnsignedLongLong(index->fieldDocumentCount(field, term)));
+    }
+
+    Py_DECREF(terms_seq);
+
+    PyDict_SetItemAndSteal(statistics, PyUnicode_FromString("term_counts"), term_counts);
+    PyDict_SetItemAndSteal(statistics, PyUnicode_FromString("term_document_counts"),
+                           term_document_counts);
+
+    return statistics;
+}
+
+static PyObject* Index_field_extents(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* document_ids_obj = NULL;
+    const char* field = NULL;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"document_ids", "field", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|l", kwlist,
+                                     &document_ids_obj, &field, &num_threads)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    const int field_id = Index_field_id(index, field);
+    std::vector<INT32> document_ids;
+
+    if (field_id == 0 || !ParseIdentifiers(document_ids_obj, &document_ids)) {
+        return NULL;
+    }
+
+    const lemur::api::DOCID_T document_base = index->documentBase();
+    const lemur::api::DOCID_T maximum_document = index->documentMaximum();
+
+    for (size_t i = 0; i < document_ids.size(); ++i) {
+        if (document_ids[i] < document_base || document_ids[i] >= maximum_document) {
+            PyErr_SetString(PyExc_IndexError,
+                            "Specified internal document identifier is out of bounds.");
+
+            return NULL;
+        }
+    }
+
+    std::vector<std::vector<std::pair<INT32, INT32> > > extents(document_ids.size());
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !ParallelForDocuments(
+        self->repository_path_, *self->index_path_,
+        document_ids.size(), std::max(num_threads, 1L),
+        [&](indri::index::DiskIndex* const thread_index, const size_t i) {
+            const indri::index::TermList* const term_list =
+                thread_index->termList(document_ids[i]);
+
+            for (size_t j = 0; j < term_list->fields().size(); ++j) {
+                const indri::index::FieldExtent& extent = term_list->fields()[j];
+
+                if (extent.id == field_id) {
+                    extents[i].push_back(std::make_pair(extent.begin, extent.end));
+                }
+            }
+
+            delete term_list;
+        },
+        &error);
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    std::vector<INT64> offsets(1, 0);
+    std::vector<INT32> begins, ends;
+
+    for (size_t i = 0; i < extents.size(); ++i) {
+        for (size_t j = 0; j < extents[i].size(); ++j) {
+            begins.push_back(extents[i][j].first);
+            ends.push_back(extents[i][j].second);
+        }
+
+        offsets.push_back(begins.size());
+    }
+
+    PyObject* const offsets_obj = BufferToMemoryView(
+        offsets.data(), offsets.size() * sizeof(INT64), "q");
+    PyObject* const begins_obj = BufferToMemoryView(
+        begins.data(), begins.size() * sizeof(INT32), "i");
+    PyObject* const ends_obj = BufferToMemoryView(
+        ends.data(), ends.size() * sizeof(INT32), "i");
+
+    if (offsets_obj == NULL || begins_obj == NULL || ends_obj == NULL) {
+        Py_XDECREF(offsets_obj);
+        Py_XDECREF(begins_obj);
+        Py_XDECREF(ends_obj);
+
+        return NULL;
+    }
+
+    PyObject* const ret = PyTuple_Pack(3, offsets_obj, begins_obj, ends_obj);
+
+    Py_DECREF(offsets_obj);
+    Py_DECREF(begins_obj);
+    Py_DECREF(ends_obj);
+
+    return ret;
+}
+
+static PyObject* Index_field_lengths(Index* self, PyObject* args, PyObject* kwds) {
+    const char* field = NULL;
+    PyObject* document_ids_obj = Py_None;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"field", "document_ids", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|Ol", kwlist,
+                                     &field, &document_ids_obj, &num_threads)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    const int field_id = Index_field_id(index, field);
+
+    if (field_id == 0) {
+        return NULL;
+    }
+
+    const lemur::api::DOCID_T document_base = index->documentBase();
+    const lemur::api::DOCID_T maximum_document = index->documentMaximum();
+
+    // Without document identifiers, lengths are indexed by internal document
+    // identifier (as Index.document_lengths).
+    std::vector<INT32> document_ids;
+
+    if (document_ids_obj == Py_None) {
+        for (lemur::api::DOCID_T int_document_id = 0;
+             int_document_id < maximum_document;
+             ++int_document_id) {
+            document_ids.push_back(int_document_id);
+        }
+    } else if (!ParseIdentifiers(document_ids_obj, &document_ids)) {
+        return NULL;
+    }
+
+    std::vector<INT32> lengths(document_ids.size(), 0);
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !ParallelForDocuments(
+        self->repository_path_, *self->index_path_,
+        document_ids.size(), std::max(num_threads, 1L),
+        [&](indri::index::DiskIndex* const thread_index, const size_t i) {
+            if (document_ids[i] < document_base || document_ids[i] >= maximum_document) {
+                return;
+            }
+
+            const indri::index::TermList* const term_list =
+                thread_index->termList(document_ids[i]);
+
+            for (size_t j = 0; j < term_list->fields().size(); ++j) {
+                const indri::index::FieldExtent& extent = term_list->fields()[j];
+
+                if (extent.id == field_id) {
+                    lengths[i] += extent.end - extent.begin;
+                }
+            }
+
+            delete term_list;
+        },
+        &error);
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    return BufferToMemoryView(lengths.data(), lengths.size() * sizeof(INT32), "i");
+}
+
+static PyObject* Index_field_term_counts(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* document_ids_obj = NULL;
+    PyObject* term_ids_obj = NULL;
+    const char* field = NULL;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"document_ids", "term_ids", "field", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOs|l", kwlist,
+                                     &document_ids_obj, &term_ids_obj, &field,
+                                     &num_threads)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    const int field_id = Index_field_id(index, field);
+
+    std::vector<INT32> document_ids;
+    std::vector<INT32> term_ids;
+
+    if (field_id == 0 ||
+        !ParseIdentifiers(document_ids_obj, &document_ids) ||
+        !ParseIdentifiers(term_ids_obj, &term_ids)) {
+        return NULL;
+    }
+
+    const lemur::api::DOCID_T document_base = index->documentBase();
+    const lemur::api::DOCID_T maximum_document = index->documentMaximum();
+
+    // Row-major matrix of term counts within the field, one row per document.
+    const size_t num_terms = term_ids.size();
+    std::vector<INT32> counts(document_ids.size() * num_terms, 0);
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !ParallelForDocuments(
+        self->repository_path_, *self->index_path_,
+        document_ids.size(), std::max(num_threads, 1L),
+        [&](indri::index::DiskIndex* const thread_index, const size_t i) {
+            if (document_ids[i] < document_base || document_ids[i] >= maximum_document) {
+                return;
+            }
+
+            const indri::index::TermList* const term_list =
+                thread_index->termList(document_ids[i]);
+
+            const indri::utility::greedy_vector<lemur::api::TERMID_T>& terms =
+                term_list->terms();
+
+            for (size_t j = 0; j < term_list->fields().size(); ++j) {
+                const indri::index::FieldExtent& extent = term_list->fields()[j];
+
+                if (extent.id != field_id) {
+                    continue;
+                }
+
+                for (int position = extent.begin;
+                     position < extent.end && position < static_cast<int>(terms.size());
+                     ++position) {
+                    for (size_t k = 0; k < num_terms; ++k) {
+                        if (terms[position] == term_ids[k]) {
+                            ++counts[i * num_terms + k];
+                        }
+                    }
+                }
+            }
+
+            delete term_list;
+        },
+        &error);
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    return BufferToMemoryView(counts.data(), counts.size() * sizeof(INT32), "i");
+}
+
+// Converts a scoring model name and a dictionary of parameters. Returns false,
+// with an exception set, on failure.
+static bool ParseScoringParameters(const char* model, PyObject* params_obj,
+                                   ScoringParameters* const parameters) {
+    if (strcmp(model, "dirichlet") == 0) {
+        parameters->model = SCORING_MODEL_DIRICHLET;
+    } else if (strcmp(model, "jm") == 0) {
+        parameters->model = SCORING_MODEL_JELINEK_MERCER;
+    } else if (strcmp(model, "bm25") == 0) {
+        parameters->model = SCORING_MODEL_BM25;
+    } else if (strcmp(model, "tfidf") == 0) {
+        parameters->model = SCORING_MODEL_TFIDF;
+    } else {
+        PyErr_Format(PyExc_ValueError, "Unknown scoring model %s.", model);
+
+        return false;
+    }
+
+    if (params_obj == NULL || params_obj == Py_None) {
+        return true;
+    } else if (!PyDict_Check(params_obj)) {
+        PyErr_SetString(PyExc_TypeError, "params should be a dictionary.");
+
+        return false;
+    }
+
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+
+    while (PyDict_Next(params_obj, &pos, &key, &value)) {
+        const char* const name = PyUnicode_AsUTF8(key);
+
+        if (name == NULL) {
+            return false;
+        }
+
+        const double parameter = PyFloat_AsDouble(value);
+
+        if (PyErr_Occurred()) {
+            return false;
+        }
+
+        if (strcmp(name, "mu") == 0) {
+            parameters->mu = parameter;
+        } else if (strcmp(name, "lambda") == 0) {
+            parameters->collection_lambda = parameter;
+        } else if (strcmp(name, "k1") == 0) {
+            parameters->k1 = parameter;
+        } else if (strcmp(name, "b") == 0) {
+            parameters->b = parameter;
+        } else {
+            PyErr_Format(PyExc_ValueError, "Unknown scoring parameter %s.", name);
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Converts a query given as a sequence of term identifiers, where None denotes
+// an out-of-vocabulary term. Out-of-vocabulary terms are kept (as 0), as they
+// affect language model scores. Returns false, with an exception set, on
+// failure.
+static bool ParseQueryTermIds(PyObject* obj, std::vector<INT32>* const term_ids) {
+    PyObject* const term_ids_seq = PySequence_Fast(obj, "term_ids should be iterable.");
+
+    if (term_ids_seq == NULL) {
+        return false;
+    }
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(term_ids_seq); ++i) {
+        PyObject* const term_id = PySequence_Fast_GET_ITEM(term_ids_seq, i);
+
+        term_ids->push_back(term_id == Py_None ? 0 : PyLong_AsLong(term_id));
+    }
+
+    Py_DECREF(term_ids_seq);
+
+    return !PyErr_Occurred();
+}
+
+static PyObject* Index_score_documents(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* term_ids_obj = NULL;
+    PyObject* document_ids_obj = NULL;
+    const char* model = "dirichlet";
+    PyObject* params_obj = NULL;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"term_ids", "document_ids", "model", "params",
+                             "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|sOl", kwlist,
+                                     &term_ids_obj, &document_ids_obj,
+                                     &model, &params_obj, &num_threads)) {
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
+
+        return NULL;
+    }
+
+    ScoringParameters parameters;
+
+    if (!ParseScoringParameters(model, params_obj, &parameters)) {
+        return NULL;
+    }
+
+    std::vector<INT32> term_ids;
+    std::vector<INT32> document_ids;
+
+    if (!ParseQueryTermIds(term_ids_obj, &term_ids) ||
+        !ParseIdentifiers(document_ids_obj, &document_ids)) {
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    std::vector<QueryTermStatistics> terms;
+
+    try {
+        terms = CollectQueryTermStatistics(index, term_ids);
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return NULL;
+    }
+
+    std::vector<double> scores;
+
+    bool failed = false;
+    std::string error;
+
+    const double collection_length = index->termCount();
+    const double num_documents = index->documentCount();
+
+    const lemur::api::DOCID_T document_base = index->documentBase();
+    const lemur::api::DOCID_T maximum_document = index->documentMaximum();
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !ScoreDocuments(self->repository_path_, *self->index_path_,
+                             terms, collection_length, num_documents,
+                             document_base, maximum_document,
+                             document_ids, parameters, num_threads,
+                             &scores, &error);
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    return BufferToMemoryView(scores.data(), scores.size() * sizeof(double), "d");
+}
+
+static PyObject* Index_sweep(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* term_ids_obj = NULL;
+    PyObject* params_obj = NULL;
+    const char* model = "dirichlet";
+    long results_requested = 1000;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"term_ids", "params", "model", "results_requested",
+                             "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|sll", kwlist,
+                                     &term_ids_obj, &params_obj, &model,
+                                     &results_requested, &num_threads)) {
+        return NULL;
+    }
+
+    if (results_requested < 0) {
+        PyErr_SetString(PyExc_ValueError, "results_requested should be non-negative.");
+
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
+
+        return NULL;
+    }
+
+    std::vector<INT32> term_ids;
+
+    if (!ParseQueryTermIds(term_ids_obj, &term_ids)) {
+        return NULL;
+    }
+
+    std::vector<ScoringParameters> configurations;
+
+    PyObject* const params_seq = PySequence_Fast(
+        params_obj, "params should be a sequence of dictionaries.");
+
+    if (params_seq == NULL) {
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(params_seq); ++i) {
+        ScoringParameters parameters;
+
+        if (!ParseScoringParameters(model, PySequence_Fast_GET_ITEM(params_seq, i),
+                                    &parameters)) {
+            Py_DECREF(params_seq);
+
+            return NULL;
+        }
+
+        configurations.push_back(parameters);
+    }
+
+    Py_DECREF(params_seq);
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    std::vector<QueryTermStatistics> terms;
+
+    try {
+        terms = CollectQueryTermStatistics(index, term_ids);
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return NULL;
+    }
+
+    std::vector<std::vector<ScoredDocument> > rankings;
+
+    bool failed = false;
+    std::string error;
+
+    const double collection_length = index->termCount();
+    const double num_documents = index->documentCount();
+
+    const lemur::api::DOCID_T document_base = index->documentBase();
+    const lemur::api::DOCID_T maximum_document = index->documentMaximum();
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !SweepScoringParameters(self->repository_path_, *self->index_path_,
+                                     terms, collection_length, num_documents,
+                                     document_base, maximum_document,
+                                     configurations, results_requested, num_threads,
+                                     &rankings, &error);
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    PyObject* const rankings_tuple = PyTuple_New(rankings.size());
+
+    if (rankings_tuple == NULL) {
+        return NULL;
+    }
+
+    for (size_t c = 0; c < rankings.size(); ++c) {
+        PyObject* const ranking_tuple = PyTuple_New(rankings[c].size());
+
+        if (ranking_tuple == NULL) {
+            Py_DECREF(rankings_tuple);
+
+            return NULL;
+        }
+
+        PyTuple_SET_ITEM(rankings_tuple, c, ranking_tuple);
+
+        for (size_t i = 0; i < rankings[c].size(); ++i) {
+            PyObject* const result = Py_BuildValue(
+                "(id)", rankings[c][i].second, rankings[c][i].first);
+
+            if (result == NULL) {
+                Py_DECREF(rankings_tuple);
+
+                return NULL;
+            }
+
+            PyTuple_SET_ITEM(ranking_tuple, i, result);
+        }
+    }
+
+    return rankings_tuple;
+}
+
+// Computes log(N / df) for term identifiers in [0, size); out-of-vocabulary
+// identifiers get 0. Returns false, with an exception set, on failure.
+static bool Index_inverse_document_frequencies(Index* self, const size_t size,
+                                               std::vector<float>* const idf) {
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return false;
+    }
+
+    const double num_documents = index->documentCount();
+
+    idf->assign(size, 0.0f);
+
+    if (self->shared_tables_ != NULL) {
+        const size_t num_terms = std::min(size, self->shared_tables_->num_terms());
+
+        for (size_t term_id = 1; term_id < num_terms; ++term_id) {
+            const UINT64 document_frequency =
+                self->shared_tables_->term_document_frequency(term_id);
+
+            if (document_frequency > 0) {
+                (*idf)[term_id] = std::log(num_documents / document_frequency);
+            }
+        }
+
+        return true;
+    }
+
+    indri::index::VocabularyIterator* const vocabulary_it = index->vocabularyIterator();
+
+    vocabulary_it->startIteration();
+
+    while (!vocabulary_it->finished()) {
+        indri::index::DiskTermData* const term_data = vocabulary_it->currentEntry();
+
+        const size_t term_id = term_data->termID;
+        const UINT64 document_frequency = term_data->termData->corpus.documentCount;
+
+        if (term_id < size && document_frequency > 0) {
+            (*idf)[term_id] = std::log(num_documents / document_frequency);
+        }
+
+        vocabulary_it->nextEntry();
+    }
+
+    delete vocabulary_it;
+
+    return true;
+}
+
+static PyObject* Index_document_embeddings(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* embeddings_obj = NULL;
+    PyObject* start_obj = Py_None;
+    PyObject* end_obj = Py_None;
+    PyObject* document_ids_obj = Py_None;
+    const char* weighting = "tfidf";
+    long num_threads = 1;
+
+    static char* kwlist[] = {"embeddings", "start", "end", "document_ids",
+                             "weighting", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOOsl", kwlist,
+                                     &embeddings_obj, &start_obj, &end_obj,
+                                     &document_ids_obj, &weighting, &num_threads)) {
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
+
+        return NULL;
+    }
+
+    const bool tfidf = strcmp(weighting, "tfidf") == 0;
+
+    if (!tfidf && strcmp(weighting, "tf") != 0) {
+        PyErr_Format(PyExc_ValueError, "Unknown weighting %s.", weighting);
+
+        return NULL;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    std::vector<INT32> document_ids;
+
+    if (document_ids_obj != Py_None) {
+        if (start_obj != Py_None || end_obj != Py_None) {
+            PyErr_SetString(PyExc_ValueError,
+                            "document_ids cannot be combined with start or end.");
+
+            return NULL;
+        }
+
+        if (!ParseIdentifiers(document_ids_obj, &document_ids)) {
+            return NULL;
+        }
+
+        for (size_t i = 0; i < document_ids.size(); ++i) {
+            if (document_ids[i] < index->documentBase() ||
+                document_ids[i] >= index->documentMaximum()) {
+                PyErr_Format(PyExc_IndexError, "Invalid document id %d.", document_ids[i]);
+
+                return NULL;
+            }
+        }
+    } else {
+        lemur::api::DOCID_T start = index->documentBase();
+        lemur::api::DOCID_T end = index->documentMaximum();
+
+        if (start_obj != Py_None) {
+            start = std::max<long>(start, PyLong_AsLong(start_obj));
+        }
+
+        if (end_obj != Py_None) {
+            end = std::min<long>(end, PyLong_AsLong(end_obj));
+        }
+
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+
+        for (lemur::api::DOCID_T int_document_id = start; int_document_id < end; ++int_document_id) {
+            document_ids.push_back(int_document_id);
+        }
+    }
+
+    Py_buffer embeddings;
+    size_t num_embeddings, dimensionality;
+
+    if (!GetFloat32Matrix(embeddings_obj, "embeddings", &embeddings,
+                          &num_embeddings, &dimensionality)) {
+        return NULL;
+    }
+
+    std::vector<float> weights;
+
+    if (tfidf && !Index_inverse_document_frequencies(self, num_embeddings, &weights)) {
+        PyBuffer_Release(&embeddings);
+
+        return NULL;
+    }
+
+    std::vector<float> centroids(document_ids.size() * dimensionality);
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !ComputeDocumentCentroids(self->repository_path_, *self->index_path_,
+                                       document_ids,
+                                       static_cast<const float*>(embeddings.buf),
+                                       num_embeddings, dimensionality,
+                                       weights, num_threads,
+                                       centroids.data(), &error);
+
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&embeddings);
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    return BufferToMemoryView(centroids.data(), centroids.size() * sizeof(float), "f");
+}
+
+static PyObject* Index_warm_up(Index* self, PyObject* args, PyObject* kwds) {
+    PyObject* components_obj = Py_None;
+    int lock_memory = 0;
+    int wait = 1;
+
+    static char* kwlist[] = {"components", "lock_memory", "wait", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Opp", kwlist,
+                                     &components_obj, &lock_memory, &wait)) {
+        return NULL;
+    }
+
+    std::vector<std::string> components;
+
+    if (components_obj != Py_None) {
+        PyObject* const components_seq = PySequence_Fast(
+            components_obj, "components should be iterable.");
+
+        if (components_seq == NULL) {
+            return NULL;
+        }
+
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(components_seq); ++i) {
+            const char* const component = PyUnicode_AsUTF8(
+                PySequence_Fast_GET_ITEM(components_seq, i));
+
+            if (component == NULL) {
+                Py_DECREF(components_seq);
+
+                return NULL;
+            }
+
+            const char* const* known = WARM_UP_COMPONENTS;
+
+            while (*known != NULL && strcmp(*known, component) != 0) {
+                ++known;
+            }
+
+            if (*known == NULL) {
+                Py_DECREF(components_seq);
+                PyErr_Format(PyExc_ValueError, "Unknown component %s.", component);
+
+                return NULL;
+            }
+
+            components.push_back(component);
+        }
+
+        Py_DECREF(components_seq);
+
+        if (components.empty()) {
+            Py_RETURN_NONE;
+        }
+    }
+
+    Index_reopen(self);
+
+    Index_start_warm_up(self, components, lock_memory);
+
+    if (!wait) {
+        Py_RETURN_NONE;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+
+    self->warmer_->Wait();
+
+    Py_END_ALLOW_THREADS
+
+    const IndexWarmer::Progress progress = self->warmer_->progress();
+
+    if (!progress.error.empty()) {
+        PyErr_SetString(PyExc_IOError, progress.error.c_str());
+
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLongLong(progress.bytes_done);
+}
+
+static PyObject* Index_warm_up_progress(Index* self) {
+    IndexWarmer::Progress progress = {0, 0, 0, false, std::string()};
+
+    if (self->warmer_ != NULL && self->fork_generation_ == fork_generation) {
+        progress = self->warmer_->progress();
+    }
+
+    PyObject* const error = progress.error.empty() ?
+        (Py_INCREF(Py_None), Py_None) : PyUnicode_FromString(progress.error.c_str());
+
+    if (error == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:O,s:N}",
+                         "bytes_done", progress.bytes_done,
+                         "bytes_total", progress.bytes_total,
+                         "bytes_locked", progress.bytes_locked,
+                         "running", progress.running ? Py_True : Py_False,
+                         "error", error);
+}
+
+static PyObject* Index_term(Index* self, PyObject* args) {
+    int term_id;
+
+    if (!PyArg_ParseTuple(args, "i", &term_id)) {
+        return NULL;
+    }
+
+    if (self->shared_tables_ != NULL) {
+        if (term_id <= 0 || static_cast<size_t>(term_id) >= self->shared_tables_->num_terms()) {
+            PyErr_SetString(PyExc_IndexError, "Specified term identifier is out of bounds.");
+
+            return NULL;
+        }
+
+        return Index_term_string(self, NULL, term_id);
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    if (term_id <= 0 || static_cast<UINT64>(term_id) > index->uniqueTermCount()) {
+        PyErr_SetString(PyExc_IndexError, "Specified term identifier is out of bounds.");
+
+        return NULL;
+    }
+
+    return Index_term_string(self, index, term_id);
+}
+
+static PyObject* Index_get_dictionary(Index* self, PyObject* args) {
+    PyObject* const token2id = PyDict_New();
+    PyObject* const id2token = PyDict_New();
+    PyObject* const id2df = PyDict_New();
+
+    if (self->shared_tables_ != NULL) {
+        for (size_t term_id = 1; term_id < self->shared_tables_->num_terms(); ++term_id) {
+            PyObject* const term_obj = Index_term_string(self, NULL, term_id);
+
+            if (term_obj == NULL) {
+                Py_DECREF(token2id);
+                Py_DECREF(id2token);
+                Py_DECREF(id2df);
+
+                return NULL;
+            }
+
+            Py_INCREF(term_obj);
+
+            PyDict_SetItemAndSteal(
+                token2id,
+                term_obj,
+                PyLong_FromLong(term_id));
+
+            PyDict_SetItemAndSteal(
+                id2token,
+                PyLong_FromLong(term_id),
+                term_obj);
+
+            PyDict_SetItemAndSteal(
+                id2df,
+                PyLong_FromLong(term_id),
+                PyLong_FromUnsignedLongLong(
+                    self->shared_tables_->term_document_frequency(term_id)));
+        }
+    } else {
+        indri::index::DiskIndex* const index = Index_disk_index(self);
+
+        if (index == NULL) {
+            Py_DECREF(token2id);
+            Py_DECREF(id2token);
+            Py_DECREF(id2df);
+
+            return NULL;
+        }
+
+        indri::index::VocabularyIterator* const vocabulary_it = index->vocabularyIterator();
+
+        vocabulary_it->startIteration();
+
+        while (!vocabulary_it->finished()) {
+            indri::index::DiskTermData* const term_data = vocabulary_it->currentEntry();
+
+            const lemur::api::TERMID_T term_id = term_data->termID;
+            const string term = term_data->termData->term;
+
+            const unsigned int document_frequency = term_data->termData->corpus.documentCount;
+            CHECK_GT(document_frequency, 0);
+
+            PyObject* const term_obj = Index_intern_term(
+                self, index->uniqueTermCount() + 1,
+                term_id, term.c_str(), term.size());
+
+            if (term_obj == NULL) {
+                delete vocabulary_it;
+
+                Py_DECREF(token2id);
+                Py_DECREF(id2token);
+                Py_DECREF(id2df);
+
+                return NULL;
+            }
+
+            Py_INCREF(term_obj);
+
+            PyDict_SetItemAndSteal(
+                token2id,
+                term_obj,
+                PyLong_FromLong(term_id));
+
+            PyDict_SetItemAndSteal(
+                id2token,
+                PyLong_FromLong(term_id),
+                term_obj);
+
+            PyDict_SetItemAndSteal(
+                id2df,
+                PyLong_FromLong(term_id),
+                PyLong_FromLong(document_frequency));
+
+            vocabulary_it->nextEntry();
+        }
+
+        delete vocabulary_it;
+
+        CHECK_EQ(PyDict_Size(token2id), index->uniqueTermCount());
+        CHECK_EQ(PyDict_Size(id2token), index->uniqueTermCount());
+        CHECK_EQ(PyDict_Size(id2df), index->uniqueTermCount());
+    }
+
+    PyObject* ret = PyTuple_Pack(3, token2id, id2token, id2df);
+
+    Py_DECREF(token2id);
+    Py_DECREF(id2token);
+    Py_DECREF(id2df);
+
+    return ret;
+}
+
+static PyObject* Index_get_term_frequencies(Index* self, PyObject* args) {
+    PyObject* const id2tf = PyDict_New();
+
+    if (self->shared_tables_ != NULL) {
+        for (size_t term_id = 1; term_id < self->shared_tables_->num_terms(); ++term_id) {
+            PyDict_SetItemAndSteal(
+                id2tf,
+                PyLong_FromLong(term_id),
+                PyLong_FromUnsignedLongLong(self->shared_tables_->term_frequency(term_id)));
+        }
+
+        return id2tf;
+    }
+
+    indri::index::DiskIndex* const index = Index_disk_index(self);
+
+    if (index == NULL) {
+        Py_DECREF(id2tf);
+
+        return NULL;
+    }
+
+    indri::index::VocabularyIterator* const vocabulary_it = index->vocabularyIterator();
+
+    vocabulary_it->startIteration();
+
+    while (!vocabulary_it->finished()) {
+        indri::index::DiskTermData* const term_data = vocabulary_it->currentEntry();
+
+        const lemur::api::TERMID_T term_id = term_data->termID;
+
+        const uint64_t term_frequency = term_data->termData->corpus.totalCount;
+        CHECK_GT(term_frequency, 0);
+
+        PyDict_SetItemAndSteal(id2tf,
+                               PyLong_FromLong(term_id),
+                               PyLong_FromLong(term_frequency));
+
+        vocabulary_it->nextEntry();
+    }
+
+    delete vocabulary_it;
+
+    CHECK_EQ(PyDict_Size(id2tf), index->uniqueTermCount());
+
+    return id2tf;
+}
+
+static PyMethodDef Index_methods[] = {
+    {"document_ids", (PyCFunction) LockedArgs<Index, Index_get_document_ids>, METH_VARARGS,
+     "Returns the internal DOC_IDs given the external identifiers."},
+    {"document", (PyCFunction) LockedKeywords<Index, Index_document>, METH_VARARGS | METH_KEYWORDS,
+     "Return a document (ext_document_id, terms) pair, where terms are strings "
+     "instead of term identifiers if as_strings is set."},
+    {"ext_document_id", (PyCFunction) LockedArgs<Index, Index_ext_document_id>, METH_VARARGS,
+     "Return a document external identifier pair."},
+    {"document_base", (PyCFunction) LockedNoArgs<Index, Index_document_base>, METH_NOARGS,
+     "Returns the lower bound document identifier (inclusive)."},
+    {"maximum_document", (PyCFunction) LockedNoArgs<Index, Index_maximum_document>, METH_NOARGS,
+     "Returns the upper bound document identifier (exclusive)."},
+
+    {"document_count", (PyCFunction) LockedNoArgs<Index, Index_document_count>, METH_NOARGS,
+     "Returns the number of documents in the index."},
+    {"document_length", (PyCFunction) LockedArgs<Index, Index_document_length>, METH_VARARGS,
+     "Returns the length of a document."},
+    {"document_lengths", (PyCFunction) LockedNoArgs<Index, Index_document_lengths>, METH_NOARGS,
+     "Returns a read-only memoryview of all document lengths, indexed by "
+     "internal document identifier (requires shared_tables)."},
+
+    {"total_terms", (PyCFunction) LockedNoArgs<Index, Index_total_terms>, METH_NOARGS,
+     "Returns the number of total terms in the index."},
+    {"unique_terms", (PyCFunction) LockedNoArgs<Index, Index_unique_terms>, METH_NOARGS,
+     "Returns the number of unique terms in the index."},
+
+    {"iter_documents", (PyCFunction) LockedKeywords<Index, Index_iter_documents>, METH_VARARGS | METH_KEYWORDS,
+     "Iterates over batches (document_ids, offsets, terms) of documents decoded "
+     "ahead by num_threads background threads."},
+
+    {"cooccurrence", (PyCFunction) LockedKeywords<Index, Index_cooccurrence>, METH_VARARGS | METH_KEYWORDS,
+     "Counts windowed term co-occurrences; returns a symmetric matrix as "
+     "(rows, columns, counts) coordinates."},
+
+    {"bag_of_words", (PyCFunction) LockedKeywords<Index, Index_bag_of_words>, METH_VARARGS | METH_KEYWORDS,
+     "Returns the term counts of a range of documents in CSR format as "
+     "(data, indices, indptr)."},
+
+    {"fields", (PyCFunction) LockedNoArgs<Index, Index_fields>, METH_NOARGS,
+     "Returns the names of the indexed fields."},
+    {"field_statistics", (PyCFunction) LockedKeywords<Index, Index_field_statistics>, METH_VARARGS | METH_KEYWORDS,
+     "Returns the collection statistics of a field, optionally for given terms."},
+    {"field_extents", (PyCFunction) LockedKeywords<Index, Index_field_extents>, METH_VARARGS | METH_KEYWORDS,
+     "Returns the extents of a field within documents as (offsets, begins, ends)."},
+    {"passages", (PyCFunction) LockedKeywords<Index, Index_passages>, METH_VARARGS | METH_KEYWORDS,
+     "Returns the terms of passages [begin, end) of documents as (offsets, terms), "
+     "followed by the passage texts if include_text is set."},
+    {"field_lengths", (PyCFunction) LockedKeywords<Index, Index_field_lengths>, METH_VARARGS | METH_KEYWORDS,
+     "Returns the length of a field within documents."},
+    {"field_term_counts", (PyCFunction) LockedKeywords<Index, Index_field_term_counts>, METH_VARARGS | METH_KEYWORDS,
+     "Returns the counts of terms within a field of documents as a row-major "
+     "matrix."},
+
+    {"score_documents", (PyCFunction) LockedKeywords<Index, Index_score_documents>, METH_VARARGS | METH_KEYWORDS,
+     "Scores documents for a query of term identifiers using a retrieval model "
+     "(dirichlet, jm, bm25 or tfidf) computed from the postings."},
+    {"sweep", (PyCFunction) LockedKeywords<Index, Index_sweep>, METH_VARARGS | METH_KEYWORDS,
+     "Ranks the documents matching a query of term identifiers under several "
+     "parameter configurations of a retrieval model in a single pass over the "
+     "postings; returns one ((int_document_id, score), ...) ranking per "
+     "configuration."},
+
+    {"document_embeddings", (PyCFunction) LockedKeywords<Index, Index_document_embeddings>, METH_VARARGS | METH_KEYWORDS,
+     "Returns the tf-idf (or tf) weighted centroids of the term embeddings of "
+     "documents as a flat row-major float32 matrix."},
+
+    {"warm_up", (PyCFunction) LockedKeywords<Index, Index_warm_up>, METH_VARARGS | METH_KEYWORDS,
+     "Faults index files (vocabulary, lengths, postings, documents and/or "
+     "collection) into the page cache, optionally pinning them in memory."},
+    {"warm_up_progress", (PyCFunction) LockedNoArgs<Index, Index_warm_up_progress>, METH_NOARGS,
+     "Returns the progress of the last warm-up."},
+
+    {"term", (PyCFunction) LockedArgs<Index, Index_term>, METH_VARARGS,
+     "Returns the term with the given identifier."},
+    {"term_count", (PyCFunction) LockedArgs<Index, Index_term_count>, METH_VARARGS,
+     "Return the term frequency for a term."},
+    {"term_stats", (PyCFunction) LockedArgs<Index, Index_term_stats>, METH_VARARGS,
+     "Returns (term_ids, document_frequencies, collection_frequencies) of "
+     "terms given as strings or term identifiers; unknown terms get zeros."},
+
+    {"process_term", (PyCFunction) LockedArgs<Index, Index_process_term>, METH_VARARGS,
+     "Pre-processes an index term."},
+
+    {"get_dictionary", (PyCFunction) LockedArgs<Index, Index_get_dictionary>, METH_NOARGS,
+     "Extracts the dictionary from the index."},
+    {"get_term_frequencies", (PyCFunction) LockedArgs<Index, Index_get_term_frequencies>, METH_NOARGS,
+     "Extracts the term frequencies from the index."},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef Index_members[] = {
+    {"path", T_STRING, offsetof(Index, repository_path_), READONLY, "path to repository"},
+    {NULL}  /* Sentinel */
+};
+
+// Sampling
+
+// Vose's alias method: draws an index in [0, n) with probability proportional
+// to its weight in O(1).
+class AliasTable {
+ public:
+    explicit AliasTable(const std::vector<double>& weights)
+            : probabilities_(weights.size()), aliases_(weights.size()) {
+        const size_t n = weights.size();
+
+        double total = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            total += weights[i];
+        }
+
+        std::vector<double> scaled(n);
+        std::vector<UINT32> small, large;
+
+        for (size_t i = 0; i < n; ++i) {
+            scaled[i] = weights[i] * n / total;
+
+            if (scaled[i] < 1.0) {
+                small.push_back(i);
+            } else {
+                large.push_back(i);
+            }
+        }
+
+        while (!small.empty() && !large.empty()) {
+            const UINT32 less = small.back();
+            small.pop_back();
+            const UINT32 more = large.back();
+
+            probabilities_[less] = scaled[less];
+            aliases_[less] = more;
+
+            scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+
+            if (scaled[more] < 1.0) {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+
+        // Remaining entries are (up to rounding errors) exactly 1.
+        for (size_t i = 0; i < large.size(); ++i) {
+            probabilities_[large[i]] = 1.0;
+            aliases_[large[i]] = large[i];
+        }
+
+        for (size_t i = 0; i < small.size(); ++i) {
+            probabilities_[small[i]] = 1.0;
+            aliases_[small[i]] = small[i];
+        }
+    }
+
+    size_t size() const { return probabilities_.size(); }
+
+    // Maps 64 random bits to an index; the upper half selects the column and
+    // the lower half the coin.
+    UINT32 draw(const UINT64 random_bits) const {
+        const UINT32 column = static_cast<UINT32>(
+            ((random_bits >> 32) * probabilities_.size()) >> 32);
+        const double coin = static_cast<UINT32>(random_bits) * (1.0 / 4294967296.0);
+
+        return coin < probabilities_[column] ? column : aliases_[column];
+    }
+
+ private:
+    std::vector<double> probabilities_;
+    std::vector<UINT32> aliases_;
+};
+
+// Draws are generated in blocks that each use a generator seeded from the
+// sampler seed, the call and the block index, such that samples for a given
+// seed do not depend on the number of threads.
+static const size_t SAMPLE_BLOCK_SIZE = 1 << 16;
+
+typedef struct {
+    PyObject_HEAD
+
+    AliasTable* term_table_;
+
+    lemur::api::DOCID_T document_base_;
+    lemur::api::DOCID_T maximum_document_;
+
+    UINT64 seed_;
+    UINT64 calls_;
+} TermSampler;
+
+static void TermSampler_dealloc(TermSampler* self) {
+    delete self->term_table_;
+    self->term_table_ = NULL;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static PyObject* TermSampler_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    TermSampler* self;
+
+    self = (TermSampler*) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->term_table_ = NULL;
+
+        self->document_base_ = 0;
+        self->maximum_document_ = 0;
+
+        self->seed_ = 0;
+        self->calls_ = 0;
+    }
+
+    return (PyObject*) self;
+}
+
+static int TermSampler_init(TermSampler* self, PyObject* args, PyObject* kwds) {
+    PyObject* index_obj = NULL;
+    double power = 0.75;
+    PyObject* seed_obj = Py_None;
+
+    static char* kwlist[] = {"index", "power", "seed", NULL};
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|dO", kwlist,
+                                     state->index_type, &index_obj,
+                                     &power,
+                                     &seed_obj)) {
+        return -1;
+    }
+
+    if (seed_obj == Py_None) {
+        std::random_device random_device;
+        self->seed_ = (static_cast<UINT64>(random_device()) << 32) | random_device();
+    } else {
+        self->seed_ = PyLong_AsUnsignedLongLongMask(seed_obj);
+
+        if (PyErr_Occurred()) {
+            return -1;
+        }
+    }
+
+    Index* const index_self = (Index*) index_obj;
+
+    indri::index::DiskIndex* index;
+    std::vector<double> weights;
+
+    // Excludes concurrent calls on the Index, as its methods do.
+    PYNDRI_BEGIN_CRITICAL_SECTION(index_obj);
+
+    index = Index_disk_index(index_self);
+
+    if (index != NULL) {
+        self->document_base_ = index->documentBase();
+        self->maximum_document_ = index->documentMaximum();
+
+        // Term identifiers are contiguous and start at 1; the table is indexed by
+        // term identifier minus one.
+        weights.resize(index->uniqueTermCount(), 0.0);
+
+        if (index_self->shared_tables_ != NULL) {
+            for (size_t term_id = 1; term_id < index_self->shared_tables_->num_terms(); ++term_id) {
+                weights[term_id - 1] = std::pow(
+                    static_cast<double>(index_self->shared_tables_->term_frequency(term_id)),
+                    power);
+            }
+        } else {
+            indri::index::VocabularyIterator* const vocabulary_it = index->vocabularyIterator();
+
+            vocabulary_it->startIteration();
+
+            while (!vocabulary_it->finished()) {
+                indri::index::DiskTermData* const term_data = vocabulary_it->currentEntry();
+
+                CHECK_GT(term_data->termID, 0);
+                CHECK(static_cast<size_t>(term_data->termID) <= weights.size());
+
+                weights[term_data->termID - 1] = std::pow(
+                    static_cast<double>(term_data->termData->corpus.totalCount), power);
+
+                vocabulary_it->nextEntry();
+            }
+
+            delete vocabulary_it;
+        }
+    }
+
+    PYNDRI_END_CRITICAL_SECTION();
+
+    if (index == NULL) {
+        return -1;
+    }
+
+    if (weights.empty()) {
+        PyErr_SetString(PyExc_ValueError, "Index has an empty vocabulary.");
+
+        return -1;
+    }
+
+    self->term_table_ = new AliasTable(weights);
+
+    return 0;
+}
+
+// Fills samples using one generator per block of SAMPLE_BLOCK_SIZE draws;
+// draw(random_bits) maps 64 random bits to a sample.
+static void FillSamples(const UINT64 seed, const UINT64 call,
+                        const std::function<INT32(UINT64)>& draw,
+                        INT32* const samples, const size_t num_samples,
+                        const size_t num_threads) {
+    const size_t num_blocks = (num_samples + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+
+    ParallelFor(num_threads, num_blocks, [&](const size_t block) {
+        std::seed_seq seed_sequence{
+            static_cast<UINT32>(seed), static_cast<UINT32>(seed >> 32),
+            static_cast<UINT32>(call), static_cast<UINT32>(call >> 32),
+            static_cast<UINT32>(block), static_cast<UINT32>(block >> 32)};
+        std::mt19937_64 generator(seed_sequence);
+
+        const size_t begin = block * SAMPLE_BLOCK_SIZE;
+        const size_t end = std::min(begin + SAMPLE_BLOCK_SIZE, num_samples);
+
+        for (size_t i = begin; i < end; ++i) {
+            samples[i] = draw(generator());
+        }
+    });
+}
+
+// Draws samples into a new int32 memoryview of num_samples_obj entries, or into
+// the writable int32 buffer out_obj.
+static PyObject* TermSampler_fill(TermSampler* self,
+                                  PyObject* num_samples_obj,
+                                  PyObject* out_obj,
+                                  const long num_threads,
+                                  const std::function<INT32(UINT64)>& draw) {
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
+
+        return NULL;
+    }
+
+    if ((num_samples_obj == Py_None) == (out_obj == Py_None)) {
+        PyErr_SetString(PyExc_TypeError, "Specify either num_samples or out.");
+
+        return NULL;
+    }
+
+    const UINT64 call = self->calls_++;
+
+    if (out_obj != Py_None) {
+        Py_buffer buffer;
+
+        if (!GetInt32Buffer(out_obj, true /* writable */, "out", &buffer)) {
+            return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        FillSamples(self->seed_, call, draw,
+                    static_cast<INT32*>(buffer.buf), buffer.len / sizeof(INT32),
+                    num_threads);
+        Py_END_ALLOW_THREADS
+
+        PyBuffer_Release(&buffer);
+
+        Py_INCREF(out_obj);
+        return out_obj;
+    }
+
+    const Py_ssize_t num_samples = PyLong_AsSsize_t(num_samples_obj);
+
+    if (num_samples < 0) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "num_samples should be non-negative.");
+        }
+
+        return NULL;
+    }
+
+    PyObject* const bytes = PyBytes_FromStringAndSize(NULL, num_samples * sizeof(INT32));
+
+    if (bytes == NULL) {
+        return NULL;
+    }
+
+    // Not shared yet, hence safe to fill in place.
+    INT32* const samples = reinterpret_cast<INT32*>(PyBytes_AS_STRING(bytes));
+
+    Py_BEGIN_ALLOW_THREADS
+    FillSamples(self->seed_, call, draw, samples, num_samples, num_threads);
+    Py_END_ALLOW_THREADS
+
+    PyObject* const view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+
+    if (view == NULL) {
+        return NULL;
+    }
+
+    PyObject* const ret = PyObject_CallMethod(view, "cast", "s", "i");
+    Py_DECREF(view);
+
+    return ret;
+}
+
+static PyObject* TermSampler_sample_terms(TermSampler* self, PyObject* args, PyObject* kwds) {
+    PyObject* num_samples_obj = Py_None;
+    PyObject* out_obj = Py_None;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"num_samples", "out", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOl", kwlist,
+                                     &num_samples_obj, &out_obj, &num_threads)) {
+        return NULL;
+    }
+
+    const AliasTable* const term_table = self->term_table_;
+
+    return TermSampler_fill(
+        self, num_samples_obj, out_obj, num_threads,
+        [term_table](const UINT64 random_bits) {
+            return static_cast<INT32>(term_table->draw(random_bits) + 1);
+        });
+}
+
+static PyObject* TermSampler_sample_documents(TermSampler* self, PyObject* args, PyObject* kwds) {
+    PyObject* num_samples_obj = Py_None;
+    PyObject* out_obj = Py_None;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"num_samples", "out", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOl", kwlist,
+                                     &num_samples_obj, &out_obj, &num_threads)) {
+        return NULL;
+    }
+
+    const lemur::api::DOCID_T document_base = self->document_base_;
+    const UINT64 num_documents = self->maximum_document_ - self->document_base_;
+
+    if (num_documents == 0) {
+        PyErr_SetString(PyExc_ValueError, "Index does not contain any documents.");
+
+        return NULL;
+    }
+
+    return TermSampler_fill(
+        self, num_samples_obj, out_obj, num_threads,
+        [document_base, num_documents](const UINT64 random_bits) {
+            return static_cast<INT32>(
+                document_base + (((random_bits >> 32) * num_documents) >> 32));
+        });
+}
+
+static PyMethodDef TermSampler_methods[] = {
+    {"sample_terms", (PyCFunction) LockedKeywords<TermSampler, TermSampler_sample_terms>, METH_VARARGS | METH_KEYWORDS,
+     "Draws term identifiers proportional to their collection frequency raised "
+     "to the sampler's power."},
+    {"sample_documents", (PyCFunction) LockedKeywords<TermSampler, TermSampler_sample_documents>, METH_VARARGS | METH_KEYWORDS,
+     "Draws internal document identifiers uniformly."},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef TermSampler_members[] = {
+    {"seed", T_ULONGLONG, offsetof(TermSampler, seed_), READONLY, "seed of the sampler"},
+    {NULL}  /* Sentinel */
+};
+
+// Queries
+
+// Static per-document scores (e.g., log-probability priors) stored as a file
+// of float32 values indexed by internal document identifier. The file is
+// memory-mapped read-only, such that it is shared between processes. The
+// bounds on the priors are either given or computed on first use, as scanning
+// the file faults in all of its pages.
+class DocumentPriors {
+ public:
+    // Bounds, if given, should hold all priors. Returns NULL, with error set,
+    // on failure.
+    static std::shared_ptr<const DocumentPriors> Open(const std::string& path,
+                                                      const double* const bounds,
+                                                      std::string* const error) {
+        const int fd = open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            *error = "Unable to open priors " + path + ": " + strerror(errno);
+
+            return std::shared_ptr<const DocumentPriors>();
+        }
+
+        struct stat file_stat;
+
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size % sizeof(float) != 0) {
+            close(fd);
+            *error = "Priors " + path + " should contain float32 values.";
+
+            return std::shared_ptr<const DocumentPriors>();
+        }
+
+        const size_t size = file_stat.st_size;
+        void* mapping = NULL;
+
+        if (size > 0) {
+            mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+
+        if (mapping == MAP_FAILED) {
+            *error = "Unable to map priors " + path + ": " + strerror(errno);
+
+            return std::shared_ptr<const DocumentPriors>();
+        }
+
+        DocumentPriors* const priors =
+            new DocumentPriors(static_cast<const float*>(mapping), size / sizeof(float));
+
+        if (bounds != NULL) {
+            std::call_once(priors->bounds_flag_, [priors, bounds]() {
+                priors->SetBounds(bounds[0], bounds[1]);
+            });
+        }
+
+        return std::shared_ptr<const DocumentPriors>(priors);
+    }
+
+    ~DocumentPriors() {
+        if (priors_ != NULL) {
+            munmap(const_cast<float*>(priors_), size_ * sizeof(float));
+        }
+    }
+
+    size_t size() const { return size_; }
+
+    float prior(const lemur::api::DOCID_T int_document_id) const {
+        return (int_document_id >= 0 && static_cast<size_t>(int_document_id) < size_) ?
+            priors_[int_document_id] : 0.0f;
+    }
+
+    // Upper bound on weight * prior over all documents.
+    double bound(const double weight) const {
+        if (weight == 0.0) {
+            return 0.0;
+        }
+
+        std::call_once(bounds_flag_, [this]() {
+            double minimum = 0.0;
+            double maximum = 0.0;
+
+            for (size_t i = 0; i < size_; ++i) {
+                minimum = std::min<double>(minimum, priors_[i]);
+                maximum = std::max<double>(maximum, priors_[i]);
+            }
+
+            SetBounds(minimum, maximum);
+        });
+
+        return weight >= 0.0 ? weight * maximum_ : weight * minimum_;
+    }
+
+ private:
+    DocumentPriors(const float* priors, const size_t size)
+            : priors_(priors), size_(size), minimum_(0.0), maximum_(0.0) {}
+
+    void SetBounds(const double minimum, const double maximum) const {
+        minimum_ = std::min(minimum, 0.0);
+        maximum_ = std::max(maximum, 0.0);
+    }
+
+    const float* priors_;
+    size_t size_;
+
+    // Include 0, the prior of documents beyond the end of the file. Set once,
+    // before the first call to bound returns.
+    mutable std::once_flag bounds_flag_;
+    mutable double minimum_;
+    mutable double maximum_;
+};
+
+// A query that can be evaluated without holding the GIL.
+struct QueryRequest {
+    QueryRequest() : results_requested(0), include_snippets(false), include_extents(false),
+                     prior_weight(0.0), has_deadline(false), allow_partial(false) {}
+
+    std::string query_str;
+    std::vector<lemur::api::DOCID_T> document_ids;
+
+    long results_requested;
+    bool include_snippets;
+
+    // Whether results include the begin and end of the scored extent (e.g.,
+    // a passage when using #combine[passageN:M]).
+    bool include_extents;
+
+    // Added to the retrieval scores, weighted by prior_weight, if set.
+    std::shared_ptr<const DocumentPriors> priors;
+    double prior_weight;
+
+    // If a deadline or cancellation flag is set, evaluation stops once the
+    // deadline passes or the flag is raised (see RunQueryInChunks).
+    bool has_deadline;
+    Clock::time_point deadline;
+    std::shared_ptr<std::atomic<bool> > cancelled;
+
+    // Whether to return partial results, flagged as such, instead of raising.
+    bool allow_partial;
+};
+
+struct QueryResponse {
+    QueryResponse() : partial(false), failed(false) {}
+
+    std::vector<indri::api::ScoredExtentResult> results;
+    std::vector<std::string> snippets;
+
+    // Whether evaluation stopped early.
+    bool partial;
+
+    bool failed;
+    std::string error;
+};
+
+// Converts the Python arguments of a query. Returns false, with an exception
+// set, on failure.
+static bool BuildQueryRequest(PyObject* query,
+                              PyObject* document_set,
+                              long results_requested,
+                              bool include_snippets,
+                              QueryRequest* const request) {
+    CHECK(PyUnicode_Check(query));
+
+    PyObject* query_bytes = PyUnicode_AsEncodedString(query, ENCODING, "strict");
+
+    if (query_bytes == NULL) {
+        return false;
+    }
+
+    request->query_str = PyBytes_AsString(query_bytes);
+
+    Py_DECREF(query_bytes);
+
+    if (document_set != NULL && document_set != Py_None) {
+        PyObject* const iterator = PyObject_GetIter(document_set);
+        PyObject *item;
+
+        if (iterator == NULL) {
+            PyErr_SetString(
+                PyExc_TypeError,
+                "Passed object for document_set not iterable.");
+
+            return false;
+        }
+
+        while ((item = PyIter_Next(iterator)) != NULL) {
+            CHECK(PyLong_CheckExact(item));
+
+            const lemur::api::DOCID_T int_doc_id = PyLong_AsLong(item);
+
+            Py_DECREF(item);
+
+            if (int_doc_id < 0) {
+                continue;
+            }
+
+            request->document_ids.push_back(int_doc_id);
+        }
+
+        Py_DECREF(iterator);
+
+        if (PyErr_Occurred()) {
+            return false;
+        }
+    }
+
+    if (results_requested <= 0) {
+        if (document_set != NULL && document_set != Py_None) {
+            results_requested = request->document_ids.size();
+        } else {
+            results_requested = 100;
+        }
+    }
+
+    CHECK_GE(results_requested, 0);
+
+    request->results_requested = results_requested;
+    request->include_snippets = include_snippets;
+
+    return true;
+}
+
+// Throws lemur::api::Exception on failure.
+static indri::api::QueryAnnotation* RunQuery(indri::api::QueryEnvironment* const query_env,
+                                             const QueryRequest& request,
+                                             const size_t results_requested) {
+    if (request.document_ids.empty()) {
+        return query_env->runAnnotatedQuery(
+            request.query_str, results_requested);
+    } else {
+        return query_env->runAnnotatedQuery(
+            request.query_str, request.document_ids, results_requested);
+    }
+}
+
+static bool CompareScoredExtentResults(const indri::api::ScoredExtentResult& a,
+                                       const indri::api::ScoredExtentResult& b) {
+    return a.score > b.score || (a.score == b.score && a.document < b.document);
+}
+
+// Maximum number of evaluations of a query by RunQueryWithPriors, and the
+// factor by which the depth grows between them.
+static const size_t PRIOR_MAX_RUNS = 3;
+static const size_t PRIOR_DEPTH_GROWTH = 8;
+
+// Retrieves the exact top documents by retrieval score plus weighted prior,
+// without over-fetching a fixed multiple of candidates. Unfetched documents
+// score at most the lowest retrieved score plus the largest weighted prior;
+// the depth grows until the k-th best combined score reaches that bound. The
+// query is evaluated at most PRIOR_MAX_RUNS times, the last time over all
+// candidates. Throws lemur::api::Exception on failure.
+static indri::api::QueryAnnotation* RunQueryWithPriors(
+        indri::api::QueryEnvironment* const query_env,
+        const QueryRequest& request,
+        std::vector<indri::api::ScoredExtentResult>* const results) {
+    const size_t k = request.results_requested;
+    const size_t num_candidates = request.document_ids.empty() ?
+        query_env->documentCount() : request.document_ids.size();
+
+    const double prior_bound = request.priors->bound(request.prior_weight);
+
+    size_t depth = std::max<size_t>(k, 1);
+
+    for (size_t run = 1; ; ++run) {
+        if (run == PRIOR_MAX_RUNS) {
+            depth = std::max(depth, num_candidates);
+        }
+
+        indri::api::QueryAnnotation* const query_annotation =
+            RunQuery(query_env, request, depth);
+
+        *results = query_annotation->getResults();
+
+        const bool exhaustive = results->size() < depth || depth >= num_candidates;
+        const double unfetched_bound = results->empty() ?
+            0.0 : results->back().score + prior_bound;
+
+        for (size_t i = 0; i < results->size(); ++i) {
+            (*results)[i].score +=
+                request.prior_weight * request.priors->prior((*results)[i].document);
+        }
+
+        std::sort(results->begin(), results->end(), &CompareScoredExtentResults);
+
+        if (exhaustive || k == 0 ||
+            (results->size() >= k && (*results)[k - 1].score >= unfetched_bound)) {
+            if (results->size() > k) {
+                results->resize(k);
+            }
+
+            return query_annotation;
+        }
+
+        delete query_annotation;
+
+        depth *= PRIOR_DEPTH_GROWTH;
+    }
+}
+
+// Bounds on the number of documents evaluated at once by RunQueryInChunks.
+// Chunks start small, such that the deadline is checked soon after
+// evaluation starts, and double up to QUERY_CHUNK_SIZE.
+static const size_t QUERY_FIRST_CHUNK_SIZE = 1;
+static const size_t QUERY_CHUNK_SIZE = 1 << 16;
+
+// Whether the evaluation of a request should stop.
+static bool QueryInterrupted(const QueryRequest& request) {
+    return (request.has_deadline && Clock::now() >= request.deadline) ||
+           (request.cancelled && request.cancelled->load());
+}
+
+// Evaluates a query over consecutive chunks of its document set, or of the
+// internal document identifiers of the whole collection if it has none, such
+// that evaluation can stop between chunks at the deadline or on cancellation
+// with the best results of the chunks evaluated so far. Indri scores do not
+// depend on the document set, hence merging the top results of all chunks
+// gives the results of a single evaluation. The annotation of the chunk that
+// produced results[i] is annotations[result_annotations[i]]. Sets
+// num_evaluated to the number of documents in the evaluated chunks.
+// Throws lemur::api::Exception on failure.
+static void RunQueryInChunks(indri::api::QueryEnvironment* const query_env,
+                             const QueryRequest& request,
+                             std::vector<indri::api::QueryAnnotation*>* const annotations,
+                             std::vector<indri::api::ScoredExtentResult>* const results,
+                             std::vector<size_t>* const result_annotations,
+                             bool* const partial,
+                             size_t* const num_evaluated) {
+    const size_t k = request.results_requested;
+
+    // Internal document identifiers of a repository are 1, ..., documentCount().
+    const bool whole_collection = request.document_ids.empty();
+    const size_t num_candidates = whole_collection ?
+        query_env->documentCount() : request.document_ids.size();
+
+    QueryRequest chunk_request;
+    chunk_request.query_str = request.query_str;
+    chunk_request.results_requested = request.results_requested;
+    chunk_request.priors = request.priors;
+    chunk_request.prior_weight = request.prior_weight;
+
+    std::vector<std::pair<indri::api::ScoredExtentResult, size_t> > merged;
+
+    *partial = false;
+    *num_evaluated = 0;
+
+    for (size_t begin = 0, chunk_size = QUERY_FIRST_CHUNK_SIZE;
+         begin < num_candidates;
+         begin += chunk_size, chunk_size = std::min(2 * chunk_size, QUERY_CHUNK_SIZE)) {
+        if (QueryInterrupted(request)) {
+            *partial = true;
+
+            break;
+        }
+
+        const size_t end = std::min(num_candidates, begin + chunk_size);
+
+        *num_evaluated = end;
+
+        if (whole_collection) {
+            chunk_request.document_ids.resize(end - begin);
+
+            for (size_t i = begin; i < end; ++i) {
+                chunk_request.document_ids[i - begin] = i + 1;
+            }
+        } else {
+            chunk_request.document_ids.assign(request.document_ids.begin() + begin,
+                                              request.document_ids.begin() + end);
+        }
+
+        std::vector<indri::api::ScoredExtentResult> chunk_results;
+
+        if (request.priors) {
+            annotations->push_back(
+                RunQueryWithPriors(query_env, chunk_request, &chunk_results));
+        } else {
+            annotations->push_back(RunQuery(query_env, chunk_request, k));
+            chunk_results = annotations->back()->getResults();
+        }
+
+        for (size_t i = 0; i < chunk_results.size(); ++i) {
+            merged.push_back(std::make_pair(chunk_results[i], annotations->size() - 1));
+        }
+
+        std::sort(merged.begin(), merged.end(),
+                  [](const std::pair<indri::api::ScoredExtentResult, size_t>& a,
+                     const std::pair<indri::api::ScoredExtentResult, size_t>& b) {
+                      return CompareScoredExtentResults(a.first, b.first);
+                  });
+
+        if (merged.size() > k) {
+            merged.resize(k);
+        }
+    }
+
+    for (size_t i = 0; i < merged.size(); ++i) {
+        results->push_back(merged[i].first);
+        result_annotations->push_back(merged[i].second);
+    }
+}
+
+// Evaluates a query. Does not touch any Python objects, such that it can be
+// called without holding the GIL.
+static void ExecuteQuery(indri::api::QueryEnvironment* const query_env,
+                         const QueryRequest& request,
+                         QueryProfile* const profile,
+                         QueryResponse* const response) {
+    Clock::time_point phase_start;
+
+    if (profile != NULL) {
+        phase_start = Clock::now();
+
+        std::vector<std::string> query_terms;
+        std::string error;
+
+        if (ExtractQueryTerms(request.query_str, &query_terms, &error)) {
+            try {
+                for (std::vector<std::string>::const_iterator term_it = query_terms.begin();
+                     term_it != query_terms.end();
+                     ++term_it) {
+                    profile->postings_touched += query_env->documentCount(*term_it);
+                }
+            } catch (const lemur::api::Exception& e) {}
+        }
+
+        profile->phase_seconds[QUERY_PHASE_PARSE] = SecondsSince(phase_start);
+        phase_start = Clock::now();
+    }
+
+    // The annotation of results[i] is annotations[result_annotations[i]].
+    std::vector<indri::api::QueryAnnotation*> annotations;
+    std::vector<size_t> result_annotations;
+
+    // Number of documents the query was evaluated on.
+    size_t num_evaluated = 0;
+
+    try {
+        // Indri cannot interrupt the evaluation of a query. Bounded queries are
+        // evaluated in chunks of documents, such that evaluation can stop
+        // between chunks.
+        if (request.has_deadline || request.cancelled) {
+            RunQueryInChunks(query_env, request, &annotations,
+                             &response->results, &result_annotations,
+                             &response->partial, &num_evaluated);
+        } else {
+            if (profile != NULL) {
+                num_evaluated = request.document_ids.empty() ?
+                    query_env->documentCount() : request.document_ids.size();
+            }
+
+            if (request.priors) {
+                annotations.push_back(
+                    RunQueryWithPriors(query_env, request, &response->results));
+            } else {
+                annotations.push_back(RunQuery(query_env, request, request.results_requested));
+                response->results = annotations.back()->getResults();
+            }
+
+            result_annotations.assign(response->results.size(), 0);
+        }
+    } catch (const lemur::api::Exception& e) {
+        for (size_t i = 0; i < annotations.size(); ++i) {
+            delete annotations[i];
+        }
+
+        response->failed = true;
+        response->error = e.what();
+
+        return;
+    }
+
+    if (profile != NULL) {
+        profile->phase_seconds[QUERY_PHASE_EVALUATE] = SecondsSince(phase_start);
+        profile->documents_scored = std::min<UINT64>(num_evaluated, profile->postings_touched);
+        profile->results = response->results.size();
+    }
+
+    if (request.include_snippets) {
+        indri::api::SnippetBuilder builder(false /* html */);
+
+        std::vector<lemur::api::DOCID_T> documentIDs(response->results.size(), 0);
+
+        for (size_t i = 0; i < response->results.size(); ++i) {
+            documentIDs[i] = response->results[i].document;
+        }
+
+        try {
+            if (profile != NULL) {
+                phase_start = Clock::now();
+            }
+
+            const std::vector<indri::api::ParsedDocument*> documents =
+                query_env->documents(documentIDs);
+
+            if (profile != NULL) {
+                profile->phase_seconds[QUERY_PHASE_FETCH_DOCUMENTS] = SecondsSince(phase_start);
+
+                for (size_t i = 0; i < documents.size(); ++i) {
+                    profile->snippet_bytes_decompressed += documents[i]->textLength;
+                }
+
+                phase_start = Clock::now();
+            }
+
+            for (size_t i = 0; i < response->results.size(); ++i) {
+                response->snippets.push_back(
+                    builder.build(documentIDs[i], documents[i],
+                                  annotations[result_annotations[i]]));
+
+                delete documents[i];
+            }
+
+            if (profile != NULL) {
+                profile->phase_seconds[QUERY_PHASE_SNIPPETS] = SecondsSince(phase_start);
+            }
+        } catch (const lemur::api::Exception& e) {}
+    }
+
+    for (size_t i = 0; i < annotations.size(); ++i) {
+        delete annotations[i];
+    }
+
+    if (request.include_snippets && !response->results.empty() &&
+        response->snippets.empty()) {
+        response->failed = true;
+        response->error = "Unable to retrieve snippets. "
+                          "Make sure storeDocs is enabled "
+                          "in your Indri configuration.";
+    }
+}
+
+// Converts the response of a query to a tuple of results, or to a (results,
+// partial) pair if the request allows partial results. Returns NULL, with an
+// exception set, if the query failed or stopped early otherwise.
+static PyObject* QueryResponseToTuple(const QueryRequest& request,
+                                      const QueryResponse& response,
+                                      QueryProfile* const profile) {
+    if (response.failed) {
+        PyErr_SetString(PyExc_IOError, response.error.c_str());
+
+        return NULL;
+    } else if (response.partial && !request.allow_partial) {
+        if (request.cancelled && request.cancelled->load()) {
+            PyErr_SetString(PyExc_InterruptedError, "Query was cancelled.");
+        } else {
+            PyErr_SetString(PyExc_TimeoutError, "Query deadline exceeded.");
+        }
+
+        return NULL;
+    }
+
+    Clock::time_point phase_start;
+
+    if (profile != NULL) {
+        phase_start = Clock::now();
+    }
+
+    const bool include_snippets = request.include_snippets;
+    const bool include_extents = request.include_extents;
+
+    PyObject* results = PyTuple_New(response.results.size());
+
+    std::vector<indri::api::ScoredExtentResult>::const_iterator it = response.results.begin();
+
+    Py_ssize_t pos = 0;
+    for (; it != response.results.end(); ++it, ++pos) {
+        PyObject* const result = PyTuple_New(
+            2 + (include_snippets ? 1 : 0) + (include_extents ? 2 : 0));
+
+        PyTuple_SetItem(result, 0, PyLong_FromLong(it->document));
+        PyTuple_SetItem(result, 1, PyFloat_FromDouble(it->score));
+
+        if (include_snippets) {
+            PyTuple_SetItem(result, 2, PyUnicode_Decode(response.snippets[pos].c_str(),
+                                                        response.snippets[pos].size(),
+                                                        ENCODING,
+                                                        "strict"));
+        }
+
+        if (include_extents) {
+            PyTuple_SetItem(result, include_snippets ? 3 : 2, PyLong_FromLong(it->begin));
+            PyTuple_SetItem(result, include_snippets ? 4 : 3, PyLong_FromLong(it->end));
+        }
+
+       PyTuple_SetItem(results, pos, result);
+    }
+
+    if (profile != NULL) {
+        profile->phase_seconds[QUERY_PHASE_CONVERSION] = SecondsSince(phase_start);
+    }
+
+    if (request.allow_partial) {
+        return Py_BuildValue("(NO)", results, response.partial ? Py_True : Py_False);
+    }
+
+    return results;
+}
+
+// Configuration from which equivalent Indri QueryEnvironments can be created.
+struct QueryEnvironmentConfig {
+    QueryEnvironmentConfig() : prior_weight(1.0) {}
+
+    std::string repository_path;
+
+    std::vector<std::string> rules;
+    std::string baseline;
+
+    std::shared_ptr<const DocumentPriors> priors;
+    double prior_weight;
+};
+
+// Throws lemur::api::Exception if the repository cannot be opened.
+static void ConfigureQueryEnvironment(const QueryEnvironmentConfig& config,
+                                      indri::api::QueryEnvironment* const query_env) {
+    query_env->addIndex(config.repository_path);
+
+    if (!config.rules.empty()) {
+        query_env->setScoringRules(config.rules);
+    } else if (!config.baseline.empty()) {
+        query_env->setBaseline(config.baseline);
+    }
+}
+
+// Fixed-size pool of threads that evaluate queries without holding the GIL.
+//
+// Indri QueryEnvironments are not safe for concurrent use, hence every worker
+// owns a private QueryEnvironment. The state is shared with the workers, such
+// that a worker can outlive the executor when the last reference to the
+// owning Python object is released from within a task.
+class QueryExecutor {
+ public:
+    typedef std::function<void(indri::api::QueryEnvironment*)> Task;
+
+    // Throws lemur::api::Exception if the repository cannot be opened.
+    QueryExecutor(const QueryEnvironmentConfig& config, const size_t num_workers)
+            : state_(new State) {
+        for (size_t i = 0; i < num_workers; ++i) {
+            indri::api::QueryEnvironment* const query_env = new indri::api::QueryEnvironment;
+            state_->query_envs.push_back(query_env);
+
+            ConfigureQueryEnvironment(config, query_env);
+        }
+
+        for (size_t i = 0; i < num_workers; ++i) {
+            threads_.push_back(std::thread(
+                &QueryExecutor::run, state_, state_->query_envs[i]));
+        }
+    }
+
+    ~QueryExecutor() {
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            state_->shutdown = true;
+        }
+
+        state_->condition.notify_all();
+
+        for (std::vector<std::thread>::iterator thread_it = threads_.begin();
+             thread_it != threads_.end();
+             ++thread_it) {
+            if (thread_it->get_id() == std::this_thread::get_id()) {
+                thread_it->detach();
+            } else {
+                thread_it->join();
+            }
+        }
+    }
+
+    void submit(const Task& task) {
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            state_->tasks.push_back(task);
+        }
+
+        state_->condition.notify_one();
+    }
+
+ private:
+    struct State {
+        State() : shutdown(false) {}
+
+        ~State() {
+            for (std::vector<indri::api::QueryEnvironment*>::iterator query_env_it = query_envs.begin();
+                 query_env_it != query_envs.end();
+                 ++query_env_it) {
+                try {
+                    (*query_env_it)->close();
+                } catch (const lemur::api::Exception& e) {}
+
+                delete *query_env_it;
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable condition;
+
+        std::deque<Task> tasks;
+        bool shutdown;
+
+        std::vector<indri::api::QueryEnvironment*> query_envs;
+    };
+
+    static void run(std::shared_ptr<State> state,
+                    indri::api::QueryEnvironment* const query_env) {
+        while (true) {
+            Task task;
+
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+
+                state->condition.wait(lock, [&state]() {
+                    return state->shutdown || !state->tasks.empty();
+                });
+
+                if (state->shutdown) {
+                    return;
+                }
+
+                task = state->tasks.front();
+                state->tasks.pop_front();
+            }
+
+            task(query_env);
+        }
+    }
+
+    std::shared_ptr<State> state_;
+    std::vector<std::thread> threads_;
+};
+
+// CancellationToken
+
+typedef struct {
+    PyObject_HEAD
+
+    std::shared_ptr<std::atomic<bool> >* cancelled_;
+} CancellationToken;
+
+static void CancellationToken_dealloc(CancellationToken* self) {
+    delete self->cancelled_;
+    self->cancelled_ = NULL;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static PyObject* CancellationToken_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    CancellationToken* self;
+
+    self = (CancellationToken*) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->cancelled_ = new std::shared_ptr<std::atomic<bool> >(
+            new std::atomic<bool>(false));
+    }
+
+    return (PyObject*) self;
+}
+
+static PyObject* CancellationToken_cancel(CancellationToken* self) {
+    (*self->cancelled_)->store(true);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* CancellationToken_cancelled(CancellationToken* self, void*) {
+    return PyBool_FromLong((*self->cancelled_)->load());
+}
+
+static PyMemberDef CancellationToken_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyMethodDef CancellationToken_methods[] = {
+    {"cancel", (PyCFunction) CancellationToken_cancel, METH_NOARGS,
+     "Requests cancellation of the queries the token was passed to."},
+
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef CancellationToken_getset[] = {
+    {"cancelled", (getter) CancellationToken_cancelled, NULL,
+     "Whether cancellation has been requested.", NULL},
+
+    {NULL}  /* Sentinel */
+};
+
+// QueryEnvironment
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject* index_;
+    indri::api::QueryEnvironment* query_env_;
+
+    // Serializes the use of query_env_, as queries run without the GIL.
+    std::mutex* query_env_mutex_;
+
+    QueryEnvironmentConfig* config_;
+
+    // Workers for asynchronous queries; created on first use.
+    long num_workers_;
+    QueryExecutor* executor_;
+
+    // Instrumentation is only collected when instrument_ is set.
+    char instrument_;
+    QueryStats* stats_;
+
+    // Value of fork_generation when query_env_ was opened.
+    unsigned long fork_generation_;
+} QueryEnvironment;
+
+static void QueryEnvironment_dealloc(QueryEnvironment* self) {
+    // Otherwise, inherited from the parent process; see QueryEnvironment_reopen.
+    if (self->fork_generation_ == fork_generation) {
+        if (self->executor_ != NULL) {
+            // Workers may be waiting for the GIL.
+            Py_BEGIN_ALLOW_THREADS
+            delete self->executor_;
+            Py_END_ALLOW_THREADS
+
+            self->executor_ = NULL;
+        }
+
+        self->query_env_->close();
+
+        // self->query_env_->close();
+        delete self->query_env_;
+
+        delete self->query_env_mutex_;
+    }
+
+    Py_XDECREF(self->index_);
+    self->index_ = NULL;
+
+    delete self->config_;
+    delete self->stats_;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static PyObject* QueryEnvironment_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    QueryEnvironment* self;
+
+    self = (QueryEnvironment*) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->index_ = NULL;
+        self->query_env_ = new indri::api::QueryEnvironment;
+        self->query_env_mutex_ = new std::mutex;
+
+        self->config_ = new QueryEnvironmentConfig;
+
+        self->num_workers_ = 4;
+        self->executor_ = NULL;
+
+        self->instrument_ = 0;
+        self->stats_ = new QueryStats;
+
+        self->fork_generation_ = fork_generation;
+    }
+
+    return (PyObject*) self;
+}
+
+// Opens a fresh Indri QueryEnvironment when called in a process forked after
+// query_env_ was opened. The inherited environment, its mutex and the
+// executor (whose threads do not exist in the child) are abandoned, as they
+// may be in use by other threads of the parent. Returns false, with an
+// exception set, on failure.
+static bool QueryEnvironment_reopen(QueryEnvironment* self) {
+    if (self->fork_generation_ == fork_generation) {
+        return true;
+    }
+
+    self->query_env_ = new indri::api::QueryEnvironment;
+    self->query_env_mutex_ = new std::mutex;
+    self->executor_ = NULL;
+
+    self->fork_generation_ = fork_generation;
+
+    try {
+        ConfigureQueryEnvironment(*self->config_, self->query_env_);
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return false;
+    }
+
+    return true;
+}
+
+static int QueryEnvironment_init(QueryEnvironment* self, PyObject* args, PyObject* kwds) {
+    PyObject* index_obj = NULL;
+    PyObject* rules_obj = NULL;
+    PyObject* baseline_obj = NULL;
+    int instrument = 0;
+    const char* priors_path = NULL;
+    double prior_weight = 1.0;
+    PyObject* prior_bounds_obj = NULL;
+
+    static char* kwlist[] = {"index", "rules", "baseline", "instrument",
+                             "num_workers", "priors", "prior_weight",
+                             "prior_bounds", NULL};
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O!O!plzdO!", kwlist,
+                                     state->index_type, &index_obj,
+                                     &PyTuple_Type, &rules_obj,
+                                     &PyUnicode_Type, &baseline_obj,
+                                     &instrument,
+                                     &self->num_workers_,
+                                     &priors_path,
+                                     &prior_weight,
+                                     &PyTuple_Type, &prior_bounds_obj)) {
+        return -1;
+    }
+
+    // (minimum, maximum) of the priors, if known.
+    double prior_bounds[2];
+
+    if (prior_bounds_obj != NULL) {
+        if (!PyArg_ParseTuple(prior_bounds_obj, "dd;prior_bounds should be (minimum, maximum).",
+                              &prior_bounds[0], &prior_bounds[1])) {
+            return -1;
+        } else if (prior_bounds[0] > prior_bounds[1]) {
+            PyErr_SetString(PyExc_ValueError,
+                            "prior_bounds should be (minimum, maximum).");
+
+            return -1;
+        }
+    }
+
+    if (priors_path != NULL) {
+        std::string error;
+
+        self->config_->priors = DocumentPriors::Open(
+            priors_path, prior_bounds_obj != NULL ? prior_bounds : NULL, &error);
+
+        if (!self->config_->priors) {
+            PyErr_SetString(PyExc_IOError, error.c_str());
+
+            return -1;
+        }
+    }
+
+    self->config_->prior_weight = prior_weight;
+
+    if (self->num_workers_ <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_workers should be positive.");
+
+        return -1;
+    }
+
+    self->instrument_ = instrument;
+
+    self->index_ = index_obj;
+    Py_INCREF(self->index_);
+
+    PyObject* repostitory_path_obj = PyObject_GetAttrString(
+        self->index_, "path");
+    CHECK_NOTNULL(repostitory_path_obj);
+
+    self->config_->repository_path = PyUnicode_AsUTF8(repostitory_path_obj);
+
+    Py_DECREF(repostitory_path_obj);
+
+    if (rules_obj != NULL && baseline_obj != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to specify smoothing rules for baseline.");
+
+        return -1;
+    } else if (rules_obj != NULL) {
+        for (Py_ssize_t i = 0; i < PyTuple_Size(rules_obj); ++i) {
+            self->config_->rules.push_back(PyUnicode_AsUTF8(PyTuple_GetItem(rules_obj, i)));
+        }
+    } else if (baseline_obj != NULL) {
+        self->config_->baseline = PyUnicode_AsUTF8(baseline_obj);
+    }
+
+    try {
+        ConfigureQueryEnvironment(*self->config_, self->query_env_);
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* QueryEnvironment_run_query(QueryEnvironment* self, PyObject* args, PyObject* kwds) {
+    PyObject* query = NULL;
+    PyObject* document_set = NULL;
+    long results_requested = 0;
+    bool include_snippets = false;
+    PyObject* timeout_obj = Py_None;
+    PyObject* token_obj = Py_None;
+    int allow_partial = 0;
+    int include_extents = 0;
+
+    static char* kwlist[] = {"query_str",
+                             "document_set",
+                             "results_requested",
+                             "include_snippets",
+                             "timeout_ms",
+                             "cancellation_token",
+                             "allow_partial",
+                             "include_extents",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "U|OlbOOpp", kwlist,
+                                     &query,
+                                     &document_set,
+                                     &results_requested,
+                                     &include_snippets,
+                                     &timeout_obj,
+                                     &token_obj,
+                                     &allow_partial,
+                                     &include_extents)) {
+        return NULL;
+    }
+
+    QueryRequest request;
+
+    if (timeout_obj != Py_None) {
+        const double timeout_ms = PyFloat_AsDouble(timeout_obj);
+
+        if (PyErr_Occurred()) {
+            return NULL;
+        } else if (timeout_ms < 0) {
+            PyErr_SetString(PyExc_ValueError, "timeout_ms should be non-negative.");
+
+            return NULL;
+        }
+
+        request.has_deadline = true;
+        request.deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::milli>(timeout_ms));
+    }
+
+    if (token_obj != Py_None) {
+        ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+        if (state == NULL) {
+            return NULL;
+        }
+
+        if (!PyObject_TypeCheck(token_obj, state->cancellation_token_type)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "cancellation_token should be a CancellationToken.");
+
+            return NULL;
+        }
+
+        request.cancelled = *reinterpret_cast<CancellationToken*>(token_obj)->cancelled_;
+    }
+
+    request.allow_partial = allow_partial;
+
+    if (!BuildQueryRequest(query, document_set, results_requested, include_snippets,
+                           &request)) {
+        return NULL;
+    }
+
+    request.include_extents = include_extents;
+
+    request.priors = self->config_->priors;
+    request.prior_weight = self->config_->prior_weight;
+
+    if (!QueryEnvironment_reopen(self)) {
+        return NULL;
+    }
+
+    QueryProfile profile;
+    QueryProfile* const profile_ptr = self->instrument_ ? &profile : NULL;
+
+    QueryResponse response;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    {
+        std::lock_guard<std::mutex> lock(*self->query_env_mutex_);
+        ExecuteQuery(self->query_env_, request, profile_ptr, &response);
+    }
+
+    Py_END_ALLOW_THREADS
+
+    PyObject* const results = QueryResponseToTuple(request, response, profile_ptr);
+
+    if (results != NULL && profile_ptr != NULL) {
+        self->stats_->add(*profile_ptr);
+    }
+
+    return results;
+}
+
+// Evaluates a query submitted through QueryEnvironment._submit on a worker.
+static void RunAsyncQuery(QueryEnvironment* const owner,  // Strong reference.
+                          PyObject* const callback,  // Strong reference.
+                          const std::shared_ptr<const QueryRequest>& request,
+                          const std::shared_ptr<std::atomic<bool> >& cancelled,
+                          const bool instrument,
+                          PyInterpreterState* const interpreter,
+                          indri::api::QueryEnvironment* const query_env) {
+    QueryProfile profile;
+    QueryResponse response;
+
+    if (!cancelled->load()) {
+        ExecuteQuery(query_env, *request, instrument ? &profile : NULL, &response);
+    }
+
+    // PyGILState_Ensure only supports the main interpreter, hence the callback
+    // runs in a fresh thread state of the interpreter that submitted the query.
+    PyThreadState* const thread_state = PyThreadState_New(interpreter);
+    PyEval_RestoreThread(thread_state);
+
+    PyObject* results = NULL;
+    PyObject* error = NULL;
+
+    if (cancelled->load()) {
+        Py_INCREF(Py_None);
+        results = Py_None;
+
+        Py_INCREF(Py_None);
+        error = Py_None;
+    } else {
+        results = QueryResponseToTuple(*request, response, instrument ? &profile : NULL);
+
+        if (results != NULL) {
+            Py_INCREF(Py_None);
+            error = Py_None;
+
+            if (instrument) {
+                PYNDRI_BEGIN_CRITICAL_SECTION(owner);
+                owner->stats_->add(profile);
+                PYNDRI_END_CRITICAL_SECTION();
+            }
+        } else {
+            PyObject* type;
+            PyObject* traceback;
+
+            PyErr_Fetch(&type, &error, &traceback);
+            PyErr_NormalizeException(&type, &error, &traceback);
+
+            Py_XDECREF(type);
+            Py_XDECREF(traceback);
+
+            Py_INCREF(Py_None);
+            results = Py_None;
+        }
+    }
+
+    PyObject* const ret = PyObject_CallFunctionObjArgs(callback, results, error, NULL);
+
+    if (ret == NULL) {
+        PyErr_WriteUnraisable(callback);
+    } else {
+        Py_DECREF(ret);
+    }
+
+    Py_DECREF(results);
+    Py_DECREF(error);
+
+    Py_DECREF(callback);
+    Py_DECREF(owner);
+
+    PyThreadState_Clear(thread_state);
+    PyThreadState_DeleteCurrent();
+}
+
+// Creates the workers of self on first use. Returns false, with an exception
+// set, on failure.
+static bool QueryEnvironment_start_executor(QueryEnvironment* self) {
+    if (self->executor_ != NULL) {
+        return true;
+    }
+
+    QueryExecutor* executor = NULL;
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    try {
+        executor = new QueryExecutor(*self->config_, self->num_workers_);
+    } catch (const lemur::api::Exception& e) {
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return false;
+    }
+
+    // Another thread may have created an executor while this one did not
+    // hold the GIL (or the critical section of self).
+    if (self->executor_ == NULL) {
+        self->executor_ = executor;
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        delete executor;
+        Py_END_ALLOW_THREADS
+    }
+
+    return true;
+}
+
+static PyObject* QueryEnvironment_submit(QueryEnvironment* self, PyObject* args, PyObject* kwds) {
+    PyObject* callback = NULL;
+    PyObject* token_obj = NULL;
+    PyObject* query = NULL;
+    PyObject* document_set = NULL;
+    long results_requested = 0;
+    bool include_snippets = false;
+    int include_extents = 0;
+
+    static char* kwlist[] = {"callback",
+                             "cancellation_token",
+                             "query_str",
+                             "document_set",
+                             "results_requested",
+                             "include_snippets",
+                             "include_extents",
+                             NULL};
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!U|Olbp", kwlist,
+                                     &callback,
+                                     state->cancellation_token_type, &token_obj,
+                                     &query,
+                                     &document_set,
+                                     &results_requested,
+                                     &include_snippets,
+                                     &include_extents)) {
+        return NULL;
+    }
+
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback should be callable.");
+
+        return NULL;
+    }
+
+    std::shared_ptr<QueryRequest> request(new QueryRequest);
+
+    if (!BuildQueryRequest(query, document_set, results_requested, include_snippets,
+                           request.get())) {
+        return NULL;
+    }
+
+    request->include_extents = include_extents;
+
+    request->priors = self->config_->priors;
+    request->prior_weight = self->config_->prior_weight;
+
+    if (!QueryEnvironment_reopen(self)) {
+        return NULL;
+    }
+
+    if (!QueryEnvironment_start_executor(self)) {
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    Py_INCREF(callback);
+
+    self->executor_->submit(std::bind(
+        &RunAsyncQuery,
+        self, callback,
+        std::shared_ptr<const QueryRequest>(request),
+        *((CancellationToken*) token_obj)->cancelled_,
+        static_cast<bool>(self->instrument_),
+        PyInterpreterState_Get(),
+        std::placeholders::_1));
+
+    Py_RETURN_NONE;
+}
+
+// Builds a #weight query of the num_terms terms of a document with the
+// highest tf-idf weights, given the idf of every term identifier (see
+// Index_inverse_document_frequencies). Leaves query_str empty if the document
+// has no terms with positive weight.
+static void BuildSimilarityQuery(indri::index::DiskIndex* const index,
+                                 const lemur::api::DOCID_T int_document_id,
+                                 const std::vector<float>& idf,
+                                 const size_t num_terms,
+                                 std::string* const query_str) {
+    const indri::index::TermList* const term_list = index->termList(int_document_id);
+
+    std::unordered_map<lemur::api::TERMID_T, size_t> term_frequencies;
+
+    for (size_t pos = 0; pos < term_list->terms().size(); ++pos) {
+        const lemur::api::TERMID_T term_id = term_list->terms()[pos];
+
+        // Out-of-vocabulary terms (e.g., stopwords) have identifier 0.
+        if (term_id > 0) {
+            ++term_frequencies[term_id];
+        }
+    }
+
+    delete term_list;
+
+    std::vector<std::pair<double, lemur::api::TERMID_T> > weighted_terms;
+
+    for (std::unordered_map<lemur::api::TERMID_T, size_t>::const_iterator it = term_frequencies.begin();
+         it != term_frequencies.end();
+         ++it) {
+        const double weight = static_cast<size_t>(it->first) < idf.size() ?
+            it->second * idf[it->first] : 0.0;
+
+        if (weight > 0.0) {
+            // Negated such that ties are broken by ascending term identifier.
+            weighted_terms.push_back(std::make_pair(-weight, it->first));
+        }
+    }
+
+    const size_t num_selected = std::min(num_terms, weighted_terms.size());
+
+    std::partial_sort(weighted_terms.begin(),
+                      weighted_terms.begin() + num_selected,
+                      weighted_terms.end());
+
+    query_str->clear();
+
+    if (num_selected == 0) {
+        return;
+    }
+
+    // Indri's query grammar does not accept scientific notation.
+    std::ostringstream query;
+    query << std::fixed << std::setprecision(6) << "#weight(";
+
+    for (size_t i = 0; i < num_selected; ++i) {
+        query << " " << -weighted_terms[i].first
+              << " " << index->term(weighted_terms[i].second);
+    }
+
+    query << " )";
+
+    *query_str = query.str();
+}
+
+static PyObject* QueryEnvironment_similar_documents(QueryEnvironment* self,
+                                                    PyObject* args, PyObject* kwds) {
+    PyObject* document_ids_obj = NULL;
+    long num_terms = 10;
+    long results_requested = 10;
+    int include_seeds = 0;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"document_ids", "num_terms", "results_requested",
+                             "include_seeds", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|llpl", kwlist,
+                                     &document_ids_obj, &num_terms,
+                                     &results_requested, &include_seeds,
+                                     &num_threads)) {
+        return NULL;
+    }
+
+    if (num_terms <= 0 || results_requested <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "num_terms and results_requested should be positive.");
+
+        return NULL;
+    }
+
+    std::vector<INT32> document_ids;
+
+    if (!ParseIdentifiers(document_ids_obj, &document_ids)) {
+        return NULL;
+    }
+
+    Index* const index_self = (Index*) self->index_;
+
+    std::vector<float> idf;
+    std::string repository_path, index_path;
+    bool succeeded = false;
+
+    PYNDRI_BEGIN_CRITICAL_SECTION(index_self);
+
+    indri::index::DiskIndex* const index = Index_disk_index(index_self);
+
+    if (index != NULL &&
+        Index_inverse_document_frequencies(index_self, index->uniqueTermCount() + 1, &idf)) {
+        succeeded = true;
+
+        for (size_t i = 0; i < document_ids.size(); ++i) {
+            if (document_ids[i] < index->documentBase() ||
+                document_ids[i] >= index->documentMaximum()) {
+                PyErr_SetString(PyExc_IndexError,
+                                "Specified internal document identifier is out of bounds.");
+
+                succeeded = false;
+                break;
+            }
+        }
+
+        repository_path = index_self->repository_path_;
+        index_path = *index_self->index_path_;
+    }
+
+    PYNDRI_END_CRITICAL_SECTION();
+
+    if (!succeeded || !QueryEnvironment_reopen(self)) {
+        return NULL;
+    }
+
+    const size_t num_seeds = document_ids.size();
+    const size_t num_parts = std::max<size_t>(
+        std::min<size_t>(std::max(num_threads, 1L), num_seeds), 1);
+
+    if (num_parts > 1 && !QueryEnvironment_start_executor(self)) {
+        return NULL;
+    }
+
+    QueryExecutor* const executor = self->executor_;
+
+    std::vector<QueryRequest> requests(num_seeds);
+    std::vector<QueryResponse> responses(num_seeds);
+
+    for (size_t i = 0; i < num_seeds; ++i) {
+        // One more result, as the seed itself usually ranks first.
+        requests[i].results_requested = results_requested + (include_seeds ? 0 : 1);
+
+        requests[i].priors = self->config_->priors;
+        requests[i].prior_weight = self->config_->prior_weight;
+    }
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    failed = !ParallelForDocuments(
+        repository_path, index_path, num_seeds, num_parts,
+        [&](indri::index::DiskIndex* const thread_index, const size_t i) {
+            BuildSimilarityQuery(thread_index, document_ids[i], idf, num_terms,
+                                 &requests[i].query_str);
+        },
+        &error);
+
+    const std::function<void(indri::api::QueryEnvironment*, size_t)> execute =
+        [&](indri::api::QueryEnvironment* const query_env, const size_t i) {
+            if (!requests[i].query_str.empty()) {
+                ExecuteQuery(query_env, requests[i], NULL, &responses[i]);
+            }
+        };
+
+    if (!failed && num_parts == 1) {
+        std::lock_guard<std::mutex> lock(*self->query_env_mutex_);
+
+        for (size_t i = 0; i < num_seeds; ++i) {
+            execute(self->query_env_, i);
+        }
+    } else if (!failed) {
+        // Parts are evaluated by the workers of the environment (see
+        // num_workers), which own private QueryEnvironments.
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        size_t num_done = 0;
+
+        for (size_t part = 0; part < num_parts; ++part) {
+            executor->submit([&, part](indri::api::QueryEnvironment* const query_env) {
+                const size_t end = num_seeds * (part + 1) / num_parts;
+
+                for (size_t i = num_seeds * part / num_parts; i < end; ++i) {
+                    execute(query_env, i);
+                }
+
+                // Notified while holding the lock, as the waiter owns done_cv.
+                std::lock_guard<std::mutex> lock(done_mutex);
+
+                ++num_done;
+                done_cv.notify_one();
+            });
+        }
+
+        std::unique_lock<std::mutex> lock(done_mutex);
+
+        done_cv.wait(lock, [&]() {
+            return num_done == num_parts;
+        });
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    PyObject* const results = PyTuple_New(num_seeds);
+
+    if (results == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_seeds; ++i) {
+        std::vector<indri::api::ScoredExtentResult>& seed_results = responses[i].results;
+
+        if (!include_seeds) {
+            seed_results.erase(
+                std::remove_if(seed_results.begin(), seed_results.end(),
+                               [&](const indri::api::ScoredExtentResult& result) {
+                                   return result.document == document_ids[i];
+                               }),
+                seed_results.end());
+        }
+
+        if (seed_results.size() > static_cast<size_t>(results_requested)) {
+            seed_results.resize(results_requested);
+        }
+
+        PyObject* const seed_results_obj = QueryResponseToTuple(
+            requests[i], responses[i], NULL);
+
+        if (seed_results_obj == NULL) {
+            Py_DECREF(results);
+
+            return NULL;
+        }
+
+        PyTuple_SET_ITEM(results, i, seed_results_obj);
+    }
+
+    return results;
+}
+
+static PyObject* QueryEnvironment_stats(QueryEnvironment* self, void*) {
+    return QueryStatsToDict(*self->stats_);
+}
+
+static PyObject* QueryEnvironment_reset_stats(QueryEnvironment* self) {
+    delete self->stats_;
+    self->stats_ = new QueryStats;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* QueryEnvironment_internal_obj(QueryEnvironment* self, void*) {
+    if (!QueryEnvironment_reopen(self)) {
+        return NULL;
+    }
+
+    return PyCapsule_New(self->query_env_, "indri::api::QueryEnvironment", NULL);
+}
+
+static PyMemberDef QueryEnvironment_members[] = {
+    {"instrument", T_BOOL, offsetof(QueryEnvironment, instrument_), 0,
+     "whether per-query timings and counters are collected"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMethodDef QueryEnvironment_methods[] = {
+    {"query", (PyCFunction) LockedKeywords<QueryEnvironment, QueryEnvironment_run_query>, METH_VARARGS | METH_KEYWORDS,
+     "Queries an Indri index."},
+    {"_submit", (PyCFunction) LockedKeywords<QueryEnvironment, QueryEnvironment_submit>, METH_VARARGS | METH_KEYWORDS,
+     "Queries an Indri index on a worker thread; calls callback(results, error) "
+     "on completion, or callback(None, None) when cancelled."},
+    {"similar_documents", (PyCFunction) LockedKeywords<QueryEnvironment, QueryEnvironment_similar_documents>, METH_VARARGS | METH_KEYWORDS,
+     "Retrieves, for every seed document, the documents that best match a "
+     "weighted query of its num_terms terms with the highest tf-idf."},
+    {"reset_stats", (PyCFunction) LockedNoArgs<QueryEnvironment, QueryEnvironment_reset_stats>, METH_NOARGS,
+     "Clears the collected query instrumentation."},
+
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef QueryEnvironment_getset[] = {
+    {"_internal_obj", (getter) LockedGetter<QueryEnvironment, QueryEnvironment_internal_obj>, NULL, NULL, NULL},
+    {"stats", (getter) LockedGetter<QueryEnvironment, QueryEnvironment_stats>, NULL,
+     "Query instrumentation: per-phase latency histograms, counters and "
+     "the breakdown of the last instrumented query.", NULL},
+
+    {NULL}  /* Sentinel */
+};
+
+// QueryExpander
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject* query_env_obj_;
+
+    indri::api::QueryEnvironment* query_env_;  // Owned by query_env_obj_.
+    std::mutex* query_env_mutex_;  // Owned by query_env_obj_.
+
+    indri::query::RMExpander* expander_;
+
+    long fb_docs_;
+    long fb_terms_;
+
+    // Value of fork_generation when expander_ was created.
+    unsigned long fork_generation_;
+} QueryExpander;
+
+// Creates the expander on the Indri QueryEnvironment of query_env_obj_.
+static bool QueryExpander_open(QueryExpander* self) {
+    QueryEnvironment* const query_env_obj = (QueryEnvironment*) self->query_env_obj_;
+
+    if (!QueryEnvironment_reopen(query_env_obj)) {
+        return false;
+    }
+
+    indri::api::Parameters rm_parameters;
+    rm_parameters.set("fbDocs", static_cast<int>(self->fb_docs_));
+    rm_parameters.set("fbTerms", static_cast<int>(self->fb_terms_));
+
+    self->query_env_ = query_env_obj->query_env_;
+    self->query_env_mutex_ = query_env_obj->query_env_mutex_;
+
+    self->expander_ = new indri::query::RMExpander(self->query_env_, rm_parameters);
+    self->fork_generation_ = fork_generation;
+
+    return true;
+}
+
+static void QueryExpander_dealloc(QueryExpander* self) {
+    Py_XDECREF(self->query_env_obj_);
+    self->query_env_obj_ = NULL;
+
+    if (self->expander_ != NULL && self->fork_generation_ == fork_generation) {
+        delete self->expander_;
+        self->expander_ = NULL;
+    }
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static PyObject* QueryExpander_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    QueryExpander* self;
+
+    self = (QueryExpander*) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->query_env_obj_ = NULL;
+
+        self->query_env_ = NULL;
+        self->query_env_mutex_ = NULL;
+
+        self->expander_ = NULL;
+
+        self->fork_generation_ = fork_generation;
+    }
+
+    return (PyObject*) self;
+}
+
+static int QueryExpander_init(QueryExpander* self, PyObject* args, PyObject* kwds) {
+    PyObject* query_env_obj = NULL;
+    self->fb_docs_ = 10;
+    self->fb_terms_ = 10;
+
+    static char* kwlist[] = {"query_env", "fb_docs", "fb_terms", NULL};
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|ll", kwlist,
+                                     state->query_environment_type, &query_env_obj,
+                                     &self->fb_docs_,
+                                     &self->fb_terms_)) {
+        return -1;
+    }
+
+    if (self->fb_docs_ <= 0) {
+        PyErr_SetString(PyExc_RuntimeError, "fb_docs should be positive.");
+        return NULL;
+    }
+
+    if (self->fb_terms_ <= 0) {
+        PyErr_SetString(PyExc_RuntimeError, "fb_terms should be positive.");
+        return NULL;
+    }
+
+    self->query_env_obj_ = query_env_obj;
+    Py_INCREF(self->query_env_obj_);
+
+    if (!QueryExpander_open(self)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* QueryExpander_expand(QueryExpander* self, PyObject* args, PyObject* kwds) {
+    PyObject* query_obj = NULL;
+
+    static char* kwlist[] = {"query_str",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "U", kwlist, &query_obj)) {
+        return NULL;
+    }
+
+    CHECK(PyUnicode_Check(query_obj));
+
+    PyObject* query_bytes_obj = PyUnicode_AsEncodedString(query_obj, ENCODING, "strict");
+    std::string query_str = PyBytes_AsString(query_bytes_obj);
+
+    Py_DECREF(query_bytes_obj);
+
+    // After a fork, the expander refers to an abandoned QueryEnvironment.
+    if (self->fork_generation_ != fork_generation && !QueryExpander_open(self)) {
+        return NULL;
+    }
+
+    bool failed = false;
+    std::string error;
+
+    string expanded_query_str;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    {
+        std::lock_guard<std::mutex> lock(*self->query_env_mutex_);
+
+        // Perform initial retrieval.
+        indri::api::QueryAnnotation* query_annotation = NULL;
+
+        try {
+            query_annotation = self->query_env_->runAnnotatedQuery(
+                query_str, self->fb_docs_);
+        } catch (const lemur::api::Exception& e) {
+            failed = true;
+            error = e.what();
+        }
+
+        if (!failed) {
+            std::vector<indri::api::ScoredExtentResult> query_results = query_annotation->getResults();
+
+            // Expand query.
+            expanded_query_str = self->expander_->expand(query_str, query_results);
+
+            // Clean up.
+            query_results.clear();
+
+            delete query_annotation;
+        }
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    return PyUnicode_Decode(expanded_query_str.c_str(),
+                            expanded_query_str.size(),
+                            ENCODING,
+                            "strict");
+}
+
+static PyMemberDef QueryExpander_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyMethodDef QueryExpander_methods[] = {
+    {"expand", (PyCFunction) LockedKeywords<QueryExpander, QueryExpander_expand>, METH_VARARGS | METH_KEYWORDS,
+     "Expands a query using RM3."},
+
+    {NULL}  /* Sentinel */
+};
+
+// IndexEnvironment
+
+typedef struct {
+    PyObject_HEAD
+
+    indri::api::IndexEnvironment* index_env_;
+
+    bool open_;
+} IndexEnvironment;
+
+static void IndexEnvironment_dealloc(IndexEnvironment* self) {
+    if (self->open_) {
+        try {
+            self->index_env_->close();
+        } catch (const lemur::api::Exception& e) {}
+
+        self->open_ = false;
+    }
+
+    delete self->index_env_;
+    self->index_env_ = NULL;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static PyObject* IndexEnvironment_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    IndexEnvironment* self;
+
+    self = (IndexEnvironment*) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->index_env_ = new indri::api::IndexEnvironment;
+        self->open_ = false;
+    }
+
+    return (PyObject*) self;
+}
+
+static int IndexEnvironment_init(IndexEnvironment* self, PyObject* args, PyObject* kwds) {
+    const char* repository_path = NULL;
+    unsigned long long memory = 0;
+    const char* stemmer = NULL;
+    int store_docs = 1;
+    int normalize = 1;
+    PyObject* fields_obj = NULL;
+
+    static char* kwlist[] = {"repository_path", "memory", "stemmer",
+                             "store_docs", "normalize", "fields",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|KzppO!", kwlist,
+                                     &repository_path,
+                                     &memory,
+                                     &stemmer,
+                                     &store_docs,
+                                     &normalize,
+                                     &PyTuple_Type, &fields_obj)) {
+        return -1;
+    }
+
+    if (self->open_) {
+        PyErr_SetString(PyExc_RuntimeError, "IndexEnvironment is already open.");
+
+        return -1;
+    }
+
+    std::vector<std::string> fields;
+
+    if (fields_obj != NULL) {
+        for (Py_ssize_t i = 0; i < PyTuple_Size(fields_obj); ++i) {
+            const char* const field = PyUnicode_AsUTF8(PyTuple_GetItem(fields_obj, i));
+
+            if (field == NULL) {
+                return -1;
+            }
+
+            fields.push_back(field);
+        }
+    }
+
+    std::vector<std::string> forward_metadata;
+    forward_metadata.push_back("docno");
+
+    std::vector<std::string> backward_metadata;
+    backward_metadata.push_back("docno");
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    try {
+        if (memory > 0) {
+            self->index_env_->setMemory(memory);
+        }
+
+        if (stemmer != NULL) {
+            self->index_env_->setStemmer(stemmer);
+        }
+
+        self->index_env_->setStoreDocs(store_docs);
+        self->index_env_->setNormalization(normalize);
+
+        if (!fields.empty()) {
+            self->index_env_->setIndexedFields(fields);
+        }
+
+        self->index_env_->setMetadataIndexedFields(forward_metadata, backward_metadata);
+
+        self->index_env_->create(repository_path);
+    } catch (const lemur::api::Exception& e) {
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return -1;
+    }
+
+    self->open_ = true;
+
+    return 0;
+}
+
+static bool IndexEnvironment_check_open(IndexEnvironment* self) {
+    if (!self->open_) {
+        PyErr_SetString(PyExc_RuntimeError, "IndexEnvironment has been closed.");
+
+        return false;
+    }
+
+    return true;
+}
+
+static PyObject* IndexEnvironment_add_file(IndexEnvironment* self, PyObject* args, PyObject* kwds) {
+    const char* file_path = NULL;
+    const char* file_class = NULL;
+
+    static char* kwlist[] = {"file_path", "file_class", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|z", kwlist,
+                                     &file_path,
+                                     &file_class)) {
+        return NULL;
+    }
+
+    if (!IndexEnvironment_check_open(self)) {
+        return NULL;
+    }
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    try {
+        if (file_class != NULL) {
+            self->index_env_->addFile(file_path, file_class);
+        } else {
+            self->index_env_->addFile(file_path);
+        }
+    } catch (const lemur::api::Exception& e) {
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* IndexEnvironment_add_document(IndexEnvironment* self, PyObject* args, PyObject* kwds) {
+    PyObject* ext_document_id_obj = NULL;
+    PyObject* text_obj = NULL;
+
+    static char* kwlist[] = {"ext_document_id", "text", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "UU", kwlist,
+                                     &ext_document_id_obj,
+                                     &text_obj)) {
+        return NULL;
+    }
+
+    if (!IndexEnvironment_check_open(self)) {
+        return NULL;
+    }
+
+    PyObject* ext_document_id_bytes = PyUnicode_AsEncodedString(ext_document_id_obj, ENCODING, "strict");
+
+    if (ext_document_id_bytes == NULL) {
+        return NULL;
+    }
+
+    PyObject* text_bytes = PyUnicode_AsEncodedString(text_obj, ENCODING, "strict");
+
+    if (text_bytes == NULL) {
+        Py_DECREF(ext_document_id_bytes);
+
+        return NULL;
+    }
+
+    const std::string ext_document_id(PyBytes_AsString(ext_document_id_bytes));
+
+    // The trectext file class only indexes text within its include tags.
+    std::string document_str;
+    document_str.reserve(PyBytes_Size(text_bytes) + 16);
+    document_str.append("<TEXT>\n");
+    document_str.append(PyBytes_AsString(text_bytes), PyBytes_Size(text_bytes));
+    document_str.append("\n</TEXT>");
+
+    Py_DECREF(ext_document_id_bytes);
+    Py_DECREF(text_bytes);
+
+    std::vector<indri::parse::MetadataPair> metadata(1);
+    metadata[0].key = "docno";
+    metadata[0].value = ext_document_id.c_str();
+    metadata[0].valueLength = ext_document_id.size() + 1;
+
+    lemur::api::DOCID_T int_document_id = 0;
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    try {
+        int_document_id = self->index_env_->addString(
+            document_str, "trectext", metadata);
+    } catch (const lemur::api::Exception& e) {
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    return PyLong_FromLong(int_document_id);
+}
+
+static PyObject* IndexEnvironment_documents_indexed(IndexEnvironment* self) {
+    if (!IndexEnvironment_check_open(self)) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(self->index_env_->documentsIndexed());
+}
+
+static PyObject* IndexEnvironment_close(IndexEnvironment* self) {
+    if (!IndexEnvironment_check_open(self)) {
+        return NULL;
+    }
+
+    bool failed = false;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    try {
+        self->index_env_->close();
+    } catch (const lemur::api::Exception& e) {
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    self->open_ = false;
+
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyMemberDef IndexEnvironment_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyMethodDef IndexEnvironment_methods[] = {
+    {"add_file", (PyCFunction) LockedKeywords<IndexEnvironment, IndexEnvironment_add_file>, METH_VARARGS | METH_KEYWORDS,
+     "Indexes all documents in a file."},
+    {"add_document", (PyCFunction) LockedKeywords<IndexEnvironment, IndexEnvironment_add_document>, METH_VARARGS | METH_KEYWORDS,
+     "Indexes a single document and returns its internal identifier."},
+    {"documents_indexed", (PyCFunction) LockedNoArgs<IndexEnvironment, IndexEnvironment_documents_indexed>, METH_NOARGS,
+     "Returns the number of documents indexed so far."},
+    {"close", (PyCFunction) LockedNoArgs<IndexEnvironment, IndexEnvironment_close>, METH_NOARGS,
+     "Flushes and closes the repository."},
+
+    {NULL}  /* Sentinel */
+};
+
+// Evaluation
+
+enum MeasureType {
+    MEASURE_MAP,
+    MEASURE_MRR,
+    MEASURE_NDCG,
+    MEASURE_PRECISION,
+    MEASURE_RECALL
+};
+
+// A retrieval effectiveness measure, optionally at a rank cut-off (0 denotes
+// the full ranking).
+struct Measure {
+    MeasureType type;
+    size_t cutoff;
+};
+
+// Parses names such as map, mrr@10, ndcg@20, p@5 or recall@1000. Precision and
+// recall require a cut-off. Returns false on failure.
+static bool ParseMeasure(const std::string& name, Measure* const measure) {
+    const size_t separator = name.find('@');
+    const std::string type = name.substr(0, separator);
+
+    measure->cutoff = 0;
+
+    if (separator != std::string::npos) {
+        const std::string cutoff = name.substr(separator + 1);
+
+        if (cutoff.empty() ||
+            cutoff.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+
+        measure->cutoff = std::stoul(cutoff);
+
+        if (measure->cutoff == 0) {
+            return false;
+        }
+    }
+
+    if (type == "map") {
+        measure->type = MEASURE_MAP;
+    } else if (type == "mrr") {
+        measure->type = MEASURE_MRR;
+    } else if (type == "ndcg") {
+        measure->type = MEASURE_NDCG;
+    } else if (type == "p") {
+        measure->type = MEASURE_PRECISION;
+    } else if (type == "recall") {
+        measure->type = MEASURE_RECALL;
+    } else {
+        return false;
+    }
+
+    return measure->cutoff > 0 ||
+        (measure->type != MEASURE_PRECISION && measure->type != MEASURE_RECALL);
+}
+
+// Relevance judgments of a single topic.
+struct TopicJudgments {
+    TopicJudgments() : num_relevant(0) {}
+
+    // Judged documents that occur in the index, sorted by identifier.
+    std::vector<std::pair<lemur::api::DOCID_T, int> > judgments;
+
+    // Number of relevant documents, including those not in the index.
+    size_t num_relevant;
+
+    // Positive relevance levels, including those of documents not in the
+    // index, in descending order; the gains of the ideal ranking.
+    std::vector<double> ideal_gains;
+
+    int relevance(const lemur::api::DOCID_T int_document_id) const {
+        std::vector<std::pair<lemur::api::DOCID_T, int> >::const_iterator it =
+            std::lower_bound(judgments.begin(), judgments.end(),
+                             std::make_pair(int_document_id, std::numeric_limits<int>::min()));
+
+        return (it != judgments.end() && it->first == int_document_id) ? it->second : 0;
+    }
+};
+
+// Computes measures over a ranking, in the given order, following the
+// definitions of trec_eval; documents are relevant if their relevance level
+// is at least relevance_threshold, and nDCG uses relevance levels as gains.
+static void EvaluateRanking(const TopicJudgments& topic,
+                            const int relevance_threshold,
+                            const std::vector<lemur::api::DOCID_T>& ranking,
+                            const std::vector<Measure>& measures,
+                            double* const values) {
+    std::vector<int> relevances(ranking.size());
+
+    for (size_t rank = 0; rank < ranking.size(); ++rank) {
+        relevances[rank] = topic.relevance(ranking[rank]);
+    }
+
+    for (size_t measure_idx = 0; measure_idx < measures.size(); ++measure_idx) {
+        const Measure& measure = measures[measure_idx];
+
+        const size_t depth = measure.cutoff > 0
+            ? std::min(measure.cutoff, ranking.size()) : ranking.size();
+
+        double value = 0.0;
+        size_t num_retrieved_relevant = 0;
+
+        if (measure.type == MEASURE_NDCG) {
+            double dcg = 0.0;
+            double ideal_dcg = 0.0;
+
+            for (size_t rank = 0; rank < depth; ++rank) {
+                if (relevances[rank] > 0) {
+                    dcg += relevances[rank] / std::log2(rank + 2.0);
+                }
+            }
+
+            const size_t ideal_depth = measure.cutoff > 0
+                ? std::min(measure.cutoff, topic.ideal_gains.size())
+                : topic.ideal_gains.size();
+
+            for (size_t rank = 0; rank < ideal_depth; ++rank) {
+                ideal_dcg += topic.ideal_gains[rank] / std::log2(rank + 2.0);
+            }
+
+            value = ideal_dcg > 0.0 ? dcg / ideal_dcg : 0.0;
+        } else {
+            for (size_t rank = 0; rank < depth; ++rank) {
+                if (relevances[rank] < relevance_threshold) {
+                    continue;
+                }
+
+                ++num_retrieved_relevant;
+
+                if (measure.type == MEASURE_MAP) {
+                    value += static_cast<double>(num_retrieved_relevant) / (rank + 1);
+                } else if (measure.type == MEASURE_MRR) {
+                    value = 1.0 / (rank + 1);
+
+                    break;
+                }
+            }
+
+            if (measure.type == MEASURE_MAP) {
+                value = topic.num_relevant > 0 ? value / topic.num_relevant : 0.0;
+            } else if (measure.type == MEASURE_PRECISION) {
+                value = static_cast<double>(num_retrieved_relevant) / measure.cutoff;
+            } else if (measure.type == MEASURE_RECALL) {
+                value = topic.num_relevant > 0
+                    ? static_cast<double>(num_retrieved_relevant) / topic.num_relevant
+                    : 0.0;
+            }
+        }
+
+        values[measure_idx] = value;
+    }
+}
+
+typedef struct {
+    PyObject_HEAD
+
+    // Topic identifiers and their judgments.
+    std::unordered_map<std::string, size_t>* topic_indices_;
+    std::vector<std::string>* topics_;
+    std::vector<TopicJudgments>* judgments_;
+
+    int relevance_threshold_;
+} Qrels;
+
+static void Qrels_dealloc(Qrels* self) {
+    delete self->topic_indices_;
+    delete self->topics_;
+    delete self->judgments_;
+
+    PyTypeObject* const type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+static PyObject* Qrels_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    Qrels* self;
+
+    self = (Qrels*) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->topic_indices_ = new std::unordered_map<std::string, size_t>;
+        self->topics_ = new std::vector<std::string>;
+        self->judgments_ = new std::vector<TopicJudgments>;
+
+        self->relevance_threshold_ = 1;
+    }
+
+    return (PyObject*) self;
+}
+
+// Returns str(obj) encoded as UTF-8. Returns false, with an exception set, on
+// failure.
+static bool GetTopicId(PyObject* obj, std::string* const topic_id) {
+    PyObject* const str = PyObject_Str(obj);
+
+    if (str == NULL) {
+        return false;
+    }
+
+    const char* const data = PyUnicode_AsUTF8(str);
+
+    if (data != NULL) {
+        *topic_id = data;
+    }
+
+    Py_DECREF(str);
+
+    return data != NULL;
+}
+
+// Judgments of a topic as (external document identifier, relevance) pairs.
+typedef std::vector<std::pair<std::string, long> > ExtJudgments;
+
+// Reads the judgments of a topic, given as a mapping from external document
+// identifiers to relevance levels. Returns false, with an exception set, on
+// failure.
+static bool GetTopicJudgments(PyObject* judgments_obj, ExtJudgments* const judgments) {
+    PyObject* const items = PyMapping_Items(judgments_obj);
+
+    if (items == NULL) {
+        return false;
+    }
+
+    judgments->reserve(PyList_GET_SIZE(items));
+
+    for (Py_ssize_t idx = 0; idx < PyList_GET_SIZE(items); ++idx) {
+        PyObject* const item = PyList_GET_ITEM(items, idx);
+
+        PyObject* const ext_document_id_bytes = PyUnicode_AsEncodedString(
+            PyTuple_GET_ITEM(item, 0), ENCODING, "strict");
+
+        if (ext_document_id_bytes == NULL) {
+            break;
+        }
+
+        const std::string ext_document_id = PyBytes_AsString(ext_document_id_bytes);
+        Py_DECREF(ext_document_id_bytes);
+
+        const long relevance = PyLong_AsLong(PyTuple_GET_ITEM(item, 1));
+
+        if (PyErr_Occurred()) {
+            break;
+        }
+
+        judgments->push_back(std::make_pair(ext_document_id, relevance));
+    }
+
+    Py_DECREF(items);
+
+    return !PyErr_Occurred();
+}
+
+// Resolves external document identifiers to internal ones with a single
+// metadata lookup; identifiers that are not in the index are left out.
+// Returns false, with an exception set, on failure.
+static bool Index_int_document_ids(
+        Index* self,
+        indri::api::QueryEnvironment* const query_env,
+        const std::vector<std::string>& ext_document_ids,
+        std::unordered_map<std::string, lemur::api::DOCID_T>* const int_document_ids) {
+    if (ext_document_ids.empty()) {
+        return true;
+    }
+
+    try {
+        const std::vector<lemur::api::DOCID_T> matches =
+            query_env->documentIDsFromMetadata("docno", ext_document_ids);
+
+        // The matches are not aligned with the requested identifiers, so map
+        // them back through their own external identifiers.
+        if (self->shared_tables_ != NULL) {
+            for (size_t idx = 0; idx < matches.size(); ++idx) {
+                const lemur::api::DOCID_T int_document_id = matches[idx];
+
+                const char* data;
+                size_t size;
+
+                self->shared_tables_->ext_document_id(int_document_id, &data, &size);
+
+                int_document_ids->insert(
+                    std::make_pair(std::string(data, size), int_document_id));
+            }
+        } else {
+            const std::vector<std::string> match_ext_document_ids =
+                query_env->documentMetadata(matches, "docno");
+
+            for (size_t idx = 0; idx < matches.size(); ++idx) {
+                int_document_ids->insert(
+                    std::make_pair(match_ext_document_ids[idx], matches[idx]));
+            }
+        }
+    } catch (const lemur::api::Exception& e) {
+        PyErr_SetString(PyExc_IOError, e.what().c_str());
+
+        return false;
+    }
+
+    return true;
+}
+
+// Adds the judgments of a topic, whose external document identifiers were
+// resolved beforehand; judged documents that are not in the index are
+// counted towards the ideal ranking only.
+static void Qrels_add_topic(
+        Qrels* self,
+        const std::string& topic_id,
+        const ExtJudgments& judgments,
+        const std::unordered_map<std::string, lemur::api::DOCID_T>& int_document_ids) {
+    TopicJudgments topic;
+
+    for (size_t idx = 0; idx < judgments.size(); ++idx) {
+        const std::pair<std::string, long>& judgment = judgments[idx];
+        const long relevance = judgment.second;
+
+        if (relevance >= self->relevance_threshold_) {
+            ++topic.num_relevant;
+        }
+
+        if (relevance > 0) {
+            topic.ideal_gains.push_back(relevance);
+        }
+
+        const std::unordered_map<std::string, lemur::api::DOCID_T>::const_iterator it =
+            int_document_ids.find(judgment.first);
+
+        if (it != int_document_ids.end()) {
+            topic.judgments.push_back(std::make_pair(it->second, relevance));
+        }
+    }
+
+    std::sort(topic.judgments.begin(), topic.judgments.end());
+    std::sort(topic.ideal_gains.begin(), topic.ideal_gains.end(), std::greater<double>());
+
+    (*self->topic_indices_)[topic_id] = self->topics_->size();
+    self->topics_->push_back(topic_id);
+    self->judgments_->push_back(topic);
+}
+
+static int Qrels_init(Qrels* self, PyObject* args, PyObject* kwds) {
+    PyObject* index_obj = NULL;
+    PyObject* qrels_obj = NULL;
+
+    static char* kwlist[] = {"index", "qrels", "relevance_threshold", NULL};
+
+    ModuleState* const state = GetModuleState(Py_TYPE(self));
+
+    if (state == NULL) {
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O|i", kwlist,
+                                     state->index_type, &index_obj,
+                                     &qrels_obj,
+                                     &self->relevance_threshold_)) {
+        return -1;
+    }
+
+    PyObject* const topics = PyMapping_Items(qrels_obj);
+
+    if (topics == NULL) {
+        return -1;
+    }
+
+    // Read all judgments first, such that the documents of every topic are
+    // resolved in one batch.
+    std::vector<std::pair<std::string, ExtJudgments> > topic_judgments(
+        PyList_GET_SIZE(topics));
+
+    for (Py_ssize_t idx = 0; idx < PyList_GET_SIZE(topics); ++idx) {
+        PyObject* const topic = PyList_GET_ITEM(topics, idx);
+
+        if (!GetTopicId(PyTuple_GET_ITEM(topic, 0), &topic_judgments[idx].first) ||
+            !GetTopicJudgments(PyTuple_GET_ITEM(topic, 1), &topic_judgments[idx].second)) {
+            break;
+        }
+    }
+
+    Py_DECREF(topics);
+
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+
+    std::vector<std::string> ext_document_ids;
+
+    for (size_t topic_idx = 0; topic_idx < topic_judgments.size(); ++topic_idx) {
+        const ExtJudgments& judgments = topic_judgments[topic_idx].second;
+
+        for (size_t idx = 0; idx < judgments.size(); ++idx) {
+            ext_document_ids.push_back(judgments[idx].first);
+        }
+    }
+
+    std::sort(ext_document_ids.begin(), ext_document_ids.end());
+    ext_document_ids.erase(std::unique(ext_document_ids.begin(), ext_document_ids.end()),
+                           ext_document_ids.end());
+
+    std::unordered_map<std::string, lemur::api::DOCID_T> int_document_ids;
+    bool resolved = false;
+
+    PYNDRI_BEGIN_CRITICAL_SECTION(index_obj);
+
+    indri::api::QueryEnvironment* const query_env = Index_query_env((Index*) index_obj);
+
+    resolved = query_env != NULL &&
+        Index_int_document_ids((Index*) index_obj, query_env,
+                               ext_document_ids, &int_document_ids);
+
+    PYNDRI_END_CRITICAL_SECTION();
+
+    if (!resolved) {
+        return -1;
+    }
+
+    self->topic_indices_->clear();
+    self->topics_->clear();
+    self->judgments_->clear();
+
+    for (size_t idx = 0; idx < topic_judgments.size(); ++idx) {
+        Qrels_add_topic(self, topic_judgments[idx].first, topic_judgments[idx].second,
+                        int_document_ids);
+    }
+
+    return 0;
+}
+
+// Appends the internal document identifiers of a ranking, which is either a
+// sequence of results (internal document identifiers, or tuples that start
+// with one, as returned by queries) or a (document_ids, scores) pair of
+// buffers (as returned by fuse). Returns false, with an exception set, on
+// failure.
+static bool GetRanking(PyObject* ranking_obj,
+                       std::vector<lemur::api::DOCID_T>* const ranking) {
+    if (PyTuple_Check(ranking_obj) && PyTuple_GET_SIZE(ranking_obj) == 2 &&
+        PyObject_CheckBuffer(PyTuple_GET_ITEM(ranking_obj, 0))) {
+        Py_buffer document_ids;
+
+        if (!GetInt32Buffer(PyTuple_GET_ITEM(ranking_obj, 0), false,
+                            "document_ids", &document_ids)) {
+            return false;
+        }
+
+        const INT32* const data = static_cast<const INT32*>(document_ids.buf);
+        ranking->assign(data, data + document_ids.len / sizeof(INT32));
+
+        PyBuffer_Release(&document_ids);
+
+        return true;
+    }
+
+    PyObject* const results = PySequence_Fast(ranking_obj, "Rankings should be iterable.");
+
+    if (results == NULL) {
+        return false;
+    }
+
+    for (Py_ssize_t idx = 0; idx < PySequence_Fast_GET_SIZE(results); ++idx) {
+        PyObject* const result = PySequence_Fast_GET_ITEM(results, idx);
+
+        PyObject* const int_document_id_obj = PyTuple_Check(result) && PyTuple_GET_SIZE(result) > 0
+            ? PyTuple_GET_ITEM(result, 0) : result;
+
+        const long int_document_id = PyLong_AsLong(int_document_id_obj);
+
+        if (PyErr_Occurred()) {
+            break;
+        }
+
+        ranking->push_back(int_document_id);
+    }
+
+    Py_DECREF(results);
+
+    return !PyErr_Occurred();
+}
+
+static PyObject* Qrels_evaluate(Qrels* self, PyObject* args, PyObject* kwds) {
+    PyObject* results_obj = NULL;
+    PyObject* measures_obj = NULL;
+    int per_topic = 0;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"results", "measures", "per_topic", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|pl", kwlist,
+                                     &results_obj, &measures_obj,
+                                     &per_topic, &num_threads)) {
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
+
+        return NULL;
+    }
+
+    PyObject* const measures_seq = PySequence_Fast(
+        measures_obj, "measures should be iterable.");
+
+    if (measures_seq == NULL) {
+        return NULL;
+    }
+
+    const Py_ssize_t num_measures = PySequence_Fast_GET_SIZE(measures_seq);
+
+    std::vector<Measure> measures(num_measures);
+
+    for (Py_ssize_t idx = 0; idx < num_measures; ++idx) {
+        PyObject* const name = PySequence_Fast_GET_ITEM(measures_seq, idx);
+
+        const char* const name_str = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+
+        if (name_str == NULL || !ParseMeasure(name_str, &measures[idx])) {
+            PyErr_Format(PyExc_ValueError,
+                         "Unknown measure %R; expected map, mrr, ndcg, p@k or recall@k, "
+                         "optionally at a cut-off (e.g., ndcg@10).", name);
+
+            Py_DECREF(measures_seq);
+
+            return NULL;
+        }
+    }
+
+    PyObject* const rankings_items = PyMapping_Items(results_obj);
+
+    if (rankings_items == NULL) {
+        Py_DECREF(measures_seq);
+
+        return NULL;
+    }
+
+    // Rankings of the topics that occur in the judgments.
+    std::vector<size_t> topics;
+    std::vector<std::vector<lemur::api::DOCID_T> > rankings;
+
+    for (Py_ssize_t idx = 0; idx < PyList_GET_SIZE(rankings_items); ++idx) {
+        PyObject* const item = PyList_GET_ITEM(rankings_items, idx);
+
+        std::string topic_id;
+
+        if (!GetTopicId(PyTuple_GET_ITEM(item, 0), &topic_id)) {
+            break;
+        }
+
+        std::unordered_map<std::string, size_t>::const_iterator it =
+            self->topic_indices_->find(topic_id);
+
+        if (it == self->topic_indices_->end()) {
+            continue;
+        }
+
+        topics.push_back(it->second);
+        rankings.push_back(std::vector<lemur::api::DOCID_T>());
+
+        if (!GetRanking(PyTuple_GET_ITEM(item, 1), &rankings.back())) {
+            break;
+        }
+    }
+
+    Py_DECREF(rankings_items);
+
+    if (PyErr_Occurred()) {
+        Py_DECREF(measures_seq);
+
+        return NULL;
+    }
+
+    // Row-major (topic, measure) matrix.
+    std::vector<double> values(topics.size() * num_measures);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    ParallelFor(num_threads, topics.size(), [&](const size_t idx) {
+        EvaluateRanking((*self->judgments_)[topics[idx]], self->relevance_threshold_,
+                        rankings[idx], measures, &values[idx * num_measures]);
+    });
+
+    Py_END_ALLOW_THREADS
+
+    // Means over the evaluated topics.
+    PyObject* const means = PyDict_New();
+    PyObject* const topic_values = per_topic ? PyDict_New() : NULL;
+
+    for (Py_ssize_t measure_idx = 0; measure_idx < num_measures; ++measure_idx) {
+        double sum = 0.0;
+
+        for (size_t idx = 0; idx < topics.size(); ++idx) {
+            sum += values[idx * num_measures + measure_idx];
+        }
+
+        PyObject* const mean = PyFloat_FromDouble(
+            topics.empty() ? 0.0 : sum / topics.size());
+
+        PyDict_SetItem(means, PySequence_Fast_GET_ITEM(measures_seq, measure_idx), mean);
+        Py_DECREF(mean);
+    }
+
+    for (size_t idx = 0; topic_values != NULL && idx < topics.size(); ++idx) {
+        PyObject* const topic_dict = PyDict_New();
+
+        for (Py_ssize_t measure_idx = 0; measure_idx < num_measures; ++measure_idx) {
+            PyObject* const value = PyFloat_FromDouble(values[idx * num_measures + measure_idx]);
+
+            PyDict_SetItem(topic_dict, PySequence_Fast_GET_ITEM(measures_seq, measure_idx), value);
+            Py_DECREF(value);
+        }
+
+        const std::string& topic_id = (*self->topics_)[topics[idx]];
+
+        PyDict_SetItemString(topic_values, topic_id.c_str(), topic_dict);
+        Py_DECREF(topic_dict);
+    }
+
+    Py_DECREF(measures_seq);
+
+    if (topic_values != NULL) {
+        return Py_BuildValue("(NN)", means, topic_values);
+    }
+
+    return means;
+}
+
+static PyObject* Qrels_topics(Qrels* self) {
+    PyObject* const topics = PyTuple_New(self->topics_->size());
+
+    for (size_t idx = 0; idx < self->topics_->size(); ++idx) {
+        PyTuple_SetItem(topics, idx, PyUnicode_FromString((*self->topics_)[idx].c_str()));
+    }
+
+    return topics;
+}
+
+static PyMemberDef Qrels_members[] = {
+    {"relevance_threshold", T_INT, offsetof(Qrels, relevance_threshold_), READONLY,
+     "minimum relevance level of relevant documents"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMethodDef Qrels_methods[] = {
+    {"evaluate", (PyCFunction) LockedKeywords<Qrels, Qrels_evaluate>, METH_VARARGS | METH_KEYWORDS,
+     "Evaluates rankings, given as a mapping from topic identifiers to results; "
+     "returns the mean of every measure over the judged topics."},
+    {"topics", (PyCFunction) LockedNoArgs<Qrels, Qrels_topics>, METH_NOARGS,
+     "Returns the judged topic identifiers."},
+
+    {NULL}  /* Sentinel */
+};
+
+// Rank fusion
+
+enum FusionMethod {
+    FUSION_COMBSUM,
+    FUSION_COMBMNZ,
+    FUSION_RRF
+};
+
+enum ScoreNormalization {
+    NORMALIZATION_NONE,
+    NORMALIZATION_MINMAX,
+    NORMALIZATION_SUM,
+    NORMALIZATION_ZMUV
+};
+
+// Normalizes the scores of a single ranking in place (Montague and Aslam,
+// 2001). Sum normalization shifts the minimum to zero before dividing by the
+// sum, as Indri scores are log-probabilities.
+static void NormalizeScores(const ScoreNormalization normalization,
+                            std::vector<double>* const scores) {
+    if (scores->empty() || normalization == NORMALIZATION_NONE) {
+        return;
+    }
+
+    const double minimum = *std::min_element(scores->begin(), scores->end());
+    const double maximum = *std::max_element(scores->begin(), scores->end());
+
+    if (normalization == NORMALIZATION_MINMAX) {
+        for (size_t i = 0; i < scores->size(); ++i) {
+            (*scores)[i] = maximum > minimum
+                ? ((*scores)[i] - minimum) / (maximum - minimum) : 1.0;
+        }
+    } else if (normalization == NORMALIZATION_SUM) {
+        double sum = 0.0;
+
+        for (size_t i = 0; i < scores->size(); ++i) {
+            sum += (*scores)[i] - minimum;
+        }
+
+        for (size_t i = 0; i < scores->size(); ++i) {
+            (*scores)[i] = sum > 0.0
+                ? ((*scores)[i] - minimum) / sum : 1.0 / scores->size();
+        }
+    } else if (normalization == NORMALIZATION_ZMUV) {
+        double mean = 0.0;
+
+        for (size_t i = 0; i < scores->size(); ++i) {
+            mean += (*scores)[i];
+        }
+
+        mean /= scores->size();
+
+        double variance = 0.0;
+
+        for (size_t i = 0; i < scores->size(); ++i) {
+            variance += ((*scores)[i] - mean) * ((*scores)[i] - mean);
+        }
+
+        const double deviation = std::sqrt(variance / scores->size());
+
+        for (size_t i = 0; i < scores->size(); ++i) {
+            (*scores)[i] = deviation > 0.0 ? ((*scores)[i] - mean) / deviation : 0.0;
+        }
+    }
+}
+
+// Fuses rankings, weighted by weights, into the results_requested
+// highest-scoring documents, ordered by descending score and ascending
+// identifier. Reciprocal rank fusion ignores the scores (and hence the
+// normalization) and uses 1 / (rrf_k + rank), where ranks start at 1.
+static void FuseRankings(
+        const std::vector<std::vector<indri::api::ScoredExtentResult> >& rankings,
+        const std::vector<double>& weights,
+        const FusionMethod method,
+        const ScoreNormalization normalization,
+        const double rrf_k,
+        const size_t results_requested,
+        std::vector<ScoredDocument>* const fused) {
+    // Fused score and number of rankings that contain the document.
+    std::unordered_map<lemur::api::DOCID_T, std::pair<double, size_t> > accumulators;
+
+    for (size_t ranking_idx = 0; ranking_idx < rankings.size(); ++ranking_idx) {
+        const std::vector<indri::api::ScoredExtentResult>& ranking = rankings[ranking_idx];
+
+        std::vector<double> scores(ranking.size());
+
+        for (size_t rank = 0; rank < ranking.size(); ++rank) {
+            scores[rank] = method == FUSION_RRF
+                ? 1.0 / (rrf_k + rank + 1) : ranking[rank].score;
+        }
+
+        if (method != FUSION_RRF) {
+            NormalizeScores(normalization, &scores);
+        }
+
+        for (size_t rank = 0; rank < ranking.size(); ++rank) {
+            std::pair<double, size_t>& accumulator = accumulators[ranking[rank].document];
+
+            accumulator.first += weights[ranking_idx] * scores[rank];
+            accumulator.second += 1;
+        }
+    }
+
+    fused->clear();
+    fused->reserve(accumulators.size());
+
+    for (std::unordered_map<lemur::api::DOCID_T, std::pair<double, size_t> >::const_iterator it =
+             accumulators.begin();
+         it != accumulators.end(); ++it) {
+        const double score = method == FUSION_COMBMNZ
+            ? it->second.first * it->second.second : it->second.first;
+
+        fused->push_back(ScoredDocument(score, it->first));
+    }
+
+    const size_t num_results = std::min(results_requested, fused->size());
+
+    std::partial_sort(fused->begin(), fused->begin() + num_results, fused->end(),
+                      CompareScoredDocuments);
+
+    fused->resize(num_results);
+}
+
+// Module methods.
+
+// Stemming
+
+// Indri stemmers keep state between calls, hence every thread uses its own.
+static std::string KrovetzStem(const std::string& term) {
+    static thread_local indri::parse::KrovetzStemmer stemmer;
+
+    std::vector<char> buffer(term.begin(), term.end());
+    buffer.push_back('\0');
+
+    return stemmer.kstem_stemmer(buffer.data());
+}
+
+static std::string PorterStem(const std::string& term) {
+    if (term.empty()) {
+        return term;
+    }
+
+    static thread_local indri::parse::Porter_Stemmer stemmer;
+
+    std::vector<char> buffer(term.begin(), term.end());
+    buffer.push_back('\0');
+
+    const int new_end = stemmer.porter_stem(buffer.data(), 0, term.length() - 1);
+
+    return std::string(buffer.data(), new_end + 1);
+}
+
+// Memo of stemmed terms across calls, shared by all threads. Terms are
+// spread over shards with their own lock, such that threads rarely contend.
+// Callers pass the capacity with every insertion; a shard is cleared entirely
+// once it holds its share of it, which keeps lookups cheap and bounds memory
+// use.
+class StemCache {
+ public:
+    static const size_t NUM_SHARDS = 16;
+
+    bool lookup(const std::string& term, std::string* const stemmed_term) {
+        Shard& shard = shards_[std::hash<std::string>()(term) % NUM_SHARDS];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        std::unordered_map<std::string, std::string>::const_iterator it =
+            shard.stems.find(term);
+
+        if (it == shard.stems.end()) {
+            return false;
+        }
+
+        *stemmed_term = it->second;
+
+        return true;
+    }
+
+    // Expects a positive capacity.
+    void insert(const std::string& term, const std::string& stemmed_term,
+                const size_t capacity) {
+        const size_t shard_capacity = std::max<size_t>(capacity / NUM_SHARDS, 1);
+
+        Shard& shard = shards_[std::hash<std::string>()(term) % NUM_SHARDS];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.stems.size() >= shard_capacity) {
+            shard.stems.clear();
+        }
+
+        shard.stems[term] = stemmed_term;
+    }
+
+ private:
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::string> stems;
+    };
+
+    Shard shards_[NUM_SHARDS];
+};
+
+static StemCache krovetz_stem_cache;
+static StemCache porter_stem_cache;
+
+static PyObject* StemTerm(PyObject* args, std::string (*stem)(const std::string&)) {
+    PyObject* term;
+
+    if (!PyArg_ParseTuple(args, "U", &term)) {
         return NULL;
     }
 
-    indri::collection::Repository* const repository =
-        &dynamic_cast<indri::server::LocalQueryServer*>(
-            self->query_env_->getServers()[0])->_repository;
+    CHECK(PyUnicode_Check(term));
 
-    const std::string processed_term =
-        repository->processTerm(term_object);
+    PyObject* term_bytes = PyUnicode_AsEncodedString(term, ENCODING, "strict");
 
-    return PyUnicode_Decode(processed_term.c_str(),
-                            processed_term.size(),
+    if (term_bytes == NULL) {
+        return NULL;
+    }
+
+    const std::string stemmed_term = stem(PyBytes_AsString(term_bytes));
+
+    Py_DECREF(term_bytes);
+
+    return PyUnicode_Decode(stemmed_term.c_str(),
+                            stemmed_term.size(),
                             ENCODING,
                             "strict");
 }
 
-static PyObject* Index_document_length(Index* self, PyObject* args) {
-    int int_document_id;
-
-    if (!PyArg_ParseTuple(args, "i", &int_document_id)) {
+// Stems a sequence of terms. Every distinct term is stemmed once, without the
+// GIL and optionally using multiple threads, and repeated terms share their
+// result object. If cache_size is positive, stems are also looked up in and
+// added to the cache, which then holds at most about cache_size terms.
+static PyObject* StemTerms(PyObject* args, PyObject* kwds,
+                           std::string (*stem)(const std::string&),
+                           StemCache* const cache) {
+    PyObject* terms_obj = NULL;
+    long num_threads = 1;
+    Py_ssize_t cache_size = 0;
+
+    static char* kwlist[] = {"terms", "num_threads", "cache_size", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ln", kwlist,
+                                     &terms_obj, &num_threads, &cache_size)) {
         return NULL;
     }
 
-    return PyLong_FromLong(self->index_->documentLength(int_document_id));
-}
-
-static PyObject* Index_get_dictionary(Index* self, PyObject* args) {
-    indri::index::VocabularyIterator* const vocabulary_it = self->index_->vocabularyIterator();
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
 
-    PyObject* const token2id = PyDict_New();
-    PyObject* const id2token = PyDict_New();
-    PyObject* const id2df = PyDict_New();
+        return NULL;
+    }
 
-    vocabulary_it->startIteration();
+    if (cache_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache_size should be non-negative.");
 
-    while (!vocabulary_it->finished()) {
-        indri::index::DiskTermData* const term_data = vocabulary_it->currentEntry();
+        return NULL;
+    }
 
-        const lemur::api::TERMID_T term_id = term_data->termID;
-        const string term = term_data->termData->term;
-
-        const unsigned int document_frequency = term_data->termData->corpus.documentCount;
-        CHECK_GT(document_frequency, 0);
-
-        PyDict_SetItemAndSteal(
-            token2id,
-            PyUnicode_Decode(term.c_str(),
-                             term.size(),
-                             ENCODING,
-                             "strict"),
-            PyLong_FromLong(term_id));
-
-        PyDict_SetItemAndSteal(
-            id2token,
-            PyLong_FromLong(term_id),
-            PyUnicode_Decode(term.c_str(),
-                             term.size(),
-                             ENCODING,
-                             "strict"));
-
-        PyDict_SetItemAndSteal(
-            id2df,
-            PyLong_FromLong(term_id),
-            PyLong_FromLong(document_frequency));
+    PyObject* const terms_seq = PySequence_Fast(terms_obj, "terms should be iterable.");
 
-        vocabulary_it->nextEntry();
+    if (terms_seq == NULL) {
+        return NULL;
     }
 
-    delete vocabulary_it;
+    const Py_ssize_t num_terms = PySequence_Fast_GET_SIZE(terms_seq);
 
-    CHECK_EQ(PyDict_Size(token2id), self->index_->uniqueTermCount());
-    CHECK_EQ(PyDict_Size(id2token), self->index_->uniqueTermCount());
-    CHECK_EQ(PyDict_Size(id2df), self->index_->uniqueTermCount());
+    // Positions of the terms within the distinct terms.
+    std::vector<size_t> positions(num_terms);
+    std::vector<std::string> distinct_terms;
 
-    PyObject* ret = PyTuple_Pack(3, token2id, id2token, id2df);
+    {
+        std::unordered_map<std::string, size_t> distinct_term_positions;
 
-    Py_DECREF(token2id);
-    Py_DECREF(id2token);
-    Py_DECREF(id2df);
+        for (Py_ssize_t i = 0; i < num_terms; ++i) {
+            PyObject* const term = PySequence_Fast_GET_ITEM(terms_seq, i);
 
-    return ret;
-}
+            if (!PyUnicode_Check(term)) {
+                Py_DECREF(terms_seq);
+                PyErr_SetString(PyExc_TypeError, "terms should be strings.");
 
-static PyObject* Index_get_term_frequencies(Index* self, PyObject* args) {
-    indri::index::VocabularyIterator* const vocabulary_it = self->index_->vocabularyIterator();
+                return NULL;
+            }
 
-    PyObject* const id2tf = PyDict_New();
+            PyObject* const term_bytes = PyUnicode_AsEncodedString(term, ENCODING, "strict");
 
-    vocabulary_it->startIteration();
+            if (term_bytes == NULL) {
+                Py_DECREF(terms_seq);
 
-    while (!vocabulary_it->finished()) {
-        indri::index::DiskTermData* const term_data = vocabulary_it->currentEntry();
+                return NULL;
+            }
 
-        const lemur::api::TERMID_T term_id = term_data->termID;
+            const std::string term_str(PyBytes_AS_STRING(term_bytes),
+                                       PyBytes_GET_SIZE(term_bytes));
 
-        const uint64_t term_frequency = term_data->termData->corpus.totalCount;
-        CHECK_GT(term_frequency, 0);
+            Py_DECREF(term_bytes);
 
-        PyDict_SetItemAndSteal(id2tf,
-                               PyLong_FromLong(term_id),
-                               PyLong_FromLong(term_frequency));
+            std::pair<std::unordered_map<std::string, size_t>::iterator, bool> it =
+                distinct_term_positions.insert(std::make_pair(term_str, distinct_terms.size()));
 
-        vocabulary_it->nextEntry();
+            if (it.second) {
+                distinct_terms.push_back(term_str);
+            }
+
+            positions[i] = it.first->second;
+        }
     }
 
-    delete vocabulary_it;
+    Py_DECREF(terms_seq);
 
-    CHECK_EQ(PyDict_Size(id2tf), self->index_->uniqueTermCount());
+    std::vector<std::string> stemmed_terms(distinct_terms.size());
 
-    return id2tf;
-}
+    Py_BEGIN_ALLOW_THREADS
 
-static PyMethodDef Index_methods[] = {
-    {"document_ids", (PyCFunction) Index_get_document_ids, METH_VARARGS,
-     "Returns the internal DOC_IDs given the external identifiers."},
-    {"document", (PyCFunction) Index_document, METH_VARARGS,
-     "Return a document (ext_document_id, terms) pair."},
-    {"ext_document_id", (PyCFunction) Index_ext_document_id, METH_VARARGS,
-     "Return a document external identifier pair."},
-    {"document_base", (PyCFunction) Index_document_base, METH_NOARGS,
-     "Returns the lower bound document identifier (inclusive)."},
-    {"maximum_document", (PyCFunction) Index_maximum_document, METH_NOARGS,
-     "Returns the upper bound document identifier (exclusive)."},
+    static const size_t TERMS_PER_TASK = 1024;
 
-    {"document_count", (PyCFunction) Index_document_count, METH_NOARGS,
-     "Returns the number of documents in the index."},
-    {"document_length", (PyCFunction) Index_document_length, METH_VARARGS,
-     "Returns the length of a document."},
+    ParallelFor(num_threads,
+                (distinct_terms.size() + TERMS_PER_TASK - 1) / TERMS_PER_TASK,
+                [&](const size_t task) {
+        const size_t end = std::min((task + 1) * TERMS_PER_TASK, distinct_terms.size());
 
-    {"total_terms", (PyCFunction) Index_total_terms, METH_NOARGS,
-     "Returns the number of total terms in the index."},
-    {"unique_terms", (PyCFunction) Index_unique_terms, METH_NOARGS,
-     "Returns the number of unique terms in the index."},
+        for (size_t i = task * TERMS_PER_TASK; i < end; ++i) {
+            if (cache_size == 0) {
+                stemmed_terms[i] = stem(distinct_terms[i]);
+            } else if (!cache->lookup(distinct_terms[i], &stemmed_terms[i])) {
+                stemmed_terms[i] = stem(distinct_terms[i]);
+                cache->insert(distinct_terms[i], stemmed_terms[i], cache_size);
+            }
+        }
+    });
 
-    {"term_count", (PyCFunction) Index_term_count, METH_VARARGS,
-     "Return the term frequency for a term."},
+    Py_END_ALLOW_THREADS
 
-    {"process_term", (PyCFunction) Index_process_term, METH_VARARGS,
-     "Pre-processes an index term."},
+    std::vector<PyObject*> stemmed_term_objs(stemmed_terms.size(), NULL);
 
-    {"get_dictionary", (PyCFunction) Index_get_dictionary, METH_NOARGS,
-     "Extracts the dictionary from the index."},
-    {"get_term_frequencies", (PyCFunction) Index_get_term_frequencies, METH_NOARGS,
-     "Extracts the term frequencies from the index."},
-    {NULL}  /* Sentinel */
-};
+    PyObject* result = PyList_New(num_terms);
 
-static PyMemberDef Index_members[] = {
-    {"path", T_STRING, offsetof(Index, repository_path_), READONLY, "path to repository"},
-    {NULL}  /* Sentinel */
-};
+    for (Py_ssize_t i = 0; result != NULL && i < num_terms; ++i) {
+        PyObject*& stemmed_term_obj = stemmed_term_objs[positions[i]];
 
-// QueryEnvironment
+        if (stemmed_term_obj == NULL) {
+            const std::string& stemmed_term = stemmed_terms[positions[i]];
 
-typedef struct {
-    PyObject_HEAD
+            stemmed_term_obj = PyUnicode_Decode(stemmed_term.c_str(),
+                                                stemmed_term.size(),
+                                                ENCODING,
+                                                "strict");
 
-    PyObject* index_;
-    indri::api::QueryEnvironment* query_env_;
-} QueryEnvironment;
+            if (stemmed_term_obj == NULL) {
+                Py_CLEAR(result);
+                break;
+            }
+        }
 
-static void QueryEnvironment_dealloc(QueryEnvironment* self) {
-    Py_DECREF(self->index_);
-    self->index_ = NULL;
+        Py_INCREF(stemmed_term_obj);
+        PyList_SET_ITEM(result, i, stemmed_term_obj);
+    }
 
-    self->query_env_->close();
+    for (size_t i = 0; i < stemmed_term_objs.size(); ++i) {
+        Py_XDECREF(stemmed_term_objs[i]);
+    }
 
-    // self->query_env_->close();
-    delete self->query_env_;
+    return result;
 }
 
-static PyObject* QueryEnvironment_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
-    QueryEnvironment* self;
+static PyObject* pyndri_krovetz_stem(PyObject* self, PyObject* args) {
+    return StemTerm(args, &KrovetzStem);
+}
 
-    self = (QueryEnvironment*) type->tp_alloc(type, 0);
-    if (self != NULL) {
-        self->index_ = NULL;
-        self->query_env_ = new indri::api::QueryEnvironment;
-    }
+static PyObject* pyndri_porter_stem(PyObject* self, PyObject* args) {
+    return StemTerm(args, &PorterStem);
+}
 
-    return (PyObject*) self;
+static PyObject* pyndri_krovetz_stem_batch(PyObject* self, PyObject* args, PyObject* kwds) {
+    return StemTerms(args, kwds, &KrovetzStem, &krovetz_stem_cache);
 }
 
-static int QueryEnvironment_init(QueryEnvironment* self, PyObject* args, PyObject* kwds) {
-    PyObject* index_obj = NULL;
-    PyObject* rules_obj = NULL;
-    PyObject* baseline_obj = NULL;
+static PyObject* pyndri_porter_stem_batch(PyObject* self, PyObject* args, PyObject* kwds) {
+    return StemTerms(args, kwds, &PorterStem, &porter_stem_cache);
+}
 
-    static char* kwlist[] = {"index", "rules", "baseline",
-                             NULL};
+static PyObject* pyndri_tokenize(PyObject* self, PyObject* args) {
+    PyObject* input;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O!O!", kwlist,
-                                     &IndexType, &index_obj,
-                                     &PyTuple_Type, &rules_obj,
-                                     &PyUnicode_Type, &baseline_obj)) {
-        return -1;
+    if (!PyArg_ParseTuple(args, "U", &input)) {
+        return NULL;
     }
 
-    self->index_ = index_obj;
-    Py_INCREF(self->index_);
+    PyObject* input_bytes = PyUnicode_AsEncodedString(input, ENCODING, "strict");
+    char* input_str = PyBytes_AsString(input_bytes);
 
-    PyObject* repostitory_path_obj = PyObject_GetAttrString(
-        self->index_, "path");
-    CHECK_NOTNULL(repostitory_path_obj);
+    std::vector<std::string> tokens;
+    std::string error;
 
-    try {
-        self->query_env_->addIndex(PyUnicode_AsUTF8(repostitory_path_obj));
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+    const bool parsed = ExtractQueryTerms(input_str, &tokens, &error);
 
-        return -1;
+    Py_DECREF(input_bytes);
+
+    if (!parsed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
+
+        return NULL;
     }
 
-    Py_DECREF(repostitory_path_obj);
+    PyObject* const tokens_tuple = PyTuple_New(tokens.size());
 
-    if (rules_obj != NULL && baseline_obj != NULL) {
-        PyErr_SetString(PyExc_RuntimeError, "Unable to specify smoothing rules for baseline.");
+    if (tokens_tuple == NULL) {
+        return NULL;
+    }
 
-        return -1;
-    } else if (rules_obj != NULL) {
-        std::vector<std::string> rules;
+    // Repeated tokens share a single string (borrowed from tokens_tuple).
+    std::unordered_map<std::string, PyObject*> token_objs;
 
-        for (Py_ssize_t i = 0; i < PyTuple_Size(rules_obj); ++i) {
-            rules.push_back(PyUnicode_AsUTF8(PyTuple_GetItem(rules_obj, i)));
+    for (size_t idx = 0; idx < tokens.size(); ++idx) {
+        PyObject*& token_obj = token_objs[tokens[idx]];
+
+        if (token_obj == NULL) {
+            token_obj = PyUnicode_Decode(tokens[idx].c_str(),
+                                         tokens[idx].size(),
+                                         ENCODING,
+                                         "strict");
+
+            if (token_obj == NULL) {
+                Py_DECREF(tokens_tuple);
+
+                return NULL;
+            }
+        } else {
+            Py_INCREF(token_obj);
         }
 
-        self->query_env_->setScoringRules(rules);
-    } else if (baseline_obj != NULL) {
-        const std::string baseline = PyUnicode_AsUTF8(baseline_obj);
-        self->query_env_->setBaseline(baseline);
+        PyTuple_SET_ITEM(tokens_tuple, idx, token_obj);
     }
 
-    return 0;
+    return tokens_tuple;
 }
 
-static PyObject* QueryEnvironment_run_query(QueryEnvironment* self, PyObject* args, PyObject* kwds) {
-    PyObject* query = NULL;
-    PyObject* document_set = NULL;
-    long results_requested = 0;
-    bool include_snippets = false;
-
-    static char* kwlist[] = {"query_str",
-                             "document_set",
-                             "results_requested",
-                             "include_snippets",
-                             NULL};
+static PyObject* pyndri_merge_repositories(PyObject* self, PyObject* args) {
+    const char* repository_path = NULL;
+    PyObject* input_paths_obj = NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "U|Olb", kwlist,
-                                     &query,
-                                     &document_set,
-                                     &results_requested,
-                                     &include_snippets)) {
+    if (!PyArg_ParseTuple(args, "sO", &repository_path, &input_paths_obj)) {
         return NULL;
     }
 
-    CHECK(PyUnicode_Check(query));
-
-    PyObject* query_bytes = PyUnicode_AsEncodedString(query, ENCODING, "strict");
-    char* query_str = PyBytes_AsString(query_bytes);
-
-    std::vector<lemur::api::DOCID_T> document_ids;
+    PyObject* const iterator = PyObject_GetIter(input_paths_obj);
 
-    if (document_set != NULL) {
-        CHECK(PyIter_Check(document_set));
+    if (iterator == NULL) {
+        return NULL;
+    }
 
-        PyObject* const iterator = PyObject_GetIter(document_set);
-        PyObject *item;
+    std::vector<std::string> input_paths;
+    PyObject* item;
 
-        if (iterator == NULL) {
-            PyErr_SetString(
-                PyExc_TypeError,
-                "Passed object for document_set not iterable.");
+    while ((item = PyIter_Next(iterator)) != NULL) {
+        const char* const input_path = PyUnicode_AsUTF8(item);
 
+        if (input_path == NULL) {
+            Py_DECREF(item);
             Py_DECREF(iterator);
-            Py_DECREF(query_bytes);
 
             return NULL;
         }
 
-        while (item = PyIter_Next(iterator)) {
-            CHECK(PyLong_CheckExact(item));
-
-            const lemur::api::DOCID_T int_doc_id = PyLong_AsLong(item);
-            if (int_doc_id < 0) {
-                continue;
-            }
+        input_paths.push_back(input_path);
 
-            document_ids.push_back(int_doc_id);
+        Py_DECREF(item);
+    }
 
-            Py_DECREF(item);
-        }
+    Py_DECREF(iterator);
 
-        Py_DECREF(iterator);
+    if (PyErr_Occurred()) {
+        return NULL;
     }
 
-    if (results_requested <= 0) {
-        if (document_set != NULL) {
-            results_requested = document_ids.size();
-        } else {
-            results_requested = 100;
-        }
+    if (input_paths.empty()) {
+        PyErr_SetString(PyExc_ValueError, "No repositories to merge.");
+
+        return NULL;
     }
 
-    CHECK_GE(results_requested, 0);
+    bool failed = false;
+    std::string error;
 
-    indri::api::QueryAnnotation* query_annotation;
+    Py_BEGIN_ALLOW_THREADS
 
     try {
-        if (document_ids.empty()) {
-            query_annotation = self->query_env_->runAnnotatedQuery(
-                query_str, results_requested);
-        } else{
-            query_annotation = self->query_env_->runAnnotatedQuery(
-                query_str, document_ids, results_requested);
-        }
+        indri::collection::Repository::merge(repository_path, input_paths);
     } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+        failed = true;
+        error = e.what();
+    }
+
+    Py_END_ALLOW_THREADS
 
-        Py_DECREF(query_bytes);
+    if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
 
         return NULL;
     }
 
-    Py_DECREF(query_bytes);
+    Py_RETURN_NONE;
+}
+
+static PyObject* pyndri_cosine_similarity(PyObject* self, PyObject* args, PyObject* kwds) {
+    PyObject* vectors_obj = NULL;
+    PyObject* queries_obj = NULL;
+    long num_threads = 1;
+
+    static char* kwlist[] = {"vectors", "queries", "num_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|l", kwlist,
+                                     &vectors_obj, &queries_obj, &num_threads)) {
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads should be positive.");
+
+        return NULL;
+    }
+
+    Py_buffer vectors;
+    size_t num_vectors, vectors_dimensionality;
+
+    if (!GetFloat32Matrix(vectors_obj, "vectors", &vectors,
+                          &num_vectors, &vectors_dimensionality)) {
+        return NULL;
+    }
+
+    Py_buffer queries;
+    size_t num_queries, queries_dimensionality;
+
+    if (!GetFloat32Matrix(queries_obj, "queries", &queries,
+                          &num_queries, &queries_dimensionality)) {
+        PyBuffer_Release(&vectors);
+
+        return NULL;
+    }
+
+    if (vectors_dimensionality != queries_dimensionality) {
+        PyBuffer_Release(&vectors);
+        PyBuffer_Release(&queries);
+
+        PyErr_SetString(PyExc_ValueError,
+                        "vectors and queries should have the same dimensionality.");
+
+        return NULL;
+    }
+
+    std::vector<float> similarities(num_queries * num_vectors);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    ComputeCosineSimilarities(static_cast<const float*>(vectors.buf), num_vectors,
+                              static_cast<const float*>(queries.buf), num_queries,
+                              vectors_dimensionality, num_threads,
+                              similarities.data());
+
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&vectors);
+    PyBuffer_Release(&queries);
+
+    return BufferToMemoryView(
+        similarities.data(), similarities.size() * sizeof(float), "f");
+}
+
+static PyObject* pyndri_fuse(PyObject* self, PyObject* args, PyObject* kwds) {
+    PyObject* query_envs_obj = NULL;
+    PyObject* queries_obj = NULL;
+    const char* method_name = "combsum";
+    const char* normalization_name = "minmax";
+    PyObject* weights_obj = Py_None;
+    long depth = 1000;
+    long results_requested = 1000;
+    PyObject* document_set = Py_None;
+    double rrf_k = 60.0;
+
+    static char* kwlist[] = {"query_envs", "queries", "method", "normalization",
+                             "weights", "depth", "results_requested",
+                             "document_set", "rrf_k", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|ssOllOd", kwlist,
+                                     &query_envs_obj, &queries_obj,
+                                     &method_name, &normalization_name,
+                                     &weights_obj, &depth, &results_requested,
+                                     &document_set, &rrf_k)) {
+        return NULL;
+    }
 
-    std::vector<indri::api::ScoredExtentResult> query_results =
-        query_annotation->getResults();
+    FusionMethod method;
 
-    std::vector<indri::api::ScoredExtentResult>::const_iterator it = query_results.begin();
+    if (strcmp(method_name, "combsum") == 0) {
+        method = FUSION_COMBSUM;
+    } else if (strcmp(method_name, "combmnz") == 0) {
+        method = FUSION_COMBMNZ;
+    } else if (strcmp(method_name, "rrf") == 0) {
+        method = FUSION_RRF;
+    } else {
+        PyErr_SetString(PyExc_ValueError,
+                        "method should be one of combsum, combmnz or rrf.");
 
-    std::vector<string> snippets;
+        return NULL;
+    }
 
-    if (include_snippets) {
-        indri::api::SnippetBuilder builder(false /* html */);
+    ScoreNormalization normalization;
 
-        std::vector<lemur::api::DOCID_T> documentIDs(query_results.size(), 0);
+    if (strcmp(normalization_name, "none") == 0) {
+        normalization = NORMALIZATION_NONE;
+    } else if (strcmp(normalization_name, "minmax") == 0) {
+        normalization = NORMALIZATION_MINMAX;
+    } else if (strcmp(normalization_name, "sum") == 0) {
+        normalization = NORMALIZATION_SUM;
+    } else if (strcmp(normalization_name, "zmuv") == 0) {
+        normalization = NORMALIZATION_ZMUV;
+    } else {
+        PyErr_SetString(PyExc_ValueError,
+                        "normalization should be one of none, minmax, sum or zmuv.");
 
-        for (size_t i = 0; i < query_results.size(); ++i) {
-            documentIDs[i] = query_results[i].document;
-        }
+        return NULL;
+    }
 
-        try {
-            const std::vector<indri::api::ParsedDocument*> documents =
-                self->query_env_->documents(documentIDs);
+    if (depth <= 0 || results_requested <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "depth and results_requested should be positive.");
 
-            for (size_t i = 0; i < query_results.size(); ++i) {
-                snippets.push_back(
-                    builder.build(documentIDs[i], documents[i], query_annotation));
+        return NULL;
+    } else if (rrf_k < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "rrf_k should be non-negative.");
 
-                delete documents[i];
-            }
-        } catch (const lemur::api::Exception& e) {}
+        return NULL;
     }
 
-    delete query_annotation;
+    ModuleState* const state = (ModuleState*) PyModule_GetState(self);
 
-    if (include_snippets && snippets.empty()) {
-        PyErr_SetString(PyExc_IOError,
-                        "Unable to retrieve snippets. "
-                        "Make sure storeDocs is enabled "
-                        "in your Indri configuration.");
+    PyObject* const query_envs_seq = PySequence_Fast(
+        query_envs_obj, "query_envs should be iterable.");
 
+    if (query_envs_seq == NULL) {
         return NULL;
     }
 
-    PyObject* results = PyTuple_New(query_results.size());
+    // Strong references, as the sequence may be modified by other threads.
+    std::vector<QueryEnvironment*> query_envs;
 
-    Py_ssize_t pos = 0;
-    for (; it != query_results.end(); ++it, ++pos) {
-        PyObject* const result = PyTuple_New(include_snippets ? 3 : 2);
+    for (Py_ssize_t idx = 0; idx < PySequence_Fast_GET_SIZE(query_envs_seq); ++idx) {
+        PyObject* const item = PySequence_Fast_GET_ITEM(query_envs_seq, idx);
 
-        PyTuple_SetItem(result, 0, PyLong_FromLong(it->document));
-        PyTuple_SetItem(result, 1, PyFloat_FromDouble(it->score));
+        if (!PyObject_TypeCheck(item, state->query_environment_type)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "query_envs should hold QueryEnvironment objects.");
 
-        if (include_snippets) {
-            PyTuple_SetItem(result, 2, PyUnicode_Decode(snippets[pos].c_str(),
-                                                        snippets[pos].size(),
-                                                        ENCODING,
-                                                        "strict"));
+            break;
         }
 
-       PyTuple_SetItem(results, pos, result);
+        Py_INCREF(item);
+        query_envs.push_back((QueryEnvironment*) item);
     }
 
-    query_results.clear();
+    Py_DECREF(query_envs_seq);
 
-    return results;
-}
+    const size_t num_envs = query_envs.size();
 
-static PyObject* QueryEnvironment_internal_obj(QueryEnvironment* self, void*) {
-    return PyCapsule_New(self->query_env_, "indri::api::QueryEnvironment", NULL);
-}
+    std::vector<QueryRequest> requests(num_envs);
+    std::vector<double> weights(num_envs, 1.0);
 
-static PyMemberDef QueryEnvironment_members[] = {
-    {NULL}  /* Sentinel */
-};
+    // Indri QueryEnvironments of query_envs and their locks.
+    std::vector<indri::api::QueryEnvironment*> indri_query_envs(num_envs, NULL);
+    std::vector<std::mutex*> query_env_mutexes(num_envs, NULL);
 
-static PyMethodDef QueryEnvironment_methods[] = {
-    {"query", (PyCFunction) QueryEnvironment_run_query, METH_VARARGS | METH_KEYWORDS,
-     "Queries an Indri index."},
+    if (!PyErr_Occurred() && num_envs == 0) {
+        PyErr_SetString(PyExc_ValueError, "query_envs should not be empty.");
+    }
 
-    {NULL}  /* Sentinel */
-};
+    if (!PyErr_Occurred() && weights_obj != Py_None) {
+        PyObject* const weights_seq = PySequence_Fast(
+            weights_obj, "weights should be iterable.");
+
+        if (weights_seq != NULL) {
+            if (static_cast<size_t>(PySequence_Fast_GET_SIZE(weights_seq)) != num_envs) {
+                PyErr_SetString(PyExc_ValueError,
+                                "weights and query_envs should have the same length.");
+            } else {
+                for (size_t idx = 0; idx < num_envs && !PyErr_Occurred(); ++idx) {
+                    weights[idx] = PyFloat_AsDouble(
+                        PySequence_Fast_GET_ITEM(weights_seq, idx));
+                }
+            }
 
-static PyGetSetDef QueryEnvironment_getset[] = {
-    {"_internal_obj", (getter) QueryEnvironment_internal_obj, NULL, NULL, NULL},
+            Py_DECREF(weights_seq);
+        }
+    }
 
-    {NULL}  /* Sentinel */
-};
+    // A single query string is used for all environments.
+    PyObject* queries_seq = NULL;
 
-// QueryExpander
+    if (!PyErr_Occurred()) {
+        if (PyUnicode_Check(queries_obj)) {
+            queries_seq = PyTuple_New(num_envs);
 
-typedef struct {
-    PyObject_HEAD
+            for (size_t idx = 0; idx < num_envs; ++idx) {
+                Py_INCREF(queries_obj);
+                PyTuple_SET_ITEM(queries_seq, idx, queries_obj);
+            }
+        } else {
+            queries_seq = PySequence_Fast(queries_obj, "queries should be a str or iterable.");
 
-    PyObject* query_env_obj_;
+            if (queries_seq != NULL &&
+                static_cast<size_t>(PySequence_Fast_GET_SIZE(queries_seq)) != num_envs) {
+                PyErr_SetString(PyExc_ValueError,
+                                "queries and query_envs should have the same length.");
+            }
+        }
+    }
 
-    indri::api::QueryEnvironment* query_env_;  // Owned by query_env_obj_.
-    indri::query::RMExpander* expander_;
+    for (size_t idx = 0; idx < num_envs && !PyErr_Occurred(); ++idx) {
+        PyObject* const query = PySequence_Fast_GET_ITEM(queries_seq, idx);
 
-    long fb_docs_;
-} QueryExpander;
+        if (!PyUnicode_Check(query)) {
+            PyErr_SetString(PyExc_TypeError, "queries should hold str objects.");
 
-static void QueryExpander_dealloc(QueryExpander* self) {
-    Py_DECREF(self->query_env_obj_);
-    self->query_env_obj_ = NULL;
+            break;
+        }
 
-    if (self->expander_ != NULL) {
-        delete self->expander_;
-        self->expander_ = NULL;
-    }
-}
+        // The document set is only consumed once, as it may be an iterator.
+        if (!BuildQueryRequest(query, idx == 0 ? document_set : NULL,
+                               depth, false, &requests[idx])) {
+            break;
+        }
 
-static PyObject* QueryExpander_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
-    QueryExpander* self;
+        requests[idx].document_ids = requests[0].document_ids;
 
-    self = (QueryExpander*) type->tp_alloc(type, 0);
-    if (self != NULL) {
-        self->query_env_obj_ = NULL;
+        QueryEnvironment* const query_env = query_envs[idx];
 
-        self->query_env_ = NULL;
-        self->expander_ = NULL;
-    }
+        bool reopened;
 
-    return (PyObject*) self;
-}
+        PYNDRI_BEGIN_CRITICAL_SECTION(query_env);
 
-static int QueryExpander_init(QueryExpander* self, PyObject* args, PyObject* kwds) {
-    PyObject* query_env_obj = NULL;
-    self->fb_docs_ = 10;
-    long fb_terms = 10;
+        reopened = QueryEnvironment_reopen(query_env);
 
-    static char* kwlist[] = {"query_env", "fb_docs", "fb_terms", NULL};
+        requests[idx].priors = query_env->config_->priors;
+        requests[idx].prior_weight = query_env->config_->prior_weight;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|ll", kwlist,
-                                     &QueryEnvironmentType, &query_env_obj,
-                                     &self->fb_docs_,
-                                     &fb_terms)) {
-        return -1;
-    }
+        indri_query_envs[idx] = query_env->query_env_;
+        query_env_mutexes[idx] = query_env->query_env_mutex_;
 
-    if (self->fb_docs_ <= 0) {
-        PyErr_SetString(PyExc_RuntimeError, "fb_docs should be positive.");
-        return NULL;
-    }
+        PYNDRI_END_CRITICAL_SECTION();
 
-    if (fb_terms <= 0) {
-        PyErr_SetString(PyExc_RuntimeError, "fb_terms should be positive.");
-        return NULL;
+        if (!reopened) {
+            break;
+        }
     }
 
-    indri::api::Parameters rm_parameters;
-    rm_parameters.set("fbDocs", static_cast<int>(self->fb_docs_));
-    rm_parameters.set("fbTerms", static_cast<int>(fb_terms));
+    Py_XDECREF(queries_seq);
 
-    self->query_env_obj_ = query_env_obj;
-    Py_INCREF(self->query_env_obj_);
+    std::vector<QueryResponse> responses(num_envs);
+    std::vector<ScoredDocument> fused;
 
-    // We use a PyCapsule to retrieve the internal pointer and immediately destroy the PyCapsule afterwards.
-    // However, the pointer is owned by the QueryEnvironment
+    bool failed = false;
+    std::string error;
 
-    // Retrieve internal pointer.
-    PyObject* internal_query_env_obj_capsule = PyObject_GetAttrString(
-        self->query_env_obj_, "_internal_obj");
+    if (!PyErr_Occurred()) {
+        Py_BEGIN_ALLOW_THREADS
 
-    self->query_env_ = (indri::api::QueryEnvironment*) PyCapsule_GetPointer(
-        internal_query_env_obj_capsule, "indri::api::QueryEnvironment");
-    CHECK_NOTNULL(self->query_env_);
+        ParallelFor(num_envs, num_envs, [&](const size_t idx) {
+            std::lock_guard<std::mutex> lock(*query_env_mutexes[idx]);
+            ExecuteQuery(indri_query_envs[idx], requests[idx], NULL, &responses[idx]);
+        });
 
-    self->expander_ = new indri::query::RMExpander(self->query_env_, rm_parameters);
+        std::vector<std::vector<indri::api::ScoredExtentResult> > rankings(num_envs);
 
-    // Deallocate.
-    Py_DECREF(self->query_env_obj_);
+        for (size_t idx = 0; idx < num_envs; ++idx) {
+            if (responses[idx].failed) {
+                failed = true;
+                error = responses[idx].error;
 
-    return 0;
-}
+                break;
+            }
 
-static PyObject* QueryExpander_expand(QueryExpander* self, PyObject* args, PyObject* kwds) {
-    PyObject* query_obj = NULL;
+            rankings[idx].swap(responses[idx].results);
+        }
 
-    static char* kwlist[] = {"query_str",
-                             NULL};
+        if (!failed) {
+            FuseRankings(rankings, weights, method, normalization, rrf_k,
+                         results_requested, &fused);
+        }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "U", kwlist, &query_obj)) {
-        return NULL;
+        Py_END_ALLOW_THREADS
     }
 
-    CHECK(PyUnicode_Check(query_obj));
+    for (size_t idx = 0; idx < num_envs; ++idx) {
+        Py_DECREF(query_envs[idx]);
+    }
 
-    PyObject* query_bytes_obj = PyUnicode_AsEncodedString(query_obj, ENCODING, "strict");
-    std::string query_str = PyBytes_AsString(query_bytes_obj);
+    if (PyErr_Occurred()) {
+        return NULL;
+    } else if (failed) {
+        PyErr_SetString(PyExc_IOError, error.c_str());
 
-    // Perform initial retrieval.
-    indri::api::QueryAnnotation* query_annotation;
+        return NULL;
+    }
 
-    try {
-        query_annotation = self->query_env_->runAnnotatedQuery(
-            query_str, self->fb_docs_);
-    } catch (const lemur::api::Exception& e) {
-        PyErr_SetString(PyExc_IOError, e.what().c_str());
+    std::vector<INT32> document_ids(fused.size());
+    std::vector<double> scores(fused.size());
+
+    for (size_t idx = 0; idx < fused.size(); ++idx) {
+        document_ids[idx] = fused[idx].second;
+        scores[idx] = fused[idx].first;
+    }
 
-        Py_DECREF(query_bytes_obj);
+    PyObject* const document_ids_view = BufferToMemoryView(
+        document_ids.data(), document_ids.size() * sizeof(INT32), "i");
+    PyObject* const scores_view = BufferToMemoryView(
+        scores.data(), scores.size() * sizeof(double), "d");
+
+    if (document_ids_view == NULL || scores_view == NULL) {
+        Py_XDECREF(document_ids_view);
+        Py_XDECREF(scores_view);
 
         return NULL;
     }
 
-    std::vector<indri::api::ScoredExtentResult> query_results = query_annotation->getResults();
+    return Py_BuildValue("(NN)", document_ids_view, scores_view);
+}
 
-    // Expand query.
-    const string expanded_query_str = self->expander_->expand(query_str, query_results);
+static PyMethodDef PyndriMethods[] = {
+    {"krovetz_stem", (PyCFunction) pyndri_krovetz_stem, METH_VARARGS,
+     "Return the Krovetz stemmed version of a term."},
+    {"porter_stem", (PyCFunction) pyndri_porter_stem, METH_VARARGS,
+     "Return the Porter stemmed version of a term."},
+    {"krovetz_stem_batch", (PyCFunction) pyndri_krovetz_stem_batch, METH_VARARGS | METH_KEYWORDS,
+     "Return the Krovetz stemmed versions of a sequence of terms."},
+    {"porter_stem_batch", (PyCFunction) pyndri_porter_stem_batch, METH_VARARGS | METH_KEYWORDS,
+     "Return the Porter stemmed versions of a sequence of terms."},
+    {"tokenize", (PyCFunction) pyndri_tokenize, METH_VARARGS,
+     "Tokenize an input string."},
+    {"merge_repositories", (PyCFunction) pyndri_merge_repositories, METH_VARARGS,
+     "Merges Indri repositories into a new repository."},
+    {"cosine_similarity", (PyCFunction) pyndri_cosine_similarity, METH_VARARGS | METH_KEYWORDS,
+     "Returns the cosine similarities between query and vector matrices as a "
+     "flat row-major float32 (num_queries, num_vectors) matrix."},
+    {"fuse", (PyCFunction) pyndri_fuse, METH_VARARGS | METH_KEYWORDS,
+     "Runs queries against multiple QueryEnvironments concurrently and fuses "
+     "the rankings; returns (document_ids, scores)."},
+    {NULL, NULL, 0, NULL}
+};
 
-    // Clean up.
-    query_results.clear();
+static PyType_Slot Index_slots[] = {
+    {Py_tp_dealloc, (void*) Index_dealloc},
+    {Py_tp_doc, (void*) "Index objects"},
+    {Py_tp_methods, Index_methods},
+    {Py_tp_members, Index_members},
+    {Py_tp_init, (void*) Index_init},
+    {Py_tp_new, (void*) Index_new},
+    {0, NULL}
+};
 
-    Py_DECREF(query_bytes_obj);
-    delete query_annotation;
+static PyType_Spec Index_spec = {
+    "pyndri.Index",
+    sizeof(Index),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    Index_slots,
+};
 
-    return PyUnicode_Decode(expanded_query_str.c_str(),
-                            expanded_query_str.size(),
-                            ENCODING,
-                            "strict");
-}
+static PyType_Slot QueryEnvironment_slots[] = {
+    {Py_tp_dealloc, (void*) QueryEnvironment_dealloc},
+    {Py_tp_doc, (void*) "QueryEnvironment objects"},
+    {Py_tp_methods, QueryEnvironment_methods},
+    {Py_tp_members, QueryEnvironment_members},
+    {Py_tp_getset, QueryEnvironment_getset},
+    {Py_tp_init, (void*) QueryEnvironment_init},
+    {Py_tp_new, (void*) QueryEnvironment_new},
+    {0, NULL}
+};
 
-static PyMemberDef QueryExpander_members[] = {
-    {NULL}  /* Sentinel */
+static PyType_Spec QueryEnvironment_spec = {
+    "pyndri.QueryEnvironment",
+    sizeof(QueryEnvironment),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    QueryEnvironment_slots,
 };
 
-static PyMethodDef QueryExpander_methods[] = {
-    {"expand", (PyCFunction) QueryExpander_expand, METH_VARARGS | METH_KEYWORDS,
-     "Expands a query using RM3."},
+static PyType_Slot QueryExpander_slots[] = {
+    {Py_tp_dealloc, (void*) QueryExpander_dealloc},
+    {Py_tp_doc, (void*) "QueryExpander objects"},
+    {Py_tp_methods, QueryExpander_methods},
+    {Py_tp_members, QueryExpander_members},
+    {Py_tp_init, (void*) QueryExpander_init},
+    {Py_tp_new, (void*) QueryExpander_new},
+    {0, NULL}
+};
 
-    {NULL}  /* Sentinel */
+static PyType_Spec QueryExpander_spec = {
+    "pyndri.QueryExpander",
+    sizeof(QueryExpander),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    QueryExpander_slots,
 };
 
-// Module methods.
+static PyType_Slot IndexEnvironment_slots[] = {
+    {Py_tp_dealloc, (void*) IndexEnvironment_dealloc},
+    {Py_tp_doc, (void*) "IndexEnvironment objects"},
+    {Py_tp_methods, IndexEnvironment_methods},
+    {Py_tp_members, IndexEnvironment_members},
+    {Py_tp_init, (void*) IndexEnvironment_init},
+    {Py_tp_new, (void*) IndexEnvironment_new},
+    {0, NULL}
+};
 
-static PyObject* pyndri_krovetz_stem(PyObject* self, PyObject* args) {
-    PyObject* term;
+static PyType_Spec IndexEnvironment_spec = {
+    "pyndri.IndexEnvironment",
+    sizeof(IndexEnvironment),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    IndexEnvironment_slots,
+};
 
-    if (!PyArg_ParseTuple(args, "U", &term)) {
-        return NULL;
-    }
+static PyType_Slot CancellationToken_slots[] = {
+    {Py_tp_dealloc, (void*) CancellationToken_dealloc},
+    {Py_tp_doc, (void*) "CancellationToken objects"},
+    {Py_tp_methods, CancellationToken_methods},
+    {Py_tp_members, CancellationToken_members},
+    {Py_tp_getset, CancellationToken_getset},
+    {Py_tp_new, (void*) CancellationToken_new},
+    {0, NULL}
+};
 
-    CHECK(PyUnicode_Check(term));
+static PyType_Spec CancellationToken_spec = {
+    "pyndri.CancellationToken",
+    sizeof(CancellationToken),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    CancellationToken_slots,
+};
 
-    PyObject* term_bytes = PyUnicode_AsEncodedString(term, ENCODING, "strict");
+static PyType_Slot SharedBuffer_slots[] = {
+    {Py_tp_dealloc, (void*) SharedBuffer_dealloc},
+    {Py_tp_doc, (void*) "SharedBuffer objects"},
+    {Py_bf_getbuffer, (void*) SharedBuffer_getbuffer},
+    {0, NULL}
+};
 
-    if (term_bytes == NULL) {
-        return NULL;
-    }
+static PyType_Spec SharedBuffer_spec = {
+    "pyndri.SharedBuffer",
+    sizeof(SharedBuffer),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    SharedBuffer_slots,
+};
 
-    char* term_str = PyBytes_AsString(term_bytes);
+static PyType_Slot DocumentIterator_slots[] = {
+    {Py_tp_dealloc, (void*) DocumentIterator_dealloc},
+    {Py_tp_doc, (void*) "DocumentIterator objects"},
+    {Py_tp_iter, (void*) PyObject_SelfIter},
+    {Py_tp_iternext, (void*) LockedIterNext<DocumentIterator, DocumentIterator_next>},
+    {0, NULL}
+};
 
-    static indri::parse::KrovetzStemmer stemmer;
-    std::string stemmed_term(stemmer.kstem_stemmer(term_str));
+static PyType_Spec DocumentIterator_spec = {
+    "pyndri.DocumentIterator",
+    sizeof(DocumentIterator),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    DocumentIterator_slots,
+};
 
-    Py_DECREF(term_bytes);
+static PyType_Slot TermSampler_slots[] = {
+    {Py_tp_dealloc, (void*) TermSampler_dealloc},
+    {Py_tp_doc, (void*) "TermSampler objects"},
+    {Py_tp_methods, TermSampler_methods},
+    {Py_tp_members, TermSampler_members},
+    {Py_tp_init, (void*) TermSampler_init},
+    {Py_tp_new, (void*) TermSampler_new},
+    {0, NULL}
+};
 
-    PyObject* result = PyUnicode_Decode(stemmed_term.c_str(),
-                                        stemmed_term.size(),
-                                        ENCODING,
-                                        "strict");
+static PyType_Spec TermSampler_spec = {
+    "pyndri.TermSampler",
+    sizeof(TermSampler),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    TermSampler_slots,
+};
 
-    // Canonical; to indicate that result can be NULL.
-    if (result == NULL) {
-        return NULL;
-    }
+static PyType_Slot Qrels_slots[] = {
+    {Py_tp_dealloc, (void*) Qrels_dealloc},
+    {Py_tp_doc, (void*) "Qrels objects"},
+    {Py_tp_methods, Qrels_methods},
+    {Py_tp_members, Qrels_members},
+    {Py_tp_init, (void*) Qrels_init},
+    {Py_tp_new, (void*) Qrels_new},
+    {0, NULL}
+};
 
-    return result;
-}
+static PyType_Spec Qrels_spec = {
+    "pyndri.Qrels",
+    sizeof(Qrels),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    Qrels_slots,
+};
 
-static PyObject* pyndri_porter_stem(PyObject* self, PyObject* args) {
-    PyObject* term;
+// Creates the type defined by spec and, if expose is set, adds it to the
+// module. Returns a new reference, or NULL with an exception set.
+static PyTypeObject* CreateType(PyObject* module, PyType_Spec* spec, const bool expose) {
+    PyTypeObject* const type = (PyTypeObject*) PyType_FromModuleAndSpec(module, spec, NULL);
 
-    if (!PyArg_ParseTuple(args, "U", &term)) {
+    if (type == NULL) {
         return NULL;
     }
 
-    CHECK(PyUnicode_Check(term));
+#if PY_VERSION_HEX < 0x030A0000
+    // Internal types are only instantiated from C++; see
+    // Py_TPFLAGS_DISALLOW_INSTANTIATION.
+    if (!expose) {
+        type->tp_new = NULL;
+    }
+#endif
 
-    PyObject* term_bytes = PyUnicode_AsEncodedString(term, ENCODING, "strict");
+    if (expose && PyModule_AddType(module, type) < 0) {
+        Py_DECREF(type);
 
-    if (term_bytes == NULL) {
         return NULL;
     }
 
-    std::string term_str(PyBytes_AsString(term_bytes)); // Takes a copy.
-    Py_DECREF(term_bytes);
+    return type;
+}
 
-    char* const stemmed_term = new char[term_str.length() + 1];
-    term_str.copy(stemmed_term, term_str.length());
-    stemmed_term[term_str.length()] = '\0';
+static int PyndriModule_exec(PyObject* module) {
+    ModuleState* const state = (ModuleState*) PyModule_GetState(module);
 
-    static indri::parse::Porter_Stemmer stemmer;
-    const int new_end = stemmer.porter_stem(stemmed_term, 0, term_str.length() - 1);
+    state->index_type = CreateType(module, &Index_spec, true);
 
-    PyObject* result = PyUnicode_Decode(stemmed_term,
-                                        new_end + 1,
-                                        ENCODING,
-                                        "strict");
+    if (state->index_type == NULL) {
+        return -1;
+    }
 
-    delete [] stemmed_term;
+    state->query_environment_type = CreateType(module, &QueryEnvironment_spec, true);
 
-    // Canonical; to indicate that result can be NULL.
-    if (result == NULL) {
-        return NULL;
+    if (state->query_environment_type == NULL) {
+        return -1;
     }
 
-    return result;
-}
+    state->query_expander_type = CreateType(module, &QueryExpander_spec, true);
 
-class TokenExtractor : public indri::lang::Walker {
- public:
-    explicit TokenExtractor(std::vector<std::string>* const tokens) : tokens_(tokens) {
-        tokens_->clear();
+    if (state->query_expander_type == NULL) {
+        return -1;
     }
 
-    virtual void defaultBefore(indri::lang::Node* node) {}
+    state->index_environment_type = CreateType(module, &IndexEnvironment_spec, true);
 
-    virtual void after(indri::lang::IndexTerm* node) {
-        tokens_->push_back(node->getText());
+    if (state->index_environment_type == NULL) {
+        return -1;
     }
 
- private:
-    std::vector<std::string>* const tokens_;
-};
+    state->cancellation_token_type = CreateType(module, &CancellationToken_spec, true);
 
-static PyObject* pyndri_tokenize(PyObject* self, PyObject* args) {
-    PyObject* input;
+    if (state->cancellation_token_type == NULL) {
+        return -1;
+    }
 
-    if (!PyArg_ParseTuple(args, "U", &input)) {
-        return NULL;
+    state->document_iterator_type = CreateType(module, &DocumentIterator_spec, false);
+
+    if (state->document_iterator_type == NULL) {
+        return -1;
     }
 
-    PyObject* input_bytes = PyUnicode_AsEncodedString(input, ENCODING, "strict");
-    char* input_str = PyBytes_AsString(input_bytes);
+    state->shared_buffer_type = CreateType(module, &SharedBuffer_spec, false);
 
-    indri::api::QueryParserWrapper* const parser = indri::api::QueryParserFactory::get(input_str, "indri");
+    if (state->shared_buffer_type == NULL) {
+        return -1;
+    }
 
-    indri::lang::ScoredExtentNode* root_node = NULL;
+    state->term_sampler_type = CreateType(module, &TermSampler_spec, true);
 
-    try {
-        root_node = parser->query();
-    } catch (const antlr::NoViableAltException& e) {
-        PyErr_SetString(PyExc_IOError, e.getMessage().c_str());
-    } catch (const antlr::MismatchedTokenException& e) {
-        PyErr_SetString(PyExc_IOError, e.getMessage().c_str());
-    } catch (const antlr::TokenStreamRecognitionException& e) {
-        PyErr_SetString(PyExc_IOError, e.getMessage().c_str());
+    if (state->term_sampler_type == NULL) {
+        return -1;
     }
 
-    Py_DECREF(input_bytes);
+    state->qrels_type = CreateType(module, &Qrels_spec, true);
 
-    if (root_node == NULL) {
-        return NULL;
+    if (state->qrels_type == NULL) {
+        return -1;
     }
 
-    std::vector<std::string> tokens;
+    return 0;
+}
 
-    TokenExtractor extractor(&tokens);
-    root_node->walk(extractor);
+static int PyndriModule_traverse(PyObject* module, visitproc visit, void* arg) {
+    ModuleState* const state = (ModuleState*) PyModule_GetState(module);
 
-    PyObject* const tokens_tuple = PyTuple_New(tokens.size());
+    Py_VISIT(state->index_type);
+    Py_VISIT(state->query_environment_type);
+    Py_VISIT(state->query_expander_type);
+    Py_VISIT(state->index_environment_type);
+    Py_VISIT(state->cancellation_token_type);
+    Py_VISIT(state->document_iterator_type);
+    Py_VISIT(state->shared_buffer_type);
+    Py_VISIT(state->term_sampler_type);
+    Py_VISIT(state->qrels_type);
 
-    for (size_t idx = 0; idx < tokens.size(); ++idx) {
-        PyTuple_SetItem(tokens_tuple, idx, PyUnicode_Decode(tokens[idx].c_str(),
-                                                            tokens[idx].size(),
-                                                            ENCODING,
-                                                            "strict"));
-    }
+    return 0;
+}
 
-    return tokens_tuple;
+static int PyndriModule_clear(PyObject* module) {
+    ModuleState* const state = (ModuleState*) PyModule_GetState(module);
+
+    Py_CLEAR(state->index_type);
+    Py_CLEAR(state->query_environment_type);
+    Py_CLEAR(state->query_expander_type);
+    Py_CLEAR(state->index_environment_type);
+    Py_CLEAR(state->cancellation_token_type);
+    Py_CLEAR(state->document_iterator_type);
+    Py_CLEAR(state->shared_buffer_type);
+    Py_CLEAR(state->term_sampler_type);
+    Py_CLEAR(state->qrels_type);
+
+    return 0;
 }
 
-static PyMethodDef PyndriMethods[] = {
-    {"krovetz_stem", (PyCFunction) pyndri_krovetz_stem, METH_VARARGS,
-     "Return the Krovetz stemmed version of a term."},
-    {"porter_stem", (PyCFunction) pyndri_porter_stem, METH_VARARGS,
-     "Return the Porter stemmed version of a term."},
-    {"tokenize", (PyCFunction) pyndri_tokenize, METH_VARARGS,
-     "Tokenize an input string."},
-    {NULL, NULL, 0, NULL}
+static void PyndriModule_free(void* module) {
+    PyndriModule_clear((PyObject*) module);
+}
+
+static PyModuleDef_Slot PyndriModule_slots[] = {
+    {Py_mod_exec, (void*) PyndriModule_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
 };
 
 static PyModuleDef PyndriModule = {
     PyModuleDef_HEAD_INIT,
     "pyndri_ext",
     "Python interface to the Indri search engine.",
-    -1,
+    sizeof(ModuleState),
     PyndriMethods,
-    NULL, NULL, NULL, NULL
+    PyndriModule_slots,
+    PyndriModule_traverse,
+    PyndriModule_clear,
+    PyndriModule_free,
 };
 
-PyMODINIT_FUNC PyInit_pyndri_ext(void) {
-    IndexType = {
-        PyVarObject_HEAD_INIT(NULL, 0)
-        "pyndri.Index",             /* tp_name */
-        sizeof(Index),             /* tp_basicsize */
-        0,                         /* tp_itemsize */
-        (destructor) Index_dealloc, /* tp_dealloc */
-        0,                         /* tp_print */
-        0,                         /* tp_getattr */
-        0,                         /* tp_setattr */
-        0,                         /* tp_reserved */
-        0,                         /* tp_repr */
-        0,                         /* tp_as_number */
-        0,                         /* tp_as_sequence */
-        0,                         /* tp_as_mapping */
-        0,                         /* tp_hash */
-        0,                         /* tp_call */
-        0,                         /* tp_str */
-        0,                         /* tp_getattro */
-        0,                         /* tp_setattro */
-        0,                         /* tp_as_buffer */
-        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-        "Index objects",           /* tp_doc */
-        0,                   /* tp_traverse */
-        0,                   /* tp_clear */
-        0,                   /* tp_richcompare */
-        0,                   /* tp_weaklistoffset */
-        0,                   /* tp_iter */
-        0,                   /* tp_iternext */
-        Index_methods,             /* tp_methods */
-        Index_members,             /* tp_members */
-        0,                         /* tp_getset */
-        0,                         /* tp_base */
-        0,                         /* tp_dict */
-        0,                         /* tp_descr_get */
-        0,                         /* tp_descr_set */
-        0,                         /* tp_dictoffset */
-        (initproc) Index_init,     /* tp_init */
-        0,                         /* tp_alloc */
-        Index_new,                 /* tp_new */
-    };
+static ModuleState* GetModuleState(PyTypeObject* type) {
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject* const module = PyType_GetModuleByDef(type, &PyndriModule);
+#else
+    PyObject* module = NULL;
 
-    if (PyType_Ready(&IndexType) < 0) {
-        return NULL;
-    }
-
-    QueryEnvironmentType = {
-        PyVarObject_HEAD_INIT(NULL, 0)
-        "pyndri.QueryEnvironment",             /* tp_name */
-        sizeof(QueryEnvironment),             /* tp_basicsize */
-        0,                         /* tp_itemsize */
-        (destructor) QueryEnvironment_dealloc, /* tp_dealloc */
-        0,                         /* tp_print */
-        0,                         /* tp_getattr */
-        0,                         /* tp_setattr */
-        0,                         /* tp_reserved */
-        0,                         /* tp_repr */
-        0,                         /* tp_as_number */
-        0,                         /* tp_as_sequence */
-        0,                         /* tp_as_mapping */
-        0,                         /* tp_hash */
-        0,                         /* tp_call */
-        0,                         /* tp_str */
-        0,                         /* tp_getattro */
-        0,                         /* tp_setattro */
-        0,                         /* tp_as_buffer */
-        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-        "QueryEnvironment objects",           /* tp_doc */
-        0,                   /* tp_traverse */
-        0,                   /* tp_clear */
-        0,                   /* tp_richcompare */
-        0,                   /* tp_weaklistoffset */
-        0,                   /* tp_iter */
-        0,                   /* tp_iternext */
-        QueryEnvironment_methods,             /* tp_methods */
-        QueryEnvironment_members,             /* tp_members */
-        QueryEnvironment_getset,              /* tp_getset */
-        0,                         /* tp_base */
-        0,                         /* tp_dict */
-        0,                         /* tp_descr_get */
-        0,                         /* tp_descr_set */
-        0,                         /* tp_dictoffset */
-        (initproc) QueryEnvironment_init,      /* tp_init */
-        0,                         /* tp_alloc */
-        QueryEnvironment_new,                 /* tp_new */
-    };
+    PyObject* const mro = type->tp_mro;
 
-    if (PyType_Ready(&QueryEnvironmentType) < 0) {
-        return NULL;
-    }
-
-    QueryExpanderType = {
-        PyVarObject_HEAD_INIT(NULL, 0)
-        "pyndri.QueryExpander",             /* tp_name */
-        sizeof(QueryExpander),             /* tp_basicsize */
-        0,                         /* tp_itemsize */
-        (destructor) QueryExpander_dealloc, /* tp_dealloc */
-        0,                         /* tp_print */
-        0,                         /* tp_getattr */
-        0,                         /* tp_setattr */
-        0,                         /* tp_reserved */
-        0,                         /* tp_repr */
-        0,                         /* tp_as_number */
-        0,                         /* tp_as_sequence */
-        0,                         /* tp_as_mapping */
-        0,                         /* tp_hash */
-        0,                         /* tp_call */
-        0,                         /* tp_str */
-        0,                         /* tp_getattro */
-        0,                         /* tp_setattro */
-        0,                         /* tp_as_buffer */
-        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-        "QueryExpander objects",           /* tp_doc */
-        0,                   /* tp_traverse */
-        0,                   /* tp_clear */
-        0,                   /* tp_richcompare */
-        0,                   /* tp_weaklistoffset */
-        0,                   /* tp_iter */
-        0,                   /* tp_iternext */
-        QueryExpander_methods,             /* tp_methods */
-        QueryExpander_members,             /* tp_members */
-        0,                         /* tp_getset */
-        0,                         /* tp_base */
-        0,                         /* tp_dict */
-        0,                         /* tp_descr_get */
-        0,                         /* tp_descr_set */
-        0,                         /* tp_dictoffset */
-        (initproc) QueryExpander_init,      /* tp_init */
-        0,                         /* tp_alloc */
-        QueryExpander_new,                 /* tp_new */
-    };
+    for (Py_ssize_t idx = 0; module == NULL && idx < PyTuple_GET_SIZE(mro); ++idx) {
+        PyTypeObject* const base = (PyTypeObject*) PyTuple_GET_ITEM(mro, idx);
 
-    if (PyType_Ready(&QueryExpanderType) < 0) {
-        return NULL;
+        if (!(base->tp_flags & Py_TPFLAGS_HEAPTYPE)) {
+            continue;
+        }
+
+        PyObject* const candidate = PyType_GetModule(base);
+
+        if (candidate == NULL) {
+            PyErr_Clear();
+        } else if (PyModule_GetDef(candidate) == &PyndriModule) {
+            module = candidate;
+        }
     }
 
-    PyObject* const module = PyModule_Create(&PyndriModule);
+    if (module == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s is not a pyndri type.", type->tp_name);
+    }
+#endif
 
     if (module == NULL) {
         return NULL;
     }
 
-    Py_INCREF(&IndexType);
-    PyModule_AddObject(module, "Index", (PyObject*) &IndexType);
+    return (ModuleState*) PyModule_GetState(module);
+}
 
-    Py_INCREF(&QueryEnvironmentType);
-    PyModule_AddObject(module, "QueryEnvironment", (PyObject*) &QueryEnvironmentType);
+// The fork handler is shared by all interpreters that import the module.
+static std::once_flag fork_handler_registered;
 
-    Py_INCREF(&QueryExpanderType);
-    PyModule_AddObject(module, "QueryExpander", (PyObject*) &QueryExpanderType);
+PyMODINIT_FUNC PyInit_pyndri_ext(void) {
+    std::call_once(fork_handler_registered, []() {
+        pthread_atfork(NULL, NULL, &IncrementForkGeneration);
+    });
 
-    return module;
+    return PyModuleDef_Init(&PyndriModule);
 }
@@ -1,4 +1,9 @@
+import array
+import asyncio
+import collections
+import concurrent.futures
 import gc
+import math
 import operator
 import os
 import shutil
@@ -37,6 +42,30 @@ class ParsingTest(PyndriTest):
         self.assertEqual(pyndri.porter_stem('marketing'), 'market')
         self.assertEqual(pyndri.porter_stem('strategies'), 'strategi')
 
+    def test_stemming_batch(self):
+        terms = ['predictions', 'marketing', 'strategies'] * 1000
+
+        self.assertEqual(
+            pyndri.krovetz_stem_batch(terms),
+            [pyndri.krovetz_stem(term) for term in terms])
+        self.assertEqual(
+            pyndri.porter_stem_batch(tuple(terms), num_threads=4),
+            [pyndri.porter_stem(term) for term in terms])
+
+        for cache_size in (2, 2, 0, 1000):
+            self.assertEqual(
+                pyndri.krovetz_stem_batch(
+                    iter(terms[:3]), num_threads=2, cache_size=cache_size),
+                ['prediction', 'marketing', 'strategy'])
+
+        with self.assertRaises(ValueError):
+            pyndri.porter_stem_batch(terms, cache_size=-1)
+
+        self.assertEqual(pyndri.porter_stem_batch([]), [])
+
+        with self.assertRaises(TypeError):
+            pyndri.krovetz_stem_batch([b'bytes'])
+
     def test_escape(self):
         self.assertEqual(pyndri.escape('hello (world)'),
                          'hello world')
@@ -49,6 +78,9 @@ class ParsingTest(PyndriTest):
         self.assertEqual(pyndri.tokenize('hello world foo bar'),
                          ('hello', 'world', 'foo', 'bar'))
 
+        tokens = pyndri.tokenize('hello world hello')
+        self.assertIs(tokens[0], tokens[2])
+
         self.assertEqual(pyndri.tokenize('hello-world'),
                          ('hello', 'world'))
 
@@ -69,7 +101,47 @@ class ParsingTest(PyndriTest):
                          ('hello', 'world',))
 
 
-class IndriTest(PyndriTest):
+class IndexTest(PyndriTest):
+    """Builds an index of CORPUS using INDRI_CONFIG for every test."""
+
+    CORPUS = None
+    INDRI_CONFIG = None
+
+    def setUp(self):
+        super(IndexTest, self).setUp()
+
+        self.test_dir = tempfile.mkdtemp()
+
+        with open(os.path.join(self.test_dir,
+                               'corpus.trectext'),
+                  'w', encoding='latin1') as f:
+            f.write(self.CORPUS)
+
+        with open(os.path.join(self.test_dir,
+                               'IndriBuildIndex.conf'), 'w') as f:
+            f.write(self.INDRI_CONFIG)
+
+        with open(os.devnull, "w") as f:
+            ret = subprocess.call(['IndriBuildIndex', 'IndriBuildIndex.conf'],
+                                  stdout=f,
+                                  cwd=self.test_dir)
+
+        self.assertEqual(ret, 0)
+
+        self.index_path = os.path.join(self.test_dir, 'index')
+        self.assertTrue(os.path.exists(self.index_path))
+
+        self.index = pyndri.Index(self.index_path)
+
+    def tearDown(self):
+        shutil.rmtree(self.test_dir)
+        del self.index
+        self.index = None
+
+        super(IndexTest, self).tearDown()
+
+
+class IndriTest(IndexTest):
 
     CORPUS = """<DOC>
 <DOCNO>lorem</DOCNO>
@@ -99,32 +171,6 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
 <stemmer><name>krovetz</name></stemmer>
 </parameters>"""
 
-    def setUp(self):
-        super(IndriTest, self).setUp()
-
-        self.test_dir = tempfile.mkdtemp()
-
-        with open(os.path.join(self.test_dir,
-                               'corpus.trectext'),
-                  'w', encoding='latin1') as f:
-            f.write(self.CORPUS)
-
-        with open(os.path.join(self.test_dir,
-                               'IndriBuildIndex.conf'), 'w') as f:
-            f.write(self.INDRI_CONFIG)
-
-        with open(os.devnull, "w") as f:
-            ret = subprocess.call(['IndriBuildIndex', 'IndriBuildIndex.conf'],
-                                  stdout=f,
-                                  cwd=self.test_dir)
-
-        self.assertEqual(ret, 0)
-
-        self.index_path = os.path.join(self.test_dir, 'index')
-        self.assertTrue(os.path.exists(self.index_path))
-
-        self.index = pyndri.Index(self.index_path)
-
     def test_1empty(self):
         pass  # Empty test to verify reference counting.
 
@@ -132,6 +178,21 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
         with pyndri.open(self.index_path) as index:
             self.assertTrue(isinstance(index, pyndri.Index))
 
+    def test_lazy_open(self):
+        repository_path = os.path.join(self.test_dir, 'lazy')
+        shutil.copytree(self.index_path, repository_path)
+
+        # Components are only opened when used.
+        shutil.rmtree(os.path.join(repository_path, 'collection'))
+
+        with pyndri.open(repository_path) as index:
+            self.assertEqual(index.document_length(3), 573)
+            self.assertEqual(index.get_dictionary(),
+                             self.index.get_dictionary())
+
+            with self.assertRaises(IOError):
+                index.ext_document_id(1)
+
     def test_repr(self):
         self.assertEqual(
             repr(self.index),
@@ -185,6 +246,45 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
               'Lorem IPSUM dolor sit amet, consectetur '
               'adipiscing\nelit. Duis...'),))
 
+    def test_query_extents(self):
+        self.assertEqual(
+            self.index.query('ipsum', include_extents=True),
+            ((1, -6.373564749941117, 0, 88),))
+
+        ((int_doc_id, _, snippet, begin, end),) = self.index.query(
+            '#combine[passage10:5](ipsum)',
+            include_snippets=True, include_extents=True)
+
+        self.assertEqual(int_doc_id, 1)
+        self.assertLess(begin, end)
+        self.assertLessEqual(end - begin, 10)
+
+    def test_passages(self):
+        _, first_tokens = self.index.document(1)
+        _, second_tokens = self.index.document(2)
+
+        offsets, terms = self.index.passages([1, 2, 1], [1, 0, 80], [3, 4, 100])
+
+        self.assertEqual(list(offsets), [0, 2, 6, 14])
+        self.assertEqual(
+            list(terms),
+            list(first_tokens[1:3] + second_tokens[0:4] + first_tokens[80:]))
+
+        offsets, terms, texts = self.index.passages(
+            [1, 1], [1, 5], [3, 5], include_text=True, num_threads=2)
+
+        self.assertEqual(list(offsets), [0, 2, 2])
+        self.assertEqual(texts, ('IPSUM dolor', ''))
+
+        with self.assertRaises(IndexError):
+            self.index.passages([0], [0], [1])
+
+        with self.assertRaises(ValueError):
+            self.index.passages([1], [2], [1])
+
+        with self.assertRaises(ValueError):
+            self.index.passages([1, 2], [0], [1])
+
     def test_document_length(self):
         self.assertEqual(self.index.document_length(1), 88)
         self.assertEqual(self.index.document_length(2), 71)
@@ -202,6 +302,38 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
             self.assertGreaterEqual(id2df[idx], 1)
             self.assertGreaterEqual(id2tf[idx], 1)
 
+    def test_term_stats(self):
+        token2id, id2token, id2df = self.index.get_dictionary()
+        id2tf = self.index.get_term_frequencies()
+
+        terms = ['ipsum', token2id['his'], 'unknownterm', 0, b'lorem',
+                 'ipsum', token2id['his']]
+
+        # The second pass is served from the cache.
+        for _ in range(2):
+            term_ids, dfs, cfs = self.index.term_stats(terms)
+
+            self.assertEqual(
+                list(term_ids),
+                [token2id['ipsum'], token2id['his'], 0, 0,
+                 token2id['lorem'], token2id['ipsum'], token2id['his']])
+
+            self.assertEqual(
+                list(dfs),
+                [id2df.get(term_id, 0) for term_id in term_ids])
+            self.assertEqual(
+                list(cfs),
+                [id2tf.get(term_id, 0) for term_id in term_ids])
+
+        self.assertEqual(
+            self.index.term_count('ipsum'), id2tf[token2id['ipsum']])
+
+        self.assertEqual(
+            [len(values) for values in self.index.term_stats([])], [0, 0, 0])
+
+        with self.assertRaises(TypeError):
+            self.index.term_stats([1.5])
+
     def test_document(self):
         token2id, id2token, id2df = self.index.get_dictionary()
 
@@ -228,6 +360,30 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
              'eget', 'convalli', 'vestibulum', 'nulla', 'integer',
              'vestibulum', 'et', 'sem', 'ac', 'scelerisque'])
 
+    def test_document_as_strings(self):
+        token2id, id2token, _ = self.index.get_dictionary()
+
+        for int_doc_id in range(self.index.document_base(),
+                                self.index.maximum_document()):
+            ext_doc_id, term_ids = self.index.document(int_doc_id)
+
+            self.assertEqual(
+                self.index.document(int_doc_id, as_strings=True),
+                (ext_doc_id, tuple(id2token.get(term_id)
+                                   for term_id in term_ids)))
+
+        # Term strings are shared by all APIs that return terms.
+        _, first_terms = self.index.document(1, as_strings=True)
+
+        self.assertIs(first_terms[0], id2token[token2id['lorem']])
+        self.assertIs(first_terms[0], first_terms[73])
+        self.assertIs(self.index.term(token2id['ipsum']), first_terms[1])
+        self.assertIs(self.index.process_term('Lorem'), first_terms[0])
+
+        # Processing text does not open the index.
+        self.assertEqual(
+            pyndri.Index(self.index_path).process_term('Lorem'), 'lorem')
+
     def test_iter_index(self):
         ext_doc_ids = [
             self.index.document(int_doc_id)[0]
@@ -238,6 +394,362 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
         self.assertEqual(ext_doc_ids,
                          ['lorem', 'hamlet', 'romeo'])
 
+    def test_iter_documents(self):
+        expected = [
+            self.index.document(int_doc_id)[1]
+            for int_doc_id in range(
+                self.index.document_base(),
+                self.index.maximum_document())]
+
+        for batch_size, num_threads in ((1, 1), (2, 1), (1024, 1), (1, 2)):
+            documents = []
+
+            for document_ids, offsets, terms in self.index.iter_documents(
+                    batch_size=batch_size, prefetch=1,
+                    num_threads=num_threads):
+                self.assertLessEqual(len(document_ids), batch_size)
+                self.assertEqual(len(offsets), len(document_ids) + 1)
+
+                self.assertEqual(
+                    (document_ids.format, offsets.format, terms.format),
+                    ('i', 'q', 'i'))
+                self.assertTrue(terms.readonly)
+
+                documents.extend(
+                    tuple(terms[offsets[idx]:offsets[idx + 1]])
+                    for idx in range(len(document_ids)))
+
+            self.assertEqual(documents, expected)
+
+        self.assertEqual(
+            [list(document_ids)
+             for document_ids, _, _ in self.index.iter_documents(
+                 start=2, end=3)],
+            [[2]])
+
+        self.assertEqual(list(self.index.iter_documents(start=3, end=2)), [])
+
+        # Abandoned iterators stop their thread.
+        iterator = self.index.iter_documents(batch_size=1)
+        next(iterator)
+        del iterator
+
+        # Threads can share an iterator; every batch is returned once.
+        iterator = self.index.iter_documents(batch_size=1, num_threads=2)
+
+        with concurrent.futures.ThreadPoolExecutor(max_workers=4) as executor:
+            batches = list(executor.map(
+                lambda _: [tuple(document_ids)
+                           for document_ids, _, _ in iterator],
+                range(4)))
+
+        self.assertEqual(
+            sorted(document_id for batch in batches
+                   for document_ids in batch for document_id in document_ids),
+            list(range(self.index.document_base(),
+                       self.index.maximum_document())))
+
+        self.assertEqual(list(iterator), [])
+
+    def test_term_sampler(self):
+        sampler = pyndri.TermSampler(self.index, seed=42)
+
+        samples = sampler.sample_terms(200000)
+        self.assertEqual(len(samples), 200000)
+
+        id2tf = self.index.get_term_frequencies()
+
+        self.assertTrue(all(term_id in id2tf for term_id in set(samples)))
+
+        # Empirical frequencies follow the unigram distribution to the 0.75.
+        normalizer = sum(tf ** 0.75 for tf in id2tf.values())
+        most_frequent = max(id2tf, key=id2tf.get)
+
+        self.assertAlmostEqual(
+            list(samples).count(most_frequent) / len(samples),
+            id2tf[most_frequent] ** 0.75 / normalizer,
+            delta=0.01)
+
+        # Seeded samplers are reproducible, regardless of the number of threads.
+        self.assertEqual(
+            list(pyndri.TermSampler(self.index, seed=42).sample_terms(
+                200000, num_threads=4)),
+            list(samples))
+
+        self.assertNotEqual(list(sampler.sample_terms(100)),
+                            list(samples[:100]))
+
+        out = array.array('i', [0] * 100)
+        self.assertIs(sampler.sample_terms(out=out), out)
+        self.assertTrue(all(term_id in id2tf for term_id in out))
+
+        with self.assertRaises(TypeError):
+            sampler.sample_terms(out=bytearray(400))
+
+        documents = sampler.sample_documents(1000)
+        self.assertEqual(set(documents), {1, 2, 3})
+
+        with self.assertRaises(TypeError):
+            sampler.sample_terms()
+
+    def test_cooccurrence(self):
+        def count(window, vocabulary_subset=None):
+            counts = collections.Counter()
+
+            for int_doc_id in range(self.index.document_base(),
+                                    self.index.maximum_document()):
+                _, terms = self.index.document(int_doc_id)
+
+                for i, a in enumerate(terms):
+                    for b in terms[i + 1:i + window + 1]:
+                        if a > 0 and b > 0 and (
+                                vocabulary_subset is None or
+                                (a in vocabulary_subset and
+                                 b in vocabulary_subset)):
+                            counts[(a, b)] += 1
+
+                            if a != b:
+                                counts[(b, a)] += 1
+
+            return counts
+
+        def as_dict(cooccurrence):
+            rows, columns, counts = cooccurrence
+
+            return {(row, column): count
+                    for row, column, count in zip(rows, columns, counts)}
+
+        self.assertEqual(as_dict(self.index.cooccurrence(window=2)),
+                         dict(count(2)))
+
+        # Spills to disk with a tiny memory budget.
+        self.assertEqual(
+            as_dict(self.index.cooccurrence(
+                window=5, num_threads=3, memory_budget=1024,
+                spill_dir=self.test_dir)),
+            dict(count(5)))
+
+        token2id, _, _ = self.index.get_dictionary()
+        vocabulary_subset = {token2id['lorem'], token2id['ipsum'],
+                             token2id['nulla'], token2id['eget']}
+
+        self.assertEqual(
+            as_dict(self.index.cooccurrence(
+                window=10, vocabulary_subset=vocabulary_subset)),
+            dict(count(10, vocabulary_subset)))
+
+        self.assertEqual(
+            as_dict(self.index.cooccurrence(window=5, min_count=3)),
+            {pair: value for pair, value in count(5).items() if value >= 3})
+
+    def test_bag_of_words(self):
+        def as_rows(csr):
+            data, indices, indptr = csr
+
+            return [
+                list(zip(indices[indptr[row]:indptr[row + 1]],
+                         data[indptr[row]:indptr[row + 1]]))
+                for row in range(len(indptr) - 1)]
+
+        dictionary = pyndri.extract_dictionary(self.index)
+
+        expected = [
+            dictionary.doc2bow(self.index.document(int_doc_id)[1])
+            for int_doc_id in range(self.index.document_base(),
+                                    self.index.maximum_document())]
+
+        self.assertEqual(as_rows(self.index.bag_of_words()), expected)
+        self.assertEqual(
+            as_rows(dictionary.corpus2csr(self.index, num_threads=2)),
+            expected)
+        self.assertEqual(
+            as_rows(self.index.bag_of_words(start=2, end=3)),
+            expected[1:2])
+
+        # Contiguous identifiers restricted to the most frequent terms.
+        dictionary, indri_id2cid = pyndri.extract_dictionary(
+            self.index, max_terms=10, make_contiguous=True)
+
+        self.assertEqual(
+            as_rows(dictionary.corpus2csr(self.index, num_threads=3)),
+            [dictionary.doc2bow(
+                indri_id2cid[token_id]
+                for token_id in self.index.document(int_doc_id)[1]
+                if token_id in indri_id2cid)
+             for int_doc_id in range(self.index.document_base(),
+                                     self.index.maximum_document())])
+
+    def test_score_documents(self):
+        token2id, _, _ = self.index.get_dictionary()
+
+        # Matches Indri's default Dirichlet language model.
+        for query in ('his', 'ipsum', 'his ipsum'):
+            term_ids = [token2id[term] for term in query.split()]
+
+            for int_doc_id, score in self.index.query(query):
+                self.assertAlmostEqual(
+                    self.index.score_documents(term_ids, [int_doc_id])[0],
+                    score)
+
+        scores = self.index.score_documents(
+            [token2id['his']], [3, 1, 2, 3], num_threads=2)
+
+        self.assertEqual(len(scores), 4)
+        self.assertAlmostEqual(scores[0], -5.972370287143733)
+        self.assertAlmostEqual(scores[2], -5.794010932279138)
+        self.assertEqual(scores[0], scores[3])
+        self.assertLess(scores[1], scores[0])
+
+        # BM25 only rewards matching terms.
+        scores = self.index.score_documents(
+            [token2id['his'], None], [1, 2, 3],
+            model='bm25', params={'k1': 1.2, 'b': 0.75})
+
+        self.assertEqual(scores[0], 0.0)
+        self.assertNotEqual(scores[1], 0.0)
+
+        self.assertEqual(
+            len(self.index.score_documents(
+                [token2id['his']], [1, 2], model='jm', params={'lambda': 0.5})),
+            2)
+
+        with self.assertRaises(ValueError):
+            self.index.score_documents([1], [1], model='unknown')
+
+        with self.assertRaises(ValueError):
+            self.index.score_documents([1], [1], params={'alpha': 1.0})
+
+    def test_sweep(self):
+        token2id, _, _ = self.index.get_dictionary()
+
+        term_ids = [token2id['his'], token2id['ipsum']]
+        params = [{'mu': 10.0}, {'mu': 2500.0}, {'mu': 10000.0}]
+
+        for num_threads in (1, 2):
+            rankings = self.index.sweep(
+                term_ids, params, num_threads=num_threads)
+
+            self.assertEqual(len(rankings), len(params))
+
+            for ranking, config in zip(rankings, params):
+                int_doc_ids = [int_doc_id for int_doc_id, _ in ranking]
+
+                # Every document that contains a query term is ranked.
+                self.assertEqual(sorted(int_doc_ids), [1, 2, 3])
+
+                scores = self.index.score_documents(
+                    term_ids, int_doc_ids, params=config)
+
+                for (_, score), expected_score in zip(ranking, scores):
+                    self.assertAlmostEqual(score, expected_score)
+
+                self.assertEqual(
+                    [score for _, score in ranking],
+                    sorted((score for _, score in ranking), reverse=True))
+
+        # Matches Indri's default Dirichlet language model.
+        (ranking,) = self.index.sweep([token2id['his']], [{}])
+
+        for (int_doc_id, score), (expected_int_doc_id, expected_score) in \
+                zip(ranking, self.index.query('his')):
+            self.assertEqual(int_doc_id, expected_int_doc_id)
+            self.assertAlmostEqual(score, expected_score)
+
+        rankings = self.index.sweep(
+            [token2id['his']],
+            [{'k1': 1.2, 'b': 0.75}, {'k1': 2.0, 'b': 0.5}],
+            model='bm25', results_requested=1)
+
+        self.assertEqual([len(ranking) for ranking in rankings], [1, 1])
+
+        self.assertEqual(self.index.sweep([None], [{}]), ((),))
+
+        with self.assertRaises(ValueError):
+            self.index.sweep(term_ids, [{'alpha': 1.0}])
+
+    def test_document_embeddings(self):
+        _, _, id2df = self.index.get_dictionary()
+
+        dim = 5
+        num_terms = self.index.unique_terms() + 1
+
+        values = array.array('f', (
+            float((term_id * 7 + d) % 11) - 5.0
+            for term_id in range(num_terms) for d in range(dim)))
+        embeddings = memoryview(values).cast('B').cast('f', (num_terms, dim))
+
+        num_documents = self.index.document_count()
+
+        def expected_centroid(int_doc_id, tfidf):
+            centroid = [0.0] * dim
+            total_weight = 0.0
+
+            for term_id in self.index.document(int_doc_id)[1]:
+                if term_id <= 0:
+                    continue
+
+                weight = math.log(num_documents / id2df[term_id]) \
+                    if tfidf else 1.0
+
+                for d in range(dim):
+                    centroid[d] += weight * values[term_id * dim + d]
+
+                total_weight += weight
+
+            return [value / total_weight if total_weight > 0 else 0.0
+                    for value in centroid]
+
+        for weighting in ('tf', 'tfidf'):
+            centroids = self.index.document_embeddings(
+                embeddings, weighting=weighting, num_threads=2)
+
+            self.assertEqual(len(centroids), num_documents * dim)
+
+            for row, int_doc_id in enumerate(
+                    range(self.index.document_base(),
+                          self.index.maximum_document())):
+                for value, expected_value in zip(
+                        centroids[row * dim:(row + 1) * dim],
+                        expected_centroid(int_doc_id, weighting == 'tfidf')):
+                    self.assertAlmostEqual(value, expected_value, places=4)
+
+        self.assertEqual(
+            self.index.document_embeddings(embeddings, document_ids=[3, 1]).tolist(),
+            self.index.document_embeddings(embeddings, start=3, end=4).tolist() +
+            self.index.document_embeddings(embeddings, start=1, end=2).tolist())
+
+        with self.assertRaises(TypeError):
+            self.index.document_embeddings(values)
+
+        with self.assertRaises(ValueError):
+            self.index.document_embeddings(embeddings, weighting='bm25')
+
+    def test_cosine_similarity(self):
+        vectors = memoryview(array.array('f', [
+            1.0, 0.0, 0.0,
+            0.0, 2.0, 0.0,
+            1.0, 1.0, 0.0,
+            0.0, 0.0, 0.0])).cast('B').cast('f', (4, 3))
+        queries = memoryview(array.array('f', [
+            3.0, 0.0, 0.0,
+            0.0, 1.0, 1.0])).cast('B').cast('f', (2, 3))
+
+        similarities = pyndri.cosine_similarity(
+            vectors, queries, num_threads=2)
+
+        expected = [1.0, 0.0, math.sqrt(0.5), 0.0,
+                    0.0, math.sqrt(0.5), 0.5, 0.0]
+
+        self.assertEqual(len(similarities), len(expected))
+
+        for similarity, expected_similarity in zip(similarities, expected):
+            self.assertAlmostEqual(similarity, expected_similarity, places=6)
+
+        with self.assertRaises(ValueError):
+            pyndri.cosine_similarity(
+                vectors, memoryview(array.array('f', [1.0, 0.0])).cast(
+                    'B').cast('f', (1, 2)))
+
     def test_query_environment(self):
         env = pyndri.QueryEnvironment(
             self.index,
@@ -265,6 +777,203 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
             ((3, -5.902633333401366),
              (2, -5.902633333401366)))
 
+    def test_query_priors(self):
+        priors_path = os.path.join(self.test_dir, 'priors')
+
+        with open(priors_path, 'wb') as f:
+            # Indexed by internal document identifier.
+            array.array('f', [0.0, 0.0, 0.0, 1.0]).tofile(f)
+
+        query_env = pyndri.QueryEnvironment(self.index, priors=priors_path)
+
+        results = query_env.query('his', results_requested=1)
+
+        self.assertEqual(len(results), 1)
+        self.assertEqual(results[0][0], 3)
+        self.assertAlmostEqual(results[0][1], -5.972370287143733 + 1.0)
+
+        self.assertEqual(
+            [int_doc_id for int_doc_id, _ in query_env.query('his')],
+            [3, 2])
+
+        self.assertEqual(
+            pyndri.QueryEnvironment(
+                self.index, priors=priors_path, prior_weight=0.0).query('his'),
+            self.index.query('his'))
+
+        # Known bounds avoid scanning the priors.
+        self.assertEqual(
+            pyndri.QueryEnvironment(
+                self.index, priors=priors_path,
+                prior_bounds=(0.0, 1.0)).query('his', results_requested=1),
+            results)
+
+        # Loose bounds cost more evaluations, but results remain exact.
+        self.assertEqual(
+            pyndri.QueryEnvironment(
+                self.index, priors=priors_path,
+                prior_bounds=(-1000.0, 1000.0)).query('his',
+                                                      results_requested=1),
+            results)
+
+        with self.assertRaises(ValueError):
+            pyndri.QueryEnvironment(
+                self.index, priors=priors_path, prior_bounds=(1.0, 0.0))
+
+        with self.assertRaises(IOError):
+            pyndri.QueryEnvironment(
+                self.index, priors=os.path.join(self.test_dir, 'missing'))
+
+    def test_query_instrumentation(self):
+        env = pyndri.QueryEnvironment(self.index, instrument=True)
+
+        self.assertEqual(env.stats['queries'], 0)
+        self.assertIsNone(env.stats['last_query'])
+
+        env.query('his', include_snippets=True)
+
+        stats = env.stats
+
+        self.assertEqual(stats['queries'], 1)
+
+        last_query = stats['last_query']
+
+        self.assertEqual(last_query['results'], 2)
+        self.assertEqual(last_query['postings_touched'], 2)
+        self.assertEqual(last_query['documents_scored'], 2)
+        self.assertGreater(last_query['snippet_bytes_decompressed'], 0)
+
+        self.assertEqual(
+            set(last_query['phase_seconds']),
+            {'parse', 'evaluate', 'fetch_documents', 'snippets',
+             'conversion'})
+        self.assertAlmostEqual(
+            last_query['total_seconds'],
+            sum(last_query['phase_seconds'].values()))
+
+        self.assertEqual(stats['histograms']['total']['count'], 1)
+        self.assertEqual(sum(stats['histograms']['evaluate']['counts']), 1)
+
+        env.query('his ipsum', document_set=[1])
+
+        last_query = env.stats['last_query']
+
+        self.assertEqual(last_query['postings_touched'], 3)
+        self.assertEqual(last_query['documents_scored'], 1)
+        self.assertEqual(env.stats['totals']['postings_touched'], 5)
+        self.assertEqual(env.stats['totals']['documents_scored'], 3)
+
+        env.instrument = False
+        env.query('his')
+
+        self.assertEqual(env.stats['queries'], 2)
+
+        env.reset_stats()
+
+        self.assertEqual(env.stats['queries'], 0)
+
+    def test_query_async(self):
+        env = pyndri.QueryEnvironment(self.index, num_workers=2)
+
+        async def run_queries():
+            return await asyncio.gather(
+                env.query_async('ipsum'),
+                env.query_async('his', results_requested=1),
+                env.query_async('his', include_snippets=True))
+
+        loop = asyncio.new_event_loop()
+
+        try:
+            ipsum_results, his_results, snippet_results = \
+                loop.run_until_complete(run_queries())
+        finally:
+            loop.close()
+
+        self.assertEqual(ipsum_results, self.index.query('ipsum'))
+        self.assertEqual(his_results, ((2, -5.794010932279138),))
+        self.assertEqual(
+            snippet_results,
+            self.index.query('his', include_snippets=True))
+
+    def test_query_deadline(self):
+        for query_str in ('his', 'ipsum', 'his ipsum'):
+            self.assertEqual(
+                self.index.query(query_str, timeout_ms=60000),
+                self.index.query(query_str))
+
+            self.assertEqual(
+                self.index.query(query_str, timeout_ms=60000,
+                                 allow_partial=True),
+                (self.index.query(query_str), False))
+
+        self.assertEqual(
+            self.index.query('his', include_snippets=True, timeout_ms=60000),
+            self.index.query('his', include_snippets=True))
+
+        self.assertEqual(
+            self.index.query('his', document_set=[3], timeout_ms=60000),
+            self.index.query('his', document_set=[3]))
+
+        with self.assertRaises(TimeoutError):
+            self.index.query('his', timeout_ms=0)
+
+        self.assertEqual(
+            self.index.query('his', timeout_ms=0, allow_partial=True),
+            ((), True))
+
+        self.assertEqual(
+            self.index.query('his', document_set=[2, 3], timeout_ms=0,
+                             allow_partial=True),
+            ((), True))
+
+        # Evaluating the first chunk (i.e., the first document) of this query
+        # takes longer than the deadline, hence evaluation of the collection
+        # stops before it reaches the only matching document.
+        slow_query_str = '#syn({})'.format(' '.join(['his'] * 20000))
+
+        results, partial = self.index.query(
+            slow_query_str, timeout_ms=1, allow_partial=True)
+
+        self.assertTrue(partial)
+        self.assertLess(len(results), len(self.index.query(slow_query_str)))
+
+        token = pyndri.CancellationToken()
+
+        self.assertEqual(
+            self.index.query('his', cancellation_token=token),
+            self.index.query('his'))
+
+        token.cancel()
+
+        with self.assertRaises(InterruptedError):
+            self.index.query('his', cancellation_token=token)
+
+        self.assertEqual(
+            self.index.query('his', cancellation_token=token,
+                             allow_partial=True),
+            ((), True))
+
+        with self.assertRaises(ValueError):
+            self.index.query('his', timeout_ms=-1)
+
+    def test_query_async_cancelled(self):
+        env = pyndri.QueryEnvironment(self.index)
+
+        token = pyndri.CancellationToken()
+        token.cancel()
+
+        self.assertTrue(token.cancelled)
+
+        loop = asyncio.new_event_loop()
+
+        try:
+            self.assertRaises(
+                asyncio.CancelledError,
+                loop.run_until_complete,
+                env.query_async('ipsum', cancellation_token=token))
+        finally:
+            loop.close()
+
     def test_tfidf(self):
         env = pyndri.TFIDFQueryEnvironment(self.index)
 
@@ -289,6 +998,187 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
             ((3, -0.3292246306130194),
              (2, -0.7195255702901702)))
 
+    def test_similar_documents(self):
+        env = pyndri.QueryEnvironment(self.index, num_workers=2)
+        token2id, id2token, id2df = self.index.get_dictionary()
+
+        num_documents = self.index.document_count()
+        seeds = list(range(self.index.document_base(),
+                           self.index.maximum_document()))
+
+        def similar_documents(seed, num_terms, results_requested):
+            _, term_ids = self.index.document(seed)
+
+            weights = {
+                term_id: term_ids.count(term_id) *
+                math.log(num_documents / id2df[term_id])
+                for term_id in set(term_ids) if term_id > 0}
+
+            selected = sorted(
+                (term_id for term_id in weights if weights[term_id] > 0),
+                key=lambda term_id: (-weights[term_id], term_id))[:num_terms]
+
+            if not selected:
+                return ()
+
+            query_str = '#weight( {} )'.format(' '.join(
+                '{:.6f} {}'.format(weights[term_id], id2token[term_id])
+                for term_id in selected))
+
+            return tuple(
+                result for result in env.query(
+                    query_str, results_requested=results_requested + 1)
+                if result[0] != seed)[:results_requested]
+
+        for num_threads in (1, 2):
+            results = env.similar_documents(
+                seeds, num_terms=5, results_requested=2,
+                num_threads=num_threads)
+
+            self.assertEqual(len(results), len(seeds))
+
+            for seed, seed_results in zip(seeds, results):
+                expected = similar_documents(seed, 5, 2)
+
+                self.assertEqual([int_doc_id for int_doc_id, _ in seed_results],
+                                 [int_doc_id for int_doc_id, _ in expected])
+
+                for (_, score), (_, expected_score) in zip(
+                        seed_results, expected):
+                    self.assertAlmostEqual(score, expected_score, places=5)
+
+        ((first_result,),) = env.similar_documents(
+            [1], num_terms=5, results_requested=1, include_seeds=True)
+        self.assertEqual(first_result[0], 1)
+
+        with self.assertRaises(IndexError):
+            env.similar_documents([0])
+
+        with self.assertRaises(ValueError):
+            env.similar_documents([1], num_terms=0)
+
+    def test_fuse(self):
+        envs = [pyndri.TFIDFQueryEnvironment(self.index),
+                pyndri.OkapiQueryEnvironment(self.index)]
+        weights = (2.0, 1.0)
+
+        def normalize(results):
+            scores = [score for _, score in results]
+            minimum, maximum = min(scores), max(scores)
+
+            return [
+                (int_doc_id, (score - minimum) / (maximum - minimum)
+                 if maximum > minimum else 1.0)
+                for int_doc_id, score in results]
+
+        for query_str in ('his', 'ipsum', 'his ipsum'):
+            combsum = collections.defaultdict(float)
+            rrf = collections.defaultdict(float)
+
+            for env, weight in zip(envs, weights):
+                results = env.query(query_str)
+
+                for int_doc_id, score in normalize(results):
+                    combsum[int_doc_id] += weight * score
+
+                for rank, (int_doc_id, _) in enumerate(results, 1):
+                    rrf[int_doc_id] += weight / (60.0 + rank)
+
+            for method, expected in (('combsum', combsum), ('rrf', rrf)):
+                expected = sorted(expected.items(),
+                                  key=lambda item: (-item[1], item[0]))
+
+                document_ids, scores = pyndri.fuse(
+                    envs, query_str, method=method, weights=weights)
+
+                self.assertEqual(
+                    list(document_ids),
+                    [int_doc_id for int_doc_id, _ in expected])
+
+                for score, (_, expected_score) in zip(scores, expected):
+                    self.assertAlmostEqual(score, expected_score)
+
+        # CombMNZ rewards documents retrieved by both environments.
+        document_ids, scores = pyndri.fuse(
+            envs, 'his ipsum', method='combmnz', normalization='none',
+            results_requested=1)
+
+        self.assertEqual(len(document_ids), 1)
+
+        document_ids, _ = pyndri.fuse(
+            envs + [pyndri.PRFQueryEnvironment(envs[0])], 'his')
+
+        self.assertEqual(sorted(document_ids), [2, 3])
+
+        document_ids, _ = pyndri.fuse(envs, 'his', document_set=[3])
+
+        self.assertEqual(list(document_ids), [3])
+
+        with self.assertRaises(TypeError):
+            pyndri.fuse([self.index], 'his')
+
+        with self.assertRaises(ValueError):
+            pyndri.fuse(envs, 'his', method='borda')
+
+    def test_evaluate(self):
+        qrels = pyndri.Qrels(self.index, {
+            '1': {'hamlet': 1, 'romeo': 2},
+            2: {'lorem': 1, 'missing': 1},
+        })
+
+        self.assertEqual(sorted(qrels.topics()), ['1', '2'])
+
+        results = {
+            '1': ((3, -1.0), (1, -2.0), (2, -3.0)),
+            '2': (1,),
+            '3': ((1, 0.0),),  # Not judged.
+        }
+
+        measures = ('map', 'mrr', 'p@2', 'recall@2', 'ndcg@3', 'map@1')
+
+        means, per_topic = qrels.evaluate(results, measures, per_topic=True)
+
+        expected = {
+            '1': {'map': (1.0 + 2.0 / 3.0) / 2.0,
+                  'mrr': 1.0,
+                  'p@2': 0.5,
+                  'recall@2': 0.5,
+                  'ndcg@3': 2.5 / (2.0 + 1.0 / math.log2(3.0)),
+                  'map@1': 0.5},
+            '2': {'map': 0.5,
+                  'mrr': 1.0,
+                  'p@2': 0.5,
+                  'recall@2': 0.5,
+                  'ndcg@3': 1.0 / (1.0 + 1.0 / math.log2(3.0)),
+                  'map@1': 0.5},
+        }
+
+        self.assertEqual(sorted(per_topic), ['1', '2'])
+
+        for measure in measures:
+            for topic_id in ('1', '2'):
+                self.assertAlmostEqual(per_topic[topic_id][measure],
+                                       expected[topic_id][measure])
+
+            self.assertAlmostEqual(
+                means[measure],
+                (expected['1'][measure] + expected['2'][measure]) / 2.0)
+
+        self.assertEqual(
+            qrels.evaluate(results, measures, num_threads=4), means)
+
+        # Array-backed rankings, as returned by fuse.
+        document_ids = array.array('i', [3, 1, 2])
+        self.assertEqual(
+            qrels.evaluate({'1': (memoryview(document_ids), None)}, ['map']),
+            {'map': expected['1']['map']})
+
+        with self.assertRaises(ValueError):
+            qrels.evaluate(results, ['p'])
+
+        with self.assertRaises(ValueError):
+            qrels.evaluate(results, ['bpref'])
+
     def test_tokenize(self):
         self.assertEqual(
             self.index.tokenize('hello world foo bar'),
@@ -334,12 +1224,256 @@ ACT I  PROLOGUE  Two households, both alike in dignity, In fair Verona, where we
 
         self.assertEqual(len(results), 2)
 
-    def tearDown(self):
-        shutil.rmtree(self.test_dir)
-        del self.index
-        self.index = None
+    def test_build_index_from_files(self):
+        index_path = os.path.join(self.test_dir, 'parallel-index')
+
+        num_documents = pyndri.build_index(
+            index_path,
+            [os.path.join(self.test_dir, 'corpus.trectext')],
+            num_workers=2)
+
+        self.assertEqual(num_documents, 3)
+
+        with pyndri.open(index_path) as index:
+            self.assertEqual(len(index), 3)
+
+            self.assertEqual(
+                [index.ext_document_id(int_doc_id)
+                 for int_doc_id in range(index.document_base(),
+                                         index.maximum_document())],
+                ['lorem', 'hamlet', 'romeo'])
+
+            self.assertEqual(index.query('ipsum'), self.index.query('ipsum'))
+            self.assertEqual(index.query('his'), self.index.query('his'))
+
+    def test_build_index_from_documents(self):
+        index_path = os.path.join(self.test_dir, 'parallel-index')
+
+        documents = [
+            ('first', 'hello world'),
+            ('second', 'hello there'),
+            ('third', 'general kenobi'),
+        ]
+
+        num_documents = pyndri.build_index(
+            index_path, iter(documents), num_workers=2)
+
+        self.assertEqual(num_documents, 3)
+
+        with pyndri.open(index_path) as index:
+            self.assertEqual(len(index), 3)
+
+            self.assertEqual(
+                sorted(index.ext_document_id(int_doc_id)
+                       for int_doc_id, _ in index.query('hello')),
+                ['first', 'second'])
+
+        # A failing worker stops its queue from draining; the producer should
+        # notice instead of blocking forever.
+        documents = [('invalid', None)] + [
+            ('doc{}'.format(idx), 'hello world')
+            for idx in range(pyndri.build.DOCUMENTS_PER_BATCH * 16)]
+
+        with self.assertRaises(RuntimeError):
+            pyndri.build_index(
+                os.path.join(self.test_dir, 'failed-index'),
+                iter(documents), num_workers=2)
+
+    def test_warm_up(self):
+        self.assertEqual(
+            self.index.warm_up_progress(),
+            {'bytes_done': 0, 'bytes_total': 0, 'bytes_locked': 0,
+             'running': False, 'error': None})
+
+        num_bytes = self.index.warm_up()
+        self.assertGreater(num_bytes, 0)
+
+        progress = self.index.warm_up_progress()
+        self.assertEqual(progress['bytes_done'], num_bytes)
+        self.assertEqual(progress['bytes_total'], num_bytes)
+        self.assertFalse(progress['running'])
+        self.assertIsNone(progress['error'])
+
+        self.assertGreater(
+            self.index.warm_up(components=['vocabulary', 'collection']), 0)
+
+        self.assertIsNone(self.index.warm_up(components=[]))
+
+        with self.assertRaises(ValueError):
+            self.index.warm_up(components=['unknown'])
+
+        with pyndri.open(self.index_path, warm_up=True) as index:
+            index.warm_up(components=['lengths'])
+
+            self.assertFalse(index.warm_up_progress()['running'])
+            self.assertEqual(index.document_length(3), 573)
+
+    def test_shared_tables(self):
+        with pyndri.open(self.index_path, shared_tables=True) as index:
+            self.assertEqual(list(index.document_lengths()[1:]),
+                             [88, 71, 573])
+
+            for int_doc_id in range(index.document_base(),
+                                    index.maximum_document()):
+                self.assertEqual(index.ext_document_id(int_doc_id),
+                                 self.index.ext_document_id(int_doc_id))
+                self.assertEqual(index.document(int_doc_id),
+                                 self.index.document(int_doc_id))
+
+            self.assertEqual(index.get_dictionary(),
+                             self.index.get_dictionary())
+            self.assertEqual(index.get_term_frequencies(),
+                             self.index.get_term_frequencies())
+
+            token2id, id2token, _ = index.get_dictionary()
+
+            for term_id, term in id2token.items():
+                self.assertEqual(index.term(term_id), term)
+                self.assertEqual(self.index.term(term_id), term)
+
+            with self.assertRaises(IndexError):
+                index.term(0)
+
+        with self.assertRaises(RuntimeError):
+            self.index.document_lengths()
+
+        # The lengths remain valid after the last reference to the Index.
+        document_lengths = pyndri.Index(
+            self.index_path, shared_tables=True).document_lengths()
+
+        gc.collect()
+
+        self.assertEqual(document_lengths.format, 'i')
+        self.assertEqual(list(document_lengths[1:]), [88, 71, 573])
+
+    @unittest.skipUnless(hasattr(os, 'fork'), 'requires fork')
+    def test_fork(self):
+        expected = self.index.query('his')
+
+        read_fd, write_fd = os.pipe()
+
+        pid = os.fork()
+
+        if pid == 0:
+            os.close(read_fd)
+
+            try:
+                ok = self.index.query('his') == expected and \
+                    self.index.document(1)[0] == 'lorem'
+            except Exception:
+                ok = False
+
+            os.write(write_fd, b'1' if ok else b'0')
+            os._exit(0)
+
+        os.close(write_fd)
+
+        with os.fdopen(read_fd, 'rb') as f:
+            self.assertEqual(f.read(), b'1')
+
+        os.waitpid(pid, 0)
+
+        self.assertEqual(self.index.query('his'), expected)
+
+    def test_threads(self):
+        def work(_):
+            return (self.index.query('his'),
+                    self.index.document(1),
+                    self.index.term_stats(['his', 'ipsum']),
+                    list(self.index.iter_documents()))
+
+        expected = work(None)
+
+        with concurrent.futures.ThreadPoolExecutor(8) as executor:
+            for result in executor.map(work, range(64)):
+                self.assertEqual(result, expected)
+
+    def test_heap_types(self):
+        self.assertEqual(pyndri.CancellationToken.__module__, 'pyndri')
+
+        if sys.version_info >= (3, 10):
+            with self.assertRaises(TypeError):
+                pyndri.CancellationToken.foo = None
+
+        with self.assertRaises(TypeError):
+            type(self.index.iter_documents())()
+
+
+class FieldTest(IndexTest):
+
+    CORPUS = """<DOC>
+<DOCNO>first</DOCNO>
+<TEXT>
+<TITLE>hello world</TITLE>
+<BODY>the world says hello to the world</BODY>
+</TEXT>
+</DOC>
+<DOC>
+<DOCNO>second</DOCNO>
+<TEXT>
+<TITLE>goodbye</TITLE>
+<BODY>hello there</BODY>
+</TEXT>
+</DOC>
+"""
+
+    INDRI_CONFIG = """<parameters>
+<index>index/</index>
+<memory>1024M</memory>
+<storeDocs>true</storeDocs>
+<corpus><path>corpus.trectext</path><class>trectext</class></corpus>
+<field><name>title</name></field>
+<field><name>body</name></field>
+</parameters>"""
+
+    def test_fields(self):
+        self.assertEqual(sorted(self.index.fields()), ['body', 'title'])
+
+        statistics = self.index.field_statistics(
+            'title', terms=('hello', 'goodbye', 'there'))
+
+        self.assertEqual(statistics['term_count'], 3)
+        self.assertEqual(statistics['document_count'], 2)
+        self.assertEqual(statistics['term_counts'], (1, 1, 0))
+        self.assertEqual(statistics['term_document_counts'], (1, 1, 0))
+
+        with self.assertRaises(KeyError):
+            self.index.field_statistics('author')
+
+    def test_field_extents(self):
+        offsets, begins, ends = self.index.field_extents([1, 2], 'title')
+
+        self.assertEqual(list(offsets), [0, 1, 2])
+        self.assertEqual(list(zip(begins, ends)), [(0, 2), (0, 1)])
+
+        offsets, begins, ends = self.index.field_extents(
+            [2, 1], 'body', num_threads=2)
+
+        self.assertEqual(list(offsets), [0, 1, 2])
+        self.assertEqual(list(zip(begins, ends)), [(1, 3), (2, 9)])
+
+    def test_field_lengths(self):
+        self.assertEqual(list(self.index.field_lengths('title')), [0, 2, 1])
+        self.assertEqual(
+            list(self.index.field_lengths('body', document_ids=[2, 1],
+                                          num_threads=2)),
+            [2, 7])
+
+    def test_field_term_counts(self):
+        token2id, _, _ = self.index.get_dictionary()
+
+        term_ids = [token2id['hello'], token2id['world'], token2id['there']]
+
+        self.assertEqual(
+            list(self.index.field_term_counts([1, 2], term_ids, 'body')),
+            [1, 2, 0,
+             1, 0, 1])
+
+        self.assertEqual(
+            list(self.index.field_term_counts([1, 2], term_ids, 'title')),
+            [1, 1, 0,
+             0, 0, 0])
 
-        super(IndriTest, self).tearDown()
 
 if __name__ == '__main__':
     unittest.main()